@@ -0,0 +1,281 @@
+/*
+Purpose:    AVL_map class declaration - an ordered key to value map built on AVL_tree.
+*/
+
+#ifndef AVL_MAP_H
+#define AVL_MAP_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <utility>
+#ifdef DEBUG
+#include <string>
+#endif // ifdef DEBUG
+
+#include "AVL_tree.hpp"
+
+/**
+ * @brief Node content of an AVL_map. Only the key takes part in comparisons, and comes first so
+ * that a search reads the start of each node.
+ *
+ * @note second is mutable - it can be changed through the map's (const) iterators, since the
+ * order only depends on first.
+ */
+template <typename K, typename V>
+struct AVL_map_entry {
+    template <typename KK, typename... Args>
+    AVL_map_entry(std::in_place_t, KK&& key, Args&&... args):
+        first(std::forward<KK>(key)),
+        second(std::forward<Args>(args)...)
+    {
+    }
+
+    K first;
+    mutable V second;
+};
+
+/**
+ * @brief Orders AVL_map entries by key, and lets AVL_tree look entries up by key (or by any
+ * type a transparent Compare accepts).
+ */
+template <typename K, typename V, typename Compare>
+struct AVL_map_compare {
+    using is_transparent = void;
+    using entry = AVL_map_entry<K, V>;
+
+    bool operator()(entry const& lhs, entry const& rhs) const
+    {
+        return m_compare(lhs.first, rhs.first);
+    }
+
+    template <typename L>
+        requires AVL_lookup_key<L, K, Compare>
+    bool operator()(L const& lhs, entry const& rhs) const
+    {
+        return m_compare(lhs, rhs.first);
+    }
+
+    template <typename L>
+        requires AVL_lookup_key<L, K, Compare>
+    bool operator()(entry const& lhs, L const& rhs) const
+    {
+        return m_compare(lhs.first, rhs);
+    }
+
+    template <typename L>
+        requires AVL_lookup_key<L, K, Compare>
+    bool operator()(L const& lhs, L const& rhs) const
+    {
+        return m_compare(lhs, rhs);
+    }
+
+    [[no_unique_address]] Compare m_compare {};
+};
+
+/**
+ * @brief Ordered map of unique keys to values, an AVL_tree of AVL_map_entry nodes whose
+ * comparator only looks at the keys.
+ *
+ * Values are updated in place through operator[], insert_or_assign() or the second member of
+ * an entry found by find(), without removing and adding nodes. Rotations relink nodes, so
+ * values never move once constructed.
+ */
+template <typename K,
+    typename V,
+    typename Compare = std::less<K>,
+    typename Allocator = std::allocator<AVL_map_entry<K, V>>>
+    requires AVL_comparator<Compare, K>
+class AVL_map {
+    using entry_compare = AVL_map_compare<K, V, Compare>;
+    // Keys are unique, so the nodes need no count.
+    using tree_type = AVL_tree<AVL_map_entry<K, V>, entry_compare, Allocator, AVL_set_traits>;
+
+    template <typename L>
+    static constexpr bool is_lookup_key = AVL_lookup_key<L, K, Compare>;
+
+public:
+    using key_type = K;
+    using mapped_type = V;
+    using value_type = AVL_map_entry<K, V>;
+    using key_compare = Compare;
+    using size_type = size_t;
+    using allocator_type = Allocator;
+    using const_iterator = typename tree_type::const_iterator;
+    using iterator = const_iterator;
+
+    AVL_map() = default;
+    explicit AVL_map(Compare const& compare, Allocator const& alloc = Allocator()):
+        m_tree(entry_compare { compare }, alloc)
+    {
+    }
+
+    /**
+     * @brief The value of key, default constructed first if key is not in the map.
+     */
+    V& operator[](K const& key)
+    {
+        return try_emplace(key).first->second;
+    }
+
+    V& operator[](K&& key)
+    {
+        return try_emplace(std::move(key)).first->second;
+    }
+
+    /**
+     * @brief Adds key with a value constructed from args, unless key is in the map already.
+     * args are only used if the entry is added.
+     *
+     * @returns Iterator to the entry of key, and whether it was added.
+     */
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(K const& key, Args&&... args)
+    {
+        auto result = m_tree.try_emplace(key, std::in_place, key, std::forward<Args>(args)...);
+        m_size += result.second ? 1 : 0;
+        return result;
+    }
+
+    /**
+     * @brief try_emplace, moving from key only if the entry is added.
+     */
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(K&& key, Args&&... args)
+    {
+        auto result =
+            m_tree.try_emplace(key, std::in_place, std::move(key), std::forward<Args>(args)...);
+        m_size += result.second ? 1 : 0;
+        return result;
+    }
+
+    /**
+     * @brief Adds key with value, or assigns value to the existing entry of key.
+     *
+     * @returns Iterator to the entry of key, and whether it was added.
+     */
+    template <typename M>
+    std::pair<iterator, bool> insert_or_assign(K const& key, M&& value)
+    {
+        auto result = try_emplace(key, std::forward<M>(value));
+        if (!result.second) {
+            result.first->second = std::forward<M>(value);
+        }
+        return result;
+    }
+
+    template <typename M>
+    std::pair<iterator, bool> insert_or_assign(K&& key, M&& value)
+    {
+        auto result = try_emplace(std::move(key), std::forward<M>(value));
+        if (!result.second) {
+            result.first->second = std::forward<M>(value);
+        }
+        return result;
+    }
+
+    avl_statuses erase(K const& key)
+    {
+        return erase<K>(key);
+    }
+
+    template <typename L>
+        requires is_lookup_key<L>
+    avl_statuses erase(L const& key)
+    {
+        auto status = m_tree.remove(key);
+        m_size -= (status == avl_statuses::SUCCESS) ? 1 : 0;
+        return status;
+    }
+
+    /**
+     * @brief The entry of key, end() if key is not in the map. Its second can be updated in
+     * place.
+     */
+    iterator find(K const& key) const
+    {
+        return m_tree.find(key);
+    }
+
+    template <typename L>
+        requires is_lookup_key<L>
+    iterator find(L const& key) const
+    {
+        return m_tree.find(key);
+    }
+
+    bool contains(K const& key) const
+    {
+        return m_tree.contains(key);
+    }
+
+    template <typename L>
+        requires is_lookup_key<L>
+    bool contains(L const& key) const
+    {
+        return m_tree.contains(key);
+    }
+
+    iterator lower_bound(K const& key) const
+    {
+        return m_tree.lower_bound(key);
+    }
+
+    template <typename L>
+        requires is_lookup_key<L>
+    iterator lower_bound(L const& key) const
+    {
+        return m_tree.lower_bound(key);
+    }
+
+    iterator upper_bound(K const& key) const
+    {
+        return m_tree.upper_bound(key);
+    }
+
+    template <typename L>
+        requires is_lookup_key<L>
+    iterator upper_bound(L const& key) const
+    {
+        return m_tree.upper_bound(key);
+    }
+
+    bool empty() const
+    {
+        return m_size == 0;
+    }
+
+    size_type size() const
+    {
+        return m_size;
+    }
+
+    void clear()
+    {
+        m_tree.clear();
+        m_size = 0;
+    }
+
+    iterator begin() const
+    {
+        return m_tree.begin();
+    }
+
+    iterator end() const
+    {
+        return m_tree.end();
+    }
+
+#ifdef DEBUG
+    std::string test_tree()
+    {
+        return m_tree.test_tree();
+    }
+#endif // ifdef DEBUG
+
+private:
+    tree_type m_tree {};
+    size_type m_size = 0;
+};
+
+#endif // AVL_MAP_H
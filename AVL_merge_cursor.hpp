@@ -0,0 +1,356 @@
+/*
+Purpose:    AVL_merge_cursor class declaration - a k-way merge of sorted sources (AVL_tree,
+            AVL_snapshot, sorted ranges) streamed in order without building a merged tree.
+*/
+
+#ifndef AVL_MERGE_CURSOR_H
+#define AVL_MERGE_CURSOR_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <ranges>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "AVL_tree.hpp"
+
+/**
+ * @brief Ranges AVL_merge_cursor can merge - forward ranges of T sorted by the cursor's
+ * comparator, whose iterators refer to values that stay in place (the nodes of an AVL_tree, the
+ * arrays of an AVL_snapshot or of a std::vector...).
+ */
+template <typename R, typename T>
+concept AVL_merge_source = std::ranges::forward_range<R> && std::ranges::viewable_range<R> &&
+    std::same_as<std::ranges::range_value_t<R>, T> &&
+    std::is_lvalue_reference_v<std::ranges::range_reference_t<R>>;
+
+/**
+ * @brief Cursor over the union of several sorted sources, yielding every distinct value once in
+ * order with the sum of its counts in all sources.
+ *
+ * Sources are AVL_tree and AVL_snapshot objects (so also memory mapped sorted runs, see
+ * AVL_snapshot::map_file()), sorted ranges, or subranges of them. The smallest current value is
+ * kept by a loser tree of the sources, so a step costs about log2(k) comparisons for k sources
+ * and the cursor uses O(k) memory whatever the sizes of the sources.
+ *
+ * Containers are referred to, not copied - they must outlive the cursor and not be modified
+ * while it is used. Rvalue views (e.g. a std::ranges::subrange) are stored in the cursor.
+ */
+template <typename T, typename Compare = std::less<T>>
+    requires AVL_comparator<Compare, T>
+class AVL_merge_cursor {
+public:
+    using value_type = T;
+    using key_compare = Compare;
+    using size_type = size_t;
+
+    /**
+     * @brief Input iterator over the rest of the merge, advancing the cursor itself. Works with
+     * range-for, the std::ranges algorithms and AVL_iterator_count().
+     */
+    class const_iterator {
+    public:
+        using iterator_concept = std::input_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+
+        const_iterator() = default;
+
+        T const& operator*() const
+        {
+            return m_cursor->value();
+        }
+
+        T const* operator->() const
+        {
+            return &m_cursor->value();
+        }
+
+        /**
+         * @brief Sum of the counts of the value in all sources.
+         */
+        uint32_t count() const
+        {
+            return m_cursor->count();
+        }
+
+        const_iterator& operator++()
+        {
+            m_cursor->next();
+            return *this;
+        }
+
+        void operator++(int)
+        {
+            m_cursor->next();
+        }
+
+        friend bool operator==(const_iterator const& it, std::default_sentinel_t)
+        {
+            return it.m_cursor->at_end();
+        }
+
+    private:
+        friend class AVL_merge_cursor;
+
+        explicit const_iterator(AVL_merge_cursor* cursor):
+            m_cursor(cursor)
+        {
+        }
+
+        AVL_merge_cursor* m_cursor = nullptr;
+    };
+
+    AVL_merge_cursor() = default;
+    explicit AVL_merge_cursor(Compare const& compare):
+        m_compare(compare)
+    {
+    }
+
+    AVL_merge_cursor(AVL_merge_cursor&&) noexcept = default;
+    AVL_merge_cursor& operator=(AVL_merge_cursor&&) noexcept = default;
+
+    /**
+     * @brief Adds a source sorted by the cursor's comparator, and rewinds the cursor.
+     *
+     * Sources with a lower_bound() member (AVL_tree, AVL_snapshot) seek with it, others with
+     * std::ranges::lower_bound(), which is logarithmic for random access ranges.
+     */
+    template <typename R>
+        requires AVL_merge_source<R, T>
+    void add_source(R&& source)
+    {
+        m_sources.push_back(std::make_unique<range_source<std::views::all_t<R>>>(
+            std::views::all(std::forward<R>(source))));
+        m_losers.resize(m_sources.size());
+        rewind();
+    }
+
+    size_type source_count() const
+    {
+        return m_sources.size();
+    }
+
+    /**
+     * @brief Moves every source back to its beginning, and the cursor to the smallest value.
+     */
+    void rewind()
+    {
+        for (auto& source : m_sources) {
+            source->rewind();
+        }
+        build();
+    }
+
+    /**
+     * @brief Moves the cursor to the first value which is not smaller than key, forward or
+     * backward, by a lower_bound() of every source.
+     */
+    void seek(T const& key)
+    {
+        for (auto& source : m_sources) {
+            source->seek(key, m_compare);
+        }
+        build();
+    }
+
+    /**
+     * @brief Whether every source is exhausted. value() and count() are only valid otherwise.
+     */
+    bool at_end() const
+    {
+        return m_value == nullptr;
+    }
+
+    T const& value() const
+    {
+        return *m_value;
+    }
+
+    /**
+     * @brief Sum of the counts of value() in all sources, 1 for each source without counts.
+     */
+    uint32_t count() const
+    {
+        return m_count;
+    }
+
+    /**
+     * @brief Moves to the next distinct value.
+     */
+    void next()
+    {
+        step();
+    }
+
+    /**
+     * @brief Iterator at the current value. Iterating advances the cursor.
+     */
+    const_iterator begin()
+    {
+        return const_iterator(this);
+    }
+
+    std::default_sentinel_t end() const
+    {
+        return std::default_sentinel;
+    }
+
+private:
+    /**
+     * @brief Type erased position in a source. m_value caches the current value so that the loser
+     * tree compares without virtual calls.
+     */
+    struct source_position {
+        virtual ~source_position() = default;
+        virtual void rewind() = 0;
+        virtual void seek(T const& key, Compare const& compare) = 0;
+        virtual void next() = 0;
+        virtual uint32_t count() const = 0;
+
+        // Current value, nullptr once the source is exhausted.
+        T const* m_value = nullptr;
+    };
+
+    template <typename V>
+    struct range_source final : source_position {
+        explicit range_source(V&& view):
+            m_view(std::move(view))
+        {
+        }
+
+        void rewind() override
+        {
+            m_it = std::ranges::begin(m_view);
+            update();
+        }
+
+        void seek(T const& key, Compare const& compare) override
+        {
+            if constexpr (requires { m_view.base().lower_bound(key); }) {
+                m_it = m_view.base().lower_bound(key);
+            } else {
+                m_it = std::ranges::lower_bound(m_view, key, compare);
+            }
+            update();
+        }
+
+        void next() override
+        {
+            ++m_it;
+            update();
+        }
+
+        uint32_t count() const override
+        {
+            return AVL_iterator_count(m_it);
+        }
+
+        void update()
+        {
+            this->m_value = (m_it == std::ranges::end(m_view)) ? nullptr : std::addressof(*m_it);
+        }
+
+        V m_view;
+        std::ranges::iterator_t<V> m_it {};
+    };
+
+    /**
+     * @brief Whether source a comes out of the merge before source b. Exhausted sources lose to
+     * all others, and equal values go to the lower index.
+     */
+    bool beats(size_t a, size_t b) const
+    {
+        auto const* a_value = m_sources[a]->m_value;
+        auto const* b_value = m_sources[b]->m_value;
+        if (b_value == nullptr) {
+            return (a_value != nullptr) || (a < b);
+        }
+        if (a_value == nullptr) {
+            return false;
+        }
+        if (m_compare(*a_value, *b_value)) {
+            return true;
+        }
+        return !m_compare(*b_value, *a_value) && (a < b);
+    }
+
+    /**
+     * @brief Plays the whole tournament from the sources' current positions, then moves to the
+     * first value.
+     *
+     * Source i is leaf k + i of an implicit binary tree of nodes 1 to 2k - 1, in which node n
+     * has children 2n and 2n + 1. Every internal node keeps the loser of the match played there,
+     * and m_losers[0] the overall winner.
+     */
+    void build()
+    {
+        size_t const k = m_sources.size();
+        if (k == 0) {
+            m_value = nullptr;
+            m_count = 0;
+            return;
+        }
+        std::vector<size_t> winners(2 * k);
+        for (size_t i = 0; i < k; ++i) {
+            winners[k + i] = i;
+        }
+        for (size_t n = k - 1; n > 0; --n) {
+            size_t const left = winners[2 * n];
+            size_t const right = winners[2 * n + 1];
+            bool const left_wins = beats(left, right);
+            winners[n] = left_wins ? left : right;
+            m_losers[n] = left_wins ? right : left;
+        }
+        m_losers[0] = winners[1];
+        step();
+    }
+
+    /**
+     * @brief After the winner source moved, plays its matches again from its leaf to the root.
+     */
+    void replay()
+    {
+        size_t winner = m_losers[0];
+        for (size_t n = (m_sources.size() + winner) / 2; n > 0; n /= 2) {
+            if (beats(m_losers[n], winner)) {
+                std::swap(m_losers[n], winner);
+            }
+        }
+        m_losers[0] = winner;
+    }
+
+    /**
+     * @brief Takes the winner's value, and advances every source holding an equal value while
+     * summing their counts. The values stay in place, so m_value is still valid afterwards.
+     */
+    void step()
+    {
+        m_count = 0;
+        m_value = m_sources.empty() ? nullptr : m_sources[m_losers[0]]->m_value;
+        if (m_value == nullptr) {
+            return;
+        }
+        T const* winner_value = m_value;
+        do {
+            auto& source = *m_sources[m_losers[0]];
+            m_count += source.count();
+            source.next();
+            replay();
+            winner_value = m_sources[m_losers[0]]->m_value;
+        } while ((winner_value != nullptr) && !m_compare(*m_value, *winner_value));
+    }
+
+    [[no_unique_address]] Compare m_compare {};
+    std::vector<std::unique_ptr<source_position>> m_sources {};
+    std::vector<size_t> m_losers {};
+    T const* m_value = nullptr;
+    uint32_t m_count = 0;
+};
+
+#endif // AVL_MERGE_CURSOR_H
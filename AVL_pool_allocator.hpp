@@ -0,0 +1,199 @@
+/*
+Purpose:    AVL_pool_allocator class declaration - a slab allocator for tree nodes.
+*/
+
+#ifndef AVL_POOL_ALLOCATOR_H
+#define AVL_POOL_ALLOCATOR_H
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+/**
+ * @brief Fixed size block pool. Blocks are cut out of geometrically growing slabs and freed
+ * blocks are kept on an intrusive free list for reuse.
+ *
+ * @note The block size is fixed by the first allocation. Not thread safe.
+ */
+class AVL_node_pool {
+public:
+    AVL_node_pool() = default;
+    AVL_node_pool(AVL_node_pool const&) = delete;
+    AVL_node_pool& operator=(AVL_node_pool const&) = delete;
+
+    ~AVL_node_pool()
+    {
+        release();
+    }
+
+    /**
+     * @brief Whether blocks of the given layout are served by this pool.
+     */
+    bool serves(size_t size, size_t alignment)
+    {
+        if (m_block_size == 0) {
+            m_block_size = std::max(size, sizeof(free_block));
+            m_block_align = std::max(alignment, alignof(free_block));
+            m_block_size = (m_block_size + m_block_align - 1) / m_block_align * m_block_align;
+        }
+        return (std::max(size, sizeof(free_block)) <= m_block_size) &&
+            (alignment <= m_block_align);
+    }
+
+    void* allocate()
+    {
+        if (m_free != nullptr) {
+            auto block = m_free;
+            m_free = block->m_next;
+            return block;
+        }
+        if (m_bump == m_bump_end) {
+            add_slab();
+        }
+        auto block = m_bump;
+        m_bump += m_block_size;
+        return block;
+    }
+
+    void deallocate(void* block)
+    {
+        auto freed = ::new (block) free_block;
+        freed->m_next = m_free;
+        m_free = freed;
+    }
+
+    /**
+     * @brief Returns all slabs to the system at once, invalidating every block handed out.
+     */
+    void release()
+    {
+        for (auto slab : m_slabs) {
+            ::operator delete(slab, std::align_val_t { m_block_align });
+        }
+        m_slabs.clear();
+        m_free = nullptr;
+        m_bump = nullptr;
+        m_bump_end = nullptr;
+        m_next_slab_blocks = FIRST_SLAB_BLOCKS;
+    }
+
+    /**
+     * @brief Total bytes reserved from the system, used or not.
+     */
+    size_t reserved_bytes() const
+    {
+        size_t total = 0;
+        size_t blocks = FIRST_SLAB_BLOCKS;
+        for (size_t i = 0; i < m_slabs.size(); ++i) {
+            total += blocks * m_block_size;
+            blocks = std::min(blocks * 2, MAX_SLAB_BLOCKS);
+        }
+        return total;
+    }
+
+private:
+    struct free_block {
+        free_block* m_next;
+    };
+
+    static constexpr size_t FIRST_SLAB_BLOCKS = 32;
+    static constexpr size_t MAX_SLAB_BLOCKS = 8192;
+
+    void add_slab()
+    {
+        auto bytes = m_next_slab_blocks * m_block_size;
+        auto slab =
+            static_cast<std::byte*>(::operator new(bytes, std::align_val_t { m_block_align }));
+        m_slabs.push_back(slab);
+        m_bump = slab;
+        m_bump_end = slab + bytes;
+        m_next_slab_blocks = std::min(m_next_slab_blocks * 2, MAX_SLAB_BLOCKS);
+    }
+
+    std::vector<std::byte*> m_slabs {};
+    free_block* m_free = nullptr;
+    std::byte* m_bump = nullptr;
+    std::byte* m_bump_end = nullptr;
+    size_t m_next_slab_blocks = FIRST_SLAB_BLOCKS;
+    size_t m_block_size = 0;
+    size_t m_block_align = 0;
+};
+
+/**
+ * @brief Allocator handing out single objects from a shared AVL_node_pool.
+ *
+ * Copies (including rebound copies) share the same pool and compare equal, so nodes may move
+ * between trees built from copies of one allocator. Multi object allocations and objects that
+ * do not fit the pool's block size fall back to the global heap.
+ */
+template <typename T>
+class AVL_pool_allocator {
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    AVL_pool_allocator():
+        m_pool(std::make_shared<AVL_node_pool>())
+    {
+    }
+
+    template <typename U>
+    AVL_pool_allocator(AVL_pool_allocator<U> const& other) noexcept:
+        m_pool(other.m_pool)
+    {
+    }
+
+    T* allocate(size_t n)
+    {
+        if ((n == 1) && m_pool->serves(sizeof(T), alignof(T))) {
+            return static_cast<T*>(m_pool->allocate());
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t { alignof(T) }));
+    }
+
+    void deallocate(T* ptr, size_t n) noexcept
+    {
+        if ((n == 1) && m_pool->serves(sizeof(T), alignof(T))) {
+            m_pool->deallocate(ptr);
+            return;
+        }
+        ::operator delete(ptr, std::align_val_t { alignof(T) });
+    }
+
+    /**
+     * @brief Drops every slab of the pool in O(1) without visiting the objects in it.
+     *
+     * @returns false (and does nothing) if other allocators still share the pool.
+     */
+    bool release() noexcept
+    {
+        if (m_pool.use_count() != 1) {
+            return false;
+        }
+        m_pool->release();
+        return true;
+    }
+
+    AVL_node_pool const& pool() const
+    {
+        return *m_pool;
+    }
+
+    template <typename U>
+    bool operator==(AVL_pool_allocator<U> const& other) const noexcept
+    {
+        return m_pool == other.m_pool;
+    }
+
+private:
+    template <typename U>
+    friend class AVL_pool_allocator;
+
+    std::shared_ptr<AVL_node_pool> m_pool;
+};
+
+#endif // AVL_POOL_ALLOCATOR_H
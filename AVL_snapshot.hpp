@@ -0,0 +1,681 @@
+/*
+Purpose:    AVL_snapshot class declaration - an immutable, contiguous copy of an AVL_tree in
+            Eytzinger (breadth first) order, and its file format.
+*/
+
+#ifndef AVL_SNAPSHOT_H
+#define AVL_SNAPSHOT_H
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <expected>
+#include <functional>
+#include <istream>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <numeric>
+#include <optional>
+#include <ostream>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define AVL_HAS_MMAP 1
+#endif // if __has_include(<sys/mman.h>)
+
+#include "AVL_tree.hpp"
+
+/**
+ * @brief Header of the snapshot file format.
+ *
+ * The file is the header, then the values array at values_offset and the counts array at
+ * counts_offset, both in Eytzinger order. Children are found by index arithmetic, so the file
+ * holds no pointers and can be used in place wherever it is mapped.
+ */
+struct AVL_file_header {
+    static constexpr char MAGIC[8] = { 'A', 'V', 'L', 'S', 'N', 'A', 'P', '\0' };
+    static constexpr uint32_t VERSION = 1;
+    // Read back differently on a machine of the other endianness.
+    static constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+    char m_magic[8];
+    uint32_t m_version;
+    uint32_t m_byte_order;
+    uint32_t m_value_size;
+    uint32_t m_value_alignment;
+    uint64_t m_unique_count;
+    uint64_t m_total_count;
+    uint64_t m_values_offset;
+    uint64_t m_counts_offset;
+    uint64_t m_file_size;
+    // FNV-1a of the values and counts arrays.
+    uint64_t m_checksum;
+};
+
+/**
+ * @brief Read only counted set made from a sorted sequence, usually through AVL_tree::freeze().
+ *
+ * The values are stored in one array in Eytzinger order: the children of the value at (1 based)
+ * position k are at 2k and 2k + 1, so there are no links to follow. A lookup descends without
+ * branching on the comparison, and prefetches the block of descendants a few levels ahead, which
+ * hides most of the memory latency of a big snapshot. The counts are kept in a separate array,
+ * so that the searched one is dense.
+ *
+ * For trivially copyable T, a snapshot can be written to a stream, read back into one buffer,
+ * or mapped from a file and queried right away.
+ *
+ * @note The storage is immutable and shared, so copies are cheap.
+ */
+template <typename T, typename Compare = std::less<T>>
+    requires AVL_comparator<Compare, T>
+class AVL_snapshot {
+    template <typename K>
+    static constexpr bool is_lookup_key = AVL_lookup_key<K, T, Compare>;
+
+public:
+    using value_type = T;
+    using key_type = T;
+    using key_compare = Compare;
+    using size_type = size_t;
+
+    /**
+     * @brief In-order forward iterator, stepping between Eytzinger positions.
+     */
+    class const_iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T const*;
+        using reference = T const&;
+
+        const_iterator() = default;
+
+        reference operator*() const
+        {
+            return m_snapshot->m_values[m_position - 1];
+        }
+
+        pointer operator->() const
+        {
+            return &m_snapshot->m_values[m_position - 1];
+        }
+
+        /**
+         * @brief How many times the value was added.
+         */
+        uint32_t count() const
+        {
+            return m_snapshot->m_counts[m_position - 1];
+        }
+
+        const_iterator& operator++()
+        {
+            m_position = m_snapshot->next_position(m_position);
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            auto prev = *this;
+            ++*this;
+            return prev;
+        }
+
+        bool operator==(const_iterator const& other) const
+        {
+            return m_position == other.m_position;
+        }
+
+    private:
+        friend class AVL_snapshot;
+
+        const_iterator(size_t position, AVL_snapshot const* snapshot):
+            m_position(position),
+            m_snapshot(snapshot)
+        {
+        }
+
+        // 1 based Eytzinger position, 0 at the end.
+        size_t m_position = 0;
+        AVL_snapshot const* m_snapshot = nullptr;
+    };
+    using iterator = const_iterator;
+
+    AVL_snapshot() = default;
+
+    /**
+     * @brief Lays out a sorted range in O(n).
+     *
+     * @param[in] first, last Range sorted in non-descending order. Equal values are counted
+     * together, and iterators with a count() (like those of AVL_tree) add that count.
+     */
+    template <std::forward_iterator It, std::sentinel_for<It> S>
+    AVL_snapshot(It first, S last, Compare const& compare = Compare()):
+        m_compare(compare)
+    {
+        std::vector<T> sorted {};
+        std::vector<uint32_t> sorted_counts {};
+        for (auto it = first; it != last; ++it) {
+            if (!sorted.empty() && !m_compare(sorted.back(), *it)) {
+                sorted_counts.back() += AVL_iterator_count(it);
+                continue;
+            }
+            sorted.push_back(*it);
+            sorted_counts.push_back(AVL_iterator_count(it));
+        }
+
+        std::vector<size_t> order(sorted.size());
+        size_t next_sorted = 0;
+        fill_order(order, 1, next_sorted);
+        auto storage = std::make_shared<owned_storage>();
+        storage->m_values.reserve(sorted.size());
+        storage->m_counts.reserve(sorted.size());
+        for (auto index : order) {
+            storage->m_values.push_back(std::move(sorted[index]));
+            storage->m_counts.push_back(sorted_counts[index]);
+            m_total += sorted_counts[index];
+        }
+        m_values = storage->m_values.data();
+        m_counts = storage->m_counts.data();
+        m_unique_count = sorted.size();
+        m_storage = std::move(storage);
+    }
+
+    /**
+     * @brief Writes the snapshot in the file format of AVL_file_header.
+     */
+    avl_file_statuses serialize(std::ostream& out) const
+        requires std::is_trivially_copyable_v<T>
+    {
+        auto header = make_header();
+        out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+        write_padding(out, header.m_values_offset - sizeof(header));
+        out.write(reinterpret_cast<char const*>(m_values), values_bytes());
+        write_padding(out, header.m_counts_offset - header.m_values_offset - values_bytes());
+        out.write(reinterpret_cast<char const*>(m_counts), counts_bytes());
+        return out ? avl_file_statuses::SUCCESS : avl_file_statuses::IO_ERROR;
+    }
+
+    /**
+     * @brief Reads a snapshot written by serialize() into one buffer, after checking its header,
+     * its checksum and its total count.
+     *
+     * The size in the header is only trusted as far as the stream goes: a stream which can tell
+     * its length is read with a single read, others into a buffer doubling with each read, so
+     * that a corrupt header cannot make an allocation much bigger than the stream.
+     */
+    static std::expected<AVL_snapshot, avl_file_statuses> deserialize(std::istream& in,
+        Compare const& compare = Compare())
+        requires std::is_trivially_copyable_v<T>
+    {
+        AVL_file_header header {};
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+            return std::unexpected { avl_file_statuses::IO_ERROR };
+        }
+        auto status = check_header(header);
+        if (status != avl_file_statuses::SUCCESS) {
+            return std::unexpected { status };
+        }
+
+        uint64_t rest = header.m_file_size - sizeof(header);
+        auto available = remaining_bytes(in);
+        if (available && (*available < rest)) {
+            return std::unexpected { avl_file_statuses::IO_ERROR };
+        }
+        // Without a length, the buffer doubles as the reads succeed, up to the size in the header.
+        uint64_t capacity = available ? header.m_file_size
+                                      : std::min<uint64_t>(header.m_file_size, READ_CHUNK_SIZE);
+        auto buffer = std::make_shared<aligned_buffer>(capacity);
+        std::memcpy(buffer->m_data, &header, sizeof(header));
+        uint64_t filled = sizeof(header);
+        while (filled < header.m_file_size) {
+            if (filled == capacity) {
+                capacity = std::min<uint64_t>(header.m_file_size, 2 * capacity);
+                auto grown = std::make_shared<aligned_buffer>(capacity);
+                std::memcpy(grown->m_data, buffer->m_data, filled);
+                buffer = std::move(grown);
+            }
+            auto size = static_cast<std::streamsize>(capacity - filled);
+            if (!in.read(reinterpret_cast<char*>(buffer->m_data) + filled, size)) {
+                return std::unexpected { avl_file_statuses::IO_ERROR };
+            }
+            filled = capacity;
+        }
+        auto data = buffer->m_data;
+        return from_image(data, header.m_file_size, std::move(buffer), compare, true);
+    }
+
+#ifdef AVL_HAS_MMAP
+    /**
+     * @brief Maps a file written by serialize() read only, and queries it in place. Only the
+     * header is read up front, unless the checksum and the total count are verified (which
+     * reads the whole file).
+     */
+    static std::expected<AVL_snapshot, avl_file_statuses> map_file(char const* path,
+        Compare const& compare = Compare(),
+        bool verify_checksum = true)
+        requires std::is_trivially_copyable_v<T>
+    {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return std::unexpected { avl_file_statuses::IO_ERROR };
+        }
+        struct stat file_stat {};
+        if ((::fstat(fd, &file_stat) != 0) ||
+            (static_cast<size_t>(file_stat.st_size) < sizeof(AVL_file_header))) {
+            ::close(fd);
+            return std::unexpected { avl_file_statuses::IO_ERROR };
+        }
+        auto size = static_cast<size_t>(file_stat.st_size);
+        void* address = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (address == MAP_FAILED) {
+            return std::unexpected { avl_file_statuses::IO_ERROR };
+        }
+        auto mapping = std::make_shared<file_mapping>(address, size);
+        auto data = static_cast<std::byte const*>(address);
+        return from_image(data, size, std::move(mapping), compare, verify_checksum);
+    }
+#endif // ifdef AVL_HAS_MMAP
+
+    /**
+     * @brief Builds a mutable tree holding the same values and counts, in O(n).
+     */
+    template <typename Allocator = std::allocator<T>, typename Traits = AVL_default_traits>
+    AVL_tree<T, Compare, Allocator, Traits> thaw(Allocator const& alloc = Allocator()) const
+    {
+        using tree_type = AVL_tree<T, Compare, Allocator, Traits>;
+        return tree_type(from_sorted, begin(), end(), m_compare, alloc);
+    }
+
+    bool empty() const
+    {
+        return m_unique_count == 0;
+    }
+
+    /**
+     * @brief Number of values, counting duplicates.
+     */
+    size_type size() const
+    {
+        return m_total;
+    }
+
+    size_type unique_size() const
+    {
+        return m_unique_count;
+    }
+
+    bool contains(T const& value) const
+    {
+        return find(value) != end();
+    }
+
+    template <typename K>
+        requires is_lookup_key<K>
+    bool contains(K const& value) const
+    {
+        return find(value) != end();
+    }
+
+    /**
+     * @brief How many times the value was added, 0 if it is not in the snapshot.
+     */
+    uint32_t count(T const& value) const
+    {
+        return count<T>(value);
+    }
+
+    template <typename K>
+        requires is_lookup_key<K>
+    uint32_t count(K const& value) const
+    {
+        auto it = find(value);
+        return (it == end()) ? 0 : it.count();
+    }
+
+    const_iterator find(T const& value) const
+    {
+        return find<T>(value);
+    }
+
+    template <typename K>
+        requires is_lookup_key<K>
+    const_iterator find(K const& value) const
+    {
+        auto it = lower_bound(value);
+        if ((it == end()) || m_compare(value, *it)) {
+            return end();
+        }
+        return it;
+    }
+
+    /**
+     * @returns Iterator to the first value which is not smaller than value.
+     */
+    const_iterator lower_bound(T const& value) const
+    {
+        return lower_bound<T>(value);
+    }
+
+    template <typename K>
+        requires is_lookup_key<K>
+    const_iterator lower_bound(K const& value) const
+    {
+        return const_iterator(
+            descend([&](T const& node_value) { return m_compare(node_value, value); }), this);
+    }
+
+    /**
+     * @returns Iterator to the first value which is bigger than value.
+     */
+    const_iterator upper_bound(T const& value) const
+    {
+        return upper_bound<T>(value);
+    }
+
+    template <typename K>
+        requires is_lookup_key<K>
+    const_iterator upper_bound(K const& value) const
+    {
+        return const_iterator(
+            descend([&](T const& node_value) { return !m_compare(value, node_value); }), this);
+    }
+
+    const_iterator begin() const
+    {
+        if (empty()) {
+            return end();
+        }
+        return const_iterator(leftmost(1), this);
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(0, this);
+    }
+
+    /**
+     * @brief Bytes used by the value and count arrays.
+     */
+    size_t memory_usage() const
+    {
+        return values_bytes() + counts_bytes();
+    }
+
+private:
+    // Descendants this many levels down share a cache line for small T.
+    static constexpr size_t PREFETCH_STRIDE = std::bit_floor(std::max<size_t>(64 / sizeof(T), 1));
+
+    /**
+     * @brief Sets order[k - 1] to the sorted index of the value at Eytzinger position k, by an
+     * in-order walk of the implicit tree.
+     */
+    static void fill_order(std::vector<size_t>& order, size_t position, size_t& next_sorted)
+    {
+        if (position > order.size()) {
+            return;
+        }
+        fill_order(order, 2 * position, next_sorted);
+        order[position - 1] = next_sorted++;
+        fill_order(order, 2 * position + 1, next_sorted);
+    }
+
+    /**
+     * @brief Finds the first value for which go_bigger is false.
+     *
+     * @returns Its Eytzinger position, 0 if there is none.
+     */
+    template <typename F>
+    size_t descend(F const& go_bigger) const
+    {
+        size_t size = m_unique_count;
+        size_t position = 1;
+        while (position <= size) {
+            if (PREFETCH_STRIDE * position <= size) {
+                prefetch(&m_values[PREFETCH_STRIDE * position - 1]);
+            }
+            position = 2 * position + static_cast<size_t>(go_bigger(m_values[position - 1]));
+        }
+        // Undo the final run of bigger steps, and the smaller step before it.
+        return position >> (std::countr_one(position) + 1);
+    }
+
+    size_t leftmost(size_t position) const
+    {
+        while (2 * position <= m_unique_count) {
+            position *= 2;
+        }
+        return position;
+    }
+
+    size_t next_position(size_t position) const
+    {
+        if (2 * position + 1 <= m_unique_count) {
+            return leftmost(2 * position + 1);
+        }
+        // Climb while coming from a bigger child, then once more.
+        return position >> (std::countr_one(position) + 1);
+    }
+
+    static void prefetch(void const* address)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(address);
+#else
+        (void)address;
+#endif // if defined(__GNUC__) || defined(__clang__)
+    }
+
+    struct owned_storage {
+        std::vector<T> m_values {};
+        std::vector<uint32_t> m_counts {};
+    };
+
+    struct aligned_buffer {
+        static constexpr std::align_val_t ALIGNMENT { 64 };
+
+        explicit aligned_buffer(size_t size):
+            m_data(static_cast<std::byte*>(::operator new(size, ALIGNMENT)))
+        {
+        }
+        aligned_buffer(aligned_buffer const&) = delete;
+        aligned_buffer& operator=(aligned_buffer const&) = delete;
+        ~aligned_buffer()
+        {
+            ::operator delete(m_data, ALIGNMENT);
+        }
+
+        std::byte* m_data;
+    };
+
+#ifdef AVL_HAS_MMAP
+    struct file_mapping {
+        file_mapping(void* address, size_t size):
+            m_address(address),
+            m_size(size)
+        {
+        }
+        file_mapping(file_mapping const&) = delete;
+        file_mapping& operator=(file_mapping const&) = delete;
+        ~file_mapping()
+        {
+            ::munmap(m_address, m_size);
+        }
+
+        void* m_address;
+        size_t m_size;
+    };
+#endif // ifdef AVL_HAS_MMAP
+
+    static constexpr uint64_t align_up(uint64_t offset, uint64_t alignment)
+    {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    // First read of a stream of unknown length, bounding the memory to what the stream holds.
+    static constexpr uint64_t READ_CHUNK_SIZE = 1 << 20;
+
+    /**
+     * @brief Bytes left in a stream, nullopt if it cannot seek.
+     */
+    static std::optional<uint64_t> remaining_bytes(std::istream& in)
+    {
+        auto position = in.tellg();
+        if (position == std::istream::pos_type(-1)) {
+            return std::nullopt;
+        }
+        in.seekg(0, std::ios::end);
+        auto end = in.tellg();
+        in.seekg(position);
+        if ((end == std::istream::pos_type(-1)) || !in) {
+            in.clear();
+            in.seekg(position);
+            return std::nullopt;
+        }
+        return static_cast<uint64_t>(end - position);
+    }
+
+    std::streamsize values_bytes() const
+    {
+        return static_cast<std::streamsize>(m_unique_count * sizeof(T));
+    }
+
+    std::streamsize counts_bytes() const
+    {
+        return static_cast<std::streamsize>(m_unique_count * sizeof(uint32_t));
+    }
+
+    static uint64_t checksum(std::byte const* data, size_t size, uint64_t hash)
+    {
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ static_cast<uint64_t>(data[i])) * 0x100000001B3ULL;
+        }
+        return hash;
+    }
+
+    static constexpr uint64_t CHECKSUM_SEED = 0xCBF29CE484222325ULL;
+
+    AVL_file_header make_header() const
+    {
+        AVL_file_header header {};
+        std::memcpy(header.m_magic, AVL_file_header::MAGIC, sizeof(header.m_magic));
+        header.m_version = AVL_file_header::VERSION;
+        header.m_byte_order = AVL_file_header::BYTE_ORDER_MARK;
+        header.m_value_size = sizeof(T);
+        header.m_value_alignment = alignof(T);
+        header.m_unique_count = m_unique_count;
+        header.m_total_count = m_total;
+        set_layout(header);
+        auto hash = checksum(reinterpret_cast<std::byte const*>(m_values), values_bytes(),
+            CHECKSUM_SEED);
+        header.m_checksum =
+            checksum(reinterpret_cast<std::byte const*>(m_counts), counts_bytes(), hash);
+        return header;
+    }
+
+    /**
+     * @brief Sets the offsets and the file size of a header, which follow from its unique count.
+     */
+    static void set_layout(AVL_file_header& header)
+    {
+        header.m_values_offset = align_up(sizeof(header), std::max<size_t>(alignof(T), 64));
+        header.m_counts_offset =
+            align_up(header.m_values_offset + header.m_unique_count * sizeof(T), 64);
+        header.m_file_size = header.m_counts_offset + header.m_unique_count * sizeof(uint32_t);
+    }
+
+    static void write_padding(std::ostream& out, uint64_t size)
+    {
+        for (uint64_t i = 0; i < size; ++i) {
+            out.put('\0');
+        }
+    }
+
+    /**
+     * @brief Checks that the header was written by this version, for this T, and that its
+     * layout is consistent.
+     */
+    static avl_file_statuses check_header(AVL_file_header const& header)
+    {
+        if (std::memcmp(header.m_magic, AVL_file_header::MAGIC, sizeof(header.m_magic)) != 0) {
+            return avl_file_statuses::BAD_MAGIC;
+        }
+        if (header.m_version != AVL_file_header::VERSION) {
+            return avl_file_statuses::VERSION_MISMATCH;
+        }
+        if ((header.m_byte_order != AVL_file_header::BYTE_ORDER_MARK) ||
+            (header.m_value_size != sizeof(T)) || (header.m_value_alignment != alignof(T))) {
+            return avl_file_statuses::LAYOUT_MISMATCH;
+        }
+        // Keeps the size computations below from overflowing.
+        if (header.m_unique_count > (UINT64_MAX / 2) / (sizeof(T) + sizeof(uint32_t))) {
+            return avl_file_statuses::CORRUPT;
+        }
+        // The checksum only covers the arrays, so every other field is checked against the
+        // unique count. The total count is checked with the counts, by from_image().
+        auto layout = header;
+        set_layout(layout);
+        if ((header.m_values_offset != layout.m_values_offset) ||
+            (header.m_counts_offset != layout.m_counts_offset) ||
+            (header.m_file_size != layout.m_file_size) ||
+            (header.m_total_count < header.m_unique_count)) {
+            return avl_file_statuses::CORRUPT;
+        }
+        return avl_file_statuses::SUCCESS;
+    }
+
+    /**
+     * @brief Makes a snapshot over a whole file image held by storage.
+     */
+    static std::expected<AVL_snapshot, avl_file_statuses> from_image(std::byte const* data,
+        size_t size,
+        std::shared_ptr<void const> storage,
+        Compare const& compare,
+        bool verify_checksum)
+    {
+        AVL_file_header header {};
+        std::memcpy(&header, data, sizeof(header));
+        auto status = check_header(header);
+        if (status != avl_file_statuses::SUCCESS) {
+            return std::unexpected { status };
+        }
+        if (header.m_file_size != size) {
+            return std::unexpected { avl_file_statuses::CORRUPT };
+        }
+
+        AVL_snapshot snapshot {};
+        snapshot.m_compare = compare;
+        snapshot.m_values = reinterpret_cast<T const*>(data + header.m_values_offset);
+        snapshot.m_counts = reinterpret_cast<uint32_t const*>(data + header.m_counts_offset);
+        snapshot.m_unique_count = header.m_unique_count;
+        snapshot.m_total = header.m_total_count;
+        snapshot.m_storage = std::move(storage);
+        if (verify_checksum &&
+            ((snapshot.make_header().m_checksum != header.m_checksum) ||
+                (std::accumulate(snapshot.m_counts, snapshot.m_counts + snapshot.m_unique_count,
+                     uint64_t { 0 }) != header.m_total_count))) {
+            return std::unexpected { avl_file_statuses::CORRUPT };
+        }
+        return snapshot;
+    }
+
+    [[no_unique_address]] Compare m_compare {};
+    // Owns the arrays - vectors, a file image or a file mapping.
+    std::shared_ptr<void const> m_storage {};
+    T const* m_values = nullptr;
+    uint32_t const* m_counts = nullptr;
+    size_type m_unique_count = 0;
+    size_type m_total = 0;
+};
+
+#endif // AVL_SNAPSHOT_H
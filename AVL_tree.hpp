@@ -6,16 +6,31 @@ Purpose:    AVL_tree class declaration.
 #define AVL_TREE_H
 
 #include <algorithm>
+#include <array>
+#include <bit>
 #include <concepts>
+#include <coroutine>
+#include <functional>
 #include <cstddef>
 #include <cstdint>
+#include <exception>
+#include <expected>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <memory>
+#include <numeric>
+#include <optional>
+#include <ranges>
+#include <span>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
 #include <utility>
 #include <vector>
 #ifdef DEBUG
-#include <expected>
-#include <string>
+#include <cmath>
 #endif // ifdef DEBUG
 
 enum class avl_statuses {
@@ -24,6 +39,30 @@ enum class avl_statuses {
     VALUE_NOT_FOUND,
 };
 
+enum class avl_file_statuses {
+    SUCCESS = 0,
+    IO_ERROR,
+    // Not a snapshot file.
+    BAD_MAGIC,
+    VERSION_MISMATCH,
+    // Written for another value type, or on a machine of another endianness.
+    LAYOUT_MISMATCH,
+    // Inconsistent sizes or a wrong checksum.
+    CORRUPT,
+};
+
+/**
+ * @brief How an AVL_tree restores its balance after the updates.
+ */
+enum class avl_balance_policies {
+    // After every add and remove, which keeps it an AVL tree at all times.
+    EAGER,
+    // After every add, while a remove only empties its node, without any rotation. The vacant
+    // nodes are dropped in a single O(n) rebuild once they outnumber the others, so a remove
+    // costs O(1) amortized after its search, and searches go at most about 1 level deeper.
+    LAZY_REMOVES,
+};
+
 static int8_t const SMALLER_UB = -2;
 static int8_t const SMALLER_HEAVY = -1;
 static int8_t const SMALLER_SIGN = -1;
@@ -32,497 +71,3208 @@ static int8_t const BIGGER_SIGN = 1;
 static int8_t const BIGGER_HEAVY = 1;
 static int8_t const BIGGER_UB = 2;
 
-template <std::totally_ordered T>
-class AVL_tree {
-public:
-    AVL_tree() = default;
-    explicit AVL_tree(
-        T head_value): // TODO is this best to get the value as && and force the
-                       // user to use std::move?
-                       // on the one hand it makes it clear that "you lose whatever value is
-                       // stored in that variable". on the other hand, it might prevent
-                       // optimizations like RVO. plus, does it make usage less comfortable?
-                       // It doesnt compile with primitive values and && so idk what to do.
-        m_head(std::make_unique<AVL_node>(head_value))
-    {
-    }
+/**
+ * @brief Tag for constructing an AVL_tree from an already sorted range.
+ */
+struct from_sorted_t {
+    explicit from_sorted_t() = default;
+};
+inline constexpr from_sorted_t from_sorted {};
 
-    void add(T value)
-    {
-        if (m_head == nullptr) {
-            m_head = std::make_unique<AVL_node>(value);
-            return;
+/**
+ * @brief Tag for the AVL_tree operations which split their work across threads.
+ */
+struct parallel_t {
+    explicit parallel_t() = default;
+};
+inline constexpr parallel_t parallel {};
+
+/**
+ * @brief A long AVL_tree operation run in steps, like clear_job(): each resume() does one
+ * budgeted step, so that the caller (an event loop) can interleave the job with its own work
+ * and bound its pauses. No step runs before the first resume().
+ */
+class AVL_job {
+public:
+    struct promise_type {
+        AVL_job get_return_object()
+        {
+            return AVL_job(std::coroutine_handle<promise_type>::from_promise(*this));
         }
 
-        AVL_node* parent = nullptr;
-        auto searched_node = m_head->find(value, &parent);
-        // value already exists.
-        if (searched_node != nullptr) {
-            searched_node->m_count += 1;
-            return;
+        std::suspend_always initial_suspend() noexcept
+        {
+            return {};
         }
 
-        auto new_node = std::make_unique<AVL_node>(value, parent);
-        bool is_smaller_child = false;
-        if (value < parent->m_value) {
-            parent->m_smaller = std::move(new_node);
-            is_smaller_child = true;
-        } else {
-            parent->m_bigger = std::move(new_node);
-            is_smaller_child = false;
+        std::suspend_always final_suspend() noexcept
+        {
+            return {};
         }
-        parent->rebalance_uptree(is_smaller_child, 1);
-        return;
-    }
 
-    avl_statuses remove(T const value)
-    {
-        AVL_node* to_remove = nullptr;
-        std::unique_ptr<AVL_node> replacement = nullptr;
-
-        to_remove = m_head->find(value, nullptr);
-        if (to_remove == nullptr) {
-            return avl_statuses::VALUE_NOT_FOUND;
-        }
+        void return_void() { }
 
-        if (to_remove->m_count > 1) {
-            to_remove->m_count -= 1;
-            return avl_statuses::SUCCESS;
+        void unhandled_exception()
+        {
+            m_exception = std::current_exception();
         }
 
-        /* to_remove has 2 children - swap its value with its minimal bigger
-        child's value and remove the child. */
-        if ((to_remove->m_bigger != nullptr) && (to_remove->m_smaller != nullptr)) {
-            AVL_node* to_swap = nullptr;
-
-            to_swap = to_remove->m_bigger->get_min();
-            to_remove->m_value = std::move(to_swap->m_value);
-            to_remove->m_count = to_swap->m_count;
-            // no need to re-assign to_swap's values since we are about to remove it.
+        std::exception_ptr m_exception {};
+    };
 
-            /* to_swap, being the minimum of its tree, has no left child,
-            so just remove it with a case of 1 or 0 children. */
-            to_remove = to_swap;
-            to_swap = nullptr;
-        }
+    AVL_job(AVL_job&& other) noexcept:
+        m_handle(std::exchange(other.m_handle, nullptr))
+    {
+    }
 
-        // Get to_remove's child if exists, or nullptr if it has no child.
-        auto parent = to_remove->m_parent;
-        if (to_remove->m_smaller != nullptr) {
-            replacement = std::move(to_remove->m_smaller);
-            replacement->m_parent = parent;
-        } else if (to_remove->m_bigger != nullptr) {
-            replacement = std::move(to_remove->m_bigger);
-            replacement->m_parent = parent;
+    AVL_job& operator=(AVL_job&& other) noexcept
+    {
+        if (this != &other) {
+            destroy();
+            m_handle = std::exchange(other.m_handle, nullptr);
         }
+        return *this;
+    }
 
-        bool is_removing_smaller = false;
+    ~AVL_job()
+    {
+        destroy();
+    }
 
-        // Only the tree's root has no parent.
-        if (parent == nullptr) {
-            m_head = std::move(replacement);
-            return avl_statuses::SUCCESS;
+    /**
+     * @brief Runs the next step, rethrowing what the step threw.
+     *
+     * @returns Whether steps are left.
+     */
+    bool resume()
+    {
+        if (done()) {
+            return false;
         }
-        if (to_remove == parent->m_smaller.get()) {
-            parent->m_smaller = std::move(replacement);
-            is_removing_smaller = true;
-        } else {
-            parent->m_bigger = std::move(replacement);
-            is_removing_smaller = false;
+        m_handle.resume();
+        if (auto exception = m_handle.promise().m_exception; exception != nullptr) {
+            destroy();
+            std::rethrow_exception(exception);
         }
+        return !m_handle.done();
+    }
 
-        parent->rebalance_uptree(is_removing_smaller, -1);
+    bool done() const
+    {
+        return (m_handle == nullptr) || m_handle.done();
+    }
 
-        return avl_statuses::SUCCESS;
+private:
+    explicit AVL_job(std::coroutine_handle<promise_type> handle):
+        m_handle(handle)
+    {
     }
 
-    bool contains(T const value) const
+    void destroy()
     {
-        return m_head->find(value, nullptr) != nullptr;
+        if (m_handle != nullptr) {
+            m_handle.destroy();
+            m_handle = nullptr;
+        }
     }
 
-#ifdef DEBUG
+    std::coroutine_handle<promise_type> m_handle {};
+};
+
+/**
+ * @brief How many values an iterator of a sorted sequence stands for - its count() for the
+ * iterators of the counted containers, 1 otherwise.
+ */
+template <typename It>
+uint32_t AVL_iterator_count(It const& it)
+{
+    if constexpr (requires {
+                      { it.count() } -> std::convertible_to<uint32_t>;
+                  }) {
+        return it.count();
+    } else {
+        return 1;
+    }
+}
+
+/**
+ * @brief Compile time options of AVL_tree. Derive from it and override members to change them.
+ */
+struct AVL_default_traits {
     /**
-     * @brief Prints the tree to the console.
+     * @brief Keep the total count of every subtree in its root, for O(log n) rank() and select()
+     * and O(1) size(). Costs a size_t per node and a walk to the root on every count change.
+     */
+    static constexpr bool order_statistics = false;
+
+    /**
+     * @brief Count the operations, rotations, retraces and search depths in an AVL_tree_stats,
+     * read with stats(). Costs a few increments per operation, and nothing at all when off.
      *
-     * @note    * Debug function.
-     *          * Only looks good for values whose char representation is the
-     *              size of 1.
+     * @note The lookups update the counters too, so an instrumented tree must not be read from
+     * several threads at once.
      */
-    void print_tree()
-    {
-        size_t height = AVL_node::get_height(m_head.get());
+    static constexpr bool statistics = false;
 
-        for (size_t i = 0; i < height; ++i) {
-            m_head->print_nth_depth(i, height);
-            std::cout << "\n";
-        }
-    }
+    /**
+     * @brief Keep a count of the equal values added in their node (a multiset). Without it the
+     * tree is a set: adding a value already in the tree leaves it as is, and the nodes carry no
+     * count.
+     */
+    static constexpr bool multiset = true;
 
-    std::string test_tree()
-    {
-        if (m_head == nullptr) {
-            return "";
-        }
-        auto test_out = m_head->test_subtree();
-        if (!test_out) {
-            return test_out.error();
-        }
-        return "";
-    }
-#endif // ifdef DEBUG
+    static constexpr avl_balance_policies balance_policy = avl_balance_policies::EAGER;
+};
 
-private:
-    enum class node_statuses {
-        UNINITIALIZED = -1,
-        SUCCESS = 0,
-        INVALID_HEIGHT,
-    };
+struct AVL_order_statistics_traits : AVL_default_traits {
+    static constexpr bool order_statistics = true;
+};
+
+struct AVL_statistics_traits : AVL_default_traits {
+    static constexpr bool statistics = true;
+};
+
+struct AVL_set_traits : AVL_default_traits {
+    static constexpr bool multiset = false;
+};
+
+struct AVL_lazy_removes_traits : AVL_default_traits {
+    static constexpr avl_balance_policies balance_policy = avl_balance_policies::LAZY_REMOVES;
+};
+
+/**
+ * @brief Operation counters of an AVL_tree with statistics, since its creation or the last
+ * reset_stats().
+ */
+struct AVL_tree_stats {
+    static constexpr size_t DEPTH_BUCKETS = 64;
+
+    // Values added, as new nodes or as count increments of existing nodes (duplicate_adds).
+    uint64_t adds = 0;
+    uint64_t duplicate_adds = 0;
+    // Counts removed, with the node or not.
+    uint64_t removes = 0;
+    // Searches for a value, by the lookups as well as by the updates, and how they ended.
+    uint64_t searches = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t single_rotations = 0;
+    uint64_t double_rotations = 0;
+    // Retraces after a subtree's height changed, and the nodes they visited in total.
+    uint64_t retraces = 0;
+    uint64_t retrace_steps = 0;
+    // depth_histogram[d] counts the searches which visited d nodes, the last bucket d or more.
+    std::array<uint64_t, DEPTH_BUCKETS> depth_histogram {};
+};
+
+/**
+ * @brief Concept for a comparator usable by AVL_tree. A comparator marked with is_transparent
+ * additionally lets the lookup functions accept any key type it can compare with T.
+ */
+template <typename Compare, typename T>
+concept AVL_comparator = std::strict_weak_order<Compare const&, T const&, T const&>;
+
+template <typename T, typename Compare>
+    requires AVL_comparator<Compare, T>
+class AVL_snapshot;
+
+/**
+ * @brief Key types accepted by the lookup functions - T itself, or anything a transparent
+ * comparator can compare with T.
+ */
+template <typename K, typename T, typename Compare>
+concept AVL_lookup_key = std::same_as<K, T> ||
+    (requires { typename Compare::is_transparent; } &&
+        std::strict_weak_order<Compare const&, K const&, T const&>);
+
+template <typename T,
+    typename Compare = std::less<T>,
+    typename Allocator = std::allocator<T>,
+    typename Traits = AVL_default_traits>
+    requires AVL_comparator<Compare, T>
+class AVL_tree {
+    class AVL_node;
+
+    static constexpr bool has_order_statistics = Traits::order_statistics;
+    static constexpr bool has_statistics = Traits::statistics;
+    static constexpr bool is_multiset = Traits::multiset;
+    static constexpr bool has_lazy_removes =
+        Traits::balance_policy == avl_balance_policies::LAZY_REMOVES;
+
+    template <typename K>
+    static constexpr bool is_lookup_key = AVL_lookup_key<K, T, Compare>;
+
+    /* Small trivially copyable values compare cheaply, so their searches go down to a leaf with
+    a single comparison per level and pick the child with a select (no branch to mispredict),
+    instead of 2 comparisons per level and an early exit. */
+    template <typename K>
+    static constexpr bool is_select_search =
+        std::same_as<K, T> && std::is_trivially_copyable_v<T> && (sizeof(T) <= sizeof(void*));
 
-    class AVL_node {
+public:
+    using value_type = T;
+    using key_type = T;
+    using key_compare = Compare;
+    using value_compare = Compare;
+    using size_type = size_t;
+    using allocator_type = Allocator;
+    using traits_type = Traits;
+
+    /**
+     * @brief In-order bidirectional iterator. Steps between neighbours through the child and
+     * parent links, without any extra state.
+     *
+     * @note Values are immutable through the iterator, the count of each value is available
+     * with count().
+     */
+    class const_iterator {
     public:
-        AVL_node(T& value, AVL_node* parent):
-            m_smaller(nullptr),
-            m_bigger(nullptr),
-            m_parent(parent),
-            m_value(std::move(value)),
-            m_count(1),
-            m_balance(BALANCED)
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T const*;
+        using reference = T const&;
+
+        const_iterator() = default;
+
+        reference operator*() const
         {
+            return m_node->m_value;
         }
 
-        AVL_node(T& value):
-            AVL_node(value, nullptr)
+        pointer operator->() const
         {
+            return &m_node->m_value;
         }
 
         /**
-         * @brief simple cleanup which relies on unique_ptr's recursive release properties.
-         *
-         * @note With 10^15 nodes, the worst AVL tree height is 72, so recursion is safe.
+         * @brief How many times the value was added.
          */
-        ~AVL_node()
+        uint32_t count() const
         {
-            m_smaller.reset();
-            m_bigger.reset();
+            return m_node->m_count;
         }
 
-        /**
-         * @brief Search for a value in the subtree and return its node if
-         * found, and optionaly its (potential) parent.
-         *
-         * @param[in] value The node value to search for
-         * @param[out] parent Optional parent of the node or potential parent if not found.
-         *
-         * @returns The node if found, nullptr otherwise.
-         */
-        AVL_node* find(T const& value, AVL_node** parent)
+        const_iterator& operator++()
         {
-            AVL_node* curr_node = this;
-            AVL_node* curr_parent = nullptr;
+            do {
+                step_forward();
+            } while (is_vacant(m_node));
+            return *this;
+        }
 
-            while ((curr_node != nullptr) && (value != curr_node->m_value)) {
-                curr_parent = curr_node;
-                if (value < curr_node->m_value) {
-                    curr_node = curr_node->m_smaller.get();
-                } else {
-                    curr_node = curr_node->m_bigger.get();
-                }
-            }
+        const_iterator operator++(int)
+        {
+            auto prev = *this;
+            ++*this;
+            return prev;
+        }
 
-            if (parent != nullptr) {
-                *parent = curr_parent;
-            }
-            return curr_node;
+        const_iterator& operator--()
+        {
+            do {
+                step_back();
+            } while (is_vacant(m_node));
+            return *this;
         }
 
-        /**
-         * @brief Get the minimal node in the subtree.
-         */
-        AVL_node* get_min()
+        const_iterator operator--(int)
         {
-            AVL_node* curr_node = this;
-            while (curr_node->m_smaller != nullptr) {
-                curr_node = curr_node->m_smaller.get();
-            }
+            auto prev = *this;
+            --*this;
+            return prev;
+        }
 
-            return curr_node;
+        bool operator==(const_iterator const& other) const
+        {
+            return m_node == other.m_node;
         }
 
-        bool operator<(const AVL_node& other) const
+    private:
+        friend class AVL_tree;
+        template <typename Bound>
+        friend class bound_sentinel;
+
+        const_iterator(AVL_node* node, AVL_tree const* tree):
+            m_node(node),
+            m_tree(tree)
         {
-            return m_value < other.m_value;
         }
 
-        static size_t get_height(AVL_node const* node)
+        void step_forward()
         {
-            if (node == nullptr) {
-                return 0;
+            if (m_node->m_bigger != nullptr) {
+                m_node = m_node->m_bigger->get_min();
+                return;
             }
-
-            return 1 +
-                std::max(get_height(node->m_smaller.get()), get_height(node->m_bigger.get()));
+            while ((m_node->m_parent != nullptr) && (m_node == m_node->m_parent->m_bigger)) {
+                m_node = m_node->m_parent;
+            }
+            m_node = m_node->m_parent;
         }
 
-        void rebalance_uptree(bool smaller_called, int8_t balance_change)
+        void step_back()
         {
-            bool keep_rebalancing = ((m_balance == BALANCED) == (balance_change == 1));
-
-            if (smaller_called) {
-                m_balance += SMALLER_SIGN * balance_change;
-            } else {
-                // bigger child called.
-                m_balance += BIGGER_SIGN * balance_change;
+            // Decrementing end() gives the maximal node.
+            if (m_node == nullptr) {
+                m_node = m_tree->m_head->get_max();
+                return;
             }
-            auto parent = m_parent;
-
-            if (m_balance == SMALLER_UB) {
-                this->rotate_to_smaller();
-            } else if (m_balance == BIGGER_UB) {
-                this->rotate_to_bigger();
+            if (m_node->m_smaller != nullptr) {
+                m_node = m_node->m_smaller->get_max();
+                return;
             }
-
-            if (balance_change == -1) {
-                keep_rebalancing = keep_rebalancing && (m_balance == BALANCED);
+            while ((m_node->m_parent != nullptr) && (m_node == m_node->m_parent->m_smaller)) {
+                m_node = m_node->m_parent;
             }
+            m_node = m_node->m_parent;
+        }
 
-            if ((parent != nullptr) && keep_rebalancing) {
-                parent->rebalance_uptree(this == parent->m_smaller.get(), balance_change);
-            }
+        AVL_node* m_node = nullptr;
+        AVL_tree const* m_tree = nullptr;
+    };
+    using iterator = const_iterator;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    /**
+     * @brief Ends an iteration at the first value which is not smaller than a bound, checked
+     * lazily as the iterator advances.
+     */
+    template <typename Bound = T>
+    class bound_sentinel {
+    public:
+        bound_sentinel() = default;
+        explicit bound_sentinel(Bound bound):
+            m_bound(std::move(bound))
+        {
         }
 
-#ifdef DEBUG
-        node_statuses print_nth_depth(size_t depth, size_t height, bool is_empty = false)
+        friend bool operator==(const_iterator const& it, bound_sentinel const& sentinel)
         {
-            const char FILLER_CHAR = ' ';
-            const char BRANCH_CHAR = '_';
-            node_statuses status = node_statuses::UNINITIALIZED;
-            size_t power = 0;
+            return sentinel.is_reached(it);
+        }
 
-            if (height == 0) {
-                return node_statuses::INVALID_HEIGHT;
-            }
+    private:
+        bool is_reached(const_iterator const& it) const
+        {
+            return (it.m_node == nullptr) || !it.m_tree->m_compare(it.m_node->m_value, *m_bound);
+        }
 
-            if (depth == 0) {
-                if (is_empty) {
-                    for (size_t i = 1; i < std::pow(2, height); ++i) {
-                        std::cout << FILLER_CHAR;
-                    }
-                    return node_statuses::SUCCESS;
-                }
+        // optional only to keep the sentinel default constructible for any Bound.
+        std::optional<Bound> m_bound = std::nullopt;
+    };
+    template <typename Bound = T>
+    using range_type = std::ranges::subrange<const_iterator, bound_sentinel<Bound>>;
 
-                if (height == 1) {
-                    // std::cout << int(m_balance) + 1;
-                    std::cout << m_value;
-                    return node_statuses::SUCCESS;
-                }
+    AVL_tree() = default;
+    explicit AVL_tree(Allocator const& alloc):
+        m_alloc(alloc)
+    {
+    }
+    explicit AVL_tree(Compare const& compare, Allocator const& alloc = Allocator()):
+        m_compare(compare),
+        m_alloc(alloc)
+    {
+    }
+    /**
+     * @brief Creates a tree holding a single value. The value is taken by value and moved into
+     * its node, so callers choose between copying and moving.
+     */
+    explicit AVL_tree(T head_value, Allocator const& alloc = Allocator()):
+        m_alloc(alloc),
+        m_head(create_node(nullptr, std::move(head_value))),
+        m_height(1)
+    {
+    }
 
-                power = height - 2;
-                for (size_t i = 0; i < std::pow(2, power); ++i) {
-                    std::cout << FILLER_CHAR;
-                }
-                for (size_t i = 0; i < std::pow(2, power) - 1; ++i) {
-                    if (m_smaller == nullptr) {
-                        std::cout << FILLER_CHAR;
-                    } else {
-                        std::cout << BRANCH_CHAR;
-                    }
+    /**
+     * @brief Builds a perfectly balanced tree from a sorted range in O(n).
+     *
+     * @param[in] first, last Range sorted in non-descending order. Equal values are counted
+     * into a single node, and iterators with a count() (like those of another tree) add that
+     * count.
+     */
+    template <std::forward_iterator It, std::sentinel_for<It> S>
+    AVL_tree(from_sorted_t,
+        It first,
+        S last,
+        Compare const& compare = Compare(),
+        Allocator const& alloc = Allocator()):
+        m_compare(compare),
+        m_alloc(alloc)
+    {
+        auto unique_count = count_runs(first, last);
+        m_head = build_sorted(first, last, unique_count, nullptr);
+        m_height = std::bit_width(unique_count);
+    }
+
+    /**
+     * @brief Builds a perfectly balanced tree from a sorted range like the from_sorted
+     * constructor, building the subtrees of the top levels on separate threads.
+     *
+     * The range is cut into a chunk per thread at run boundaries and the runs of the chunks
+     * are counted in parallel, which locates the value of every top level node.
+     *
+     * @note Only builds in parallel with an allocator usable from several threads at once
+     * (std::allocator), otherwise on the calling thread.
+     */
+    template <std::random_access_iterator It>
+    AVL_tree(parallel_t,
+        from_sorted_t,
+        It first,
+        It last,
+        Compare const& compare = Compare(),
+        Allocator const& alloc = Allocator()):
+        m_compare(compare),
+        m_alloc(alloc)
+    {
+        if constexpr (!is_parallel_safe) {
+            auto unique_count = count_runs(first, last);
+            m_head = build_sorted(first, last, unique_count, nullptr);
+            m_height = std::bit_width(unique_count);
+        } else {
+            int depth = parallel_depth();
+            size_t chunk_count = size_t { 1 } << depth;
+            auto size = static_cast<size_t>(last - first);
+            run_index<It> runs { std::vector<It>(chunk_count + 1, last),
+                std::vector<size_t>(chunk_count + 1, 0) };
+            for (size_t i = 0; i < chunk_count; ++i) {
+                auto chunk_first = first + static_cast<std::ptrdiff_t>(i * size / chunk_count);
+                while ((chunk_first != first) && (chunk_first != last) &&
+                    !m_compare(*(chunk_first - 1), *chunk_first)) {
+                    ++chunk_first;
                 }
+                runs.m_chunk_firsts[i] = chunk_first;
+            }
+            count_chunk_runs(runs, 0, chunk_count);
+            std::exclusive_scan(runs.m_run_offsets.begin(),
+                runs.m_run_offsets.end(),
+                runs.m_run_offsets.begin(),
+                size_t { 0 });
+            m_head = build_sorted_parallel(runs, 0, runs.m_run_offsets.back(), nullptr, depth);
+            m_height = std::bit_width(runs.m_run_offsets.back());
+        }
+    }
 
-                // std::cout << int(m_balance) + 1;
-                std::cout << m_value;
+    /**
+     * @brief Sorts a copy of the range and builds the tree from it in O(n log n).
+     */
+    template <std::input_iterator It, std::sentinel_for<It> S>
+    AVL_tree(It first,
+        S last,
+        Compare const& compare = Compare(),
+        Allocator const& alloc = Allocator()):
+        m_compare(compare),
+        m_alloc(alloc)
+    {
+        std::vector<T> values(first, last);
+        std::sort(values.begin(), values.end(), m_compare);
+        auto moved_first = std::make_move_iterator(values.begin());
+        auto unique_count = values.size() - count_duplicates(values);
+        m_head =
+            build_sorted(moved_first, std::make_move_iterator(values.end()), unique_count, nullptr);
+        m_height = std::bit_width(unique_count);
+    }
 
-                for (size_t i = 0; i < std::pow(2, power) - 1; ++i) {
-                    if (m_bigger == nullptr) {
-                        std::cout << FILLER_CHAR;
-                    } else {
-                        std::cout << BRANCH_CHAR;
-                    }
-                }
-                for (size_t i = 0; i < std::pow(2, power); ++i) {
-                    std::cout << FILLER_CHAR;
-                }
-            } else {
-                if (is_empty || (m_smaller == nullptr)) {
-                    status = this->print_nth_depth(depth - 1, height - 1, true);
-                    if (status != node_statuses::SUCCESS) {
-                        return status;
-                    }
-                } else {
-                    status = m_smaller->print_nth_depth(depth - 1, height - 1);
-                    if (status != node_statuses::SUCCESS) {
-                        return status;
+    AVL_tree(AVL_tree const&) = delete;
+    AVL_tree& operator=(AVL_tree const&) = delete;
+
+    AVL_tree(AVL_tree&& other) noexcept:
+        m_compare(other.m_compare),
+        m_alloc(other.m_alloc),
+        m_head(std::exchange(other.m_head, nullptr)),
+        m_height(std::exchange(other.m_height, 0)),
+        m_last_added(std::exchange(other.m_last_added, nullptr)),
+        m_last_added_next(std::exchange(other.m_last_added_next, nullptr)),
+        m_teardown(std::exchange(other.m_teardown, nullptr)),
+        m_lazy(std::exchange(other.m_lazy, {})),
+        m_stats(other.m_stats)
+    {
+    }
+
+    AVL_tree& operator=(AVL_tree&& other) noexcept
+    {
+        if (this != &other) {
+            destroy_tree();
+            m_compare = other.m_compare;
+            m_alloc = other.m_alloc;
+            m_head = std::exchange(other.m_head, nullptr);
+            m_height = std::exchange(other.m_height, 0);
+            m_last_added = std::exchange(other.m_last_added, nullptr);
+            m_last_added_next = std::exchange(other.m_last_added_next, nullptr);
+            m_teardown = std::exchange(other.m_teardown, nullptr);
+            m_lazy = std::exchange(other.m_lazy, {});
+            m_stats = other.m_stats;
+        }
+        return *this;
+    }
+
+    /**
+     * @note Big trees with an allocator usable from several threads at once are freed on
+     * several threads.
+     */
+    ~AVL_tree()
+    {
+        destroy_tree();
+    }
+
+    /**
+     * @brief Removes every value, like the destructor, and keeps the tree usable.
+     */
+    void clear()
+    {
+        destroy_tree();
+    }
+
+    /**
+     * @brief Rebuilds the tree perfectly balanced in O(n), dropping the vacant nodes left by the
+     * removes of LAZY_REMOVES. The nodes are relinked, none is allocated.
+     */
+    void rebalance()
+    {
+        forget_last_added();
+        // Unrolled into a list of bigger links by rotations like destroy_subtree, in order.
+        AVL_node* list = nullptr;
+        AVL_node** tail = &list;
+        size_type count = 0;
+        AVL_node* node = m_head;
+        while (node != nullptr) {
+            if (auto smaller = node->m_smaller; smaller != nullptr) {
+                node->m_smaller = smaller->m_bigger;
+                smaller->m_bigger = node;
+                node = smaller;
+                continue;
+            }
+            auto bigger = node->m_bigger;
+            if (is_vacant(node)) {
+                destroy_node(node);
+            } else {
+                *tail = node;
+                tail = &node->m_bigger;
+                count += 1;
+            }
+            node = bigger;
+        }
+        *tail = nullptr;
+
+        m_head = link_sorted(list, count, nullptr);
+        m_height = std::bit_width(count);
+        if constexpr (has_lazy_removes) {
+            m_lazy = { count, 0 };
+        }
+    }
+
+    /**
+     * @brief clear() for callers which cannot pause for O(n): empties the tree in O(log n),
+     * leaving its nodes to be freed by clear_step(). The tree is usable meanwhile, and clearing
+     * it again adds its new nodes to those being freed.
+     */
+    void clear_incremental()
+    {
+        if (m_head == nullptr) {
+            return;
+        }
+        forget_last_added();
+        if constexpr (has_lazy_removes) {
+            m_lazy = { 0, 0 };
+        }
+        // The nodes being freed are in no particular order, any shape of tree will do.
+        m_head->get_max()->m_bigger = m_teardown;
+        m_teardown = std::exchange(m_head, nullptr);
+        m_height = 0;
+    }
+
+    /**
+     * @brief Frees nodes left by clear_incremental(), in at most budget rotations and frees.
+     * The values in the tree are not touched.
+     *
+     * @returns Whether every such node is freed.
+     */
+    bool clear_step(size_t budget)
+    {
+        m_teardown = destroy_steps(m_teardown, budget);
+        return m_teardown == nullptr;
+    }
+
+    /**
+     * @brief The rebuild of LAZY_REMOVES in steps: unlinks the vacant nodes and rebalances
+     * like eager removes would have, visiting at most budget nodes in order, from where the
+     * previous step stopped.
+     *
+     * Steps done often enough keep the vacant nodes from ever outnumbering the others, so the
+     * O(n) rebuild of a remove does not happen.
+     *
+     * @returns Whether no vacant node is left.
+     */
+    bool rebuild_step(size_t budget)
+        requires has_lazy_removes
+    {
+        AVL_node* node = m_lazy.m_rebuild_next;
+        for (; (budget > 0) && (m_lazy.m_vacant > 0); --budget) {
+            if (node == nullptr) {
+                node = m_head->get_min();
+            }
+            const_iterator next(node, this);
+            next.step_forward();
+            if (is_vacant(node)) {
+                unlink_node(node);
+                destroy_node(node);
+            }
+            node = next.m_node;
+        }
+        m_lazy.m_rebuild_next = (m_lazy.m_vacant > 0) ? node : nullptr;
+        return m_lazy.m_vacant == 0;
+    }
+
+    allocator_type get_allocator() const
+    {
+        return allocator_type(m_alloc);
+    }
+
+    key_compare key_comp() const
+    {
+        return m_compare;
+    }
+
+    value_compare value_comp() const
+    {
+        return m_compare;
+    }
+
+    void add(T const& value)
+    {
+        insert(value);
+    }
+
+    void add(T&& value)
+    {
+        insert(std::move(value));
+    }
+
+    /**
+     * @brief Adds a value, copying it only if it is not in the tree yet.
+     *
+     * @returns Iterator to the value, and whether a new node was created for it (false means
+     * that the count of an existing value was increased).
+     */
+    std::pair<const_iterator, bool> insert(T const& value)
+    {
+        return insert_if_new(value, value);
+    }
+
+    /**
+     * @brief Adds a value, moving from it only if it is not in the tree yet.
+     */
+    std::pair<const_iterator, bool> insert(T&& value)
+    {
+        return insert_if_new(value, std::move(value));
+    }
+
+    /**
+     * @brief insert, searching from hint (usually the value added before) instead of from the
+     * root, in O(log d) where d is the distance between value and hint.
+     *
+     * @note An end() hint searches like insert without a hint.
+     */
+    std::pair<const_iterator, bool> insert(const_iterator hint, T const& value)
+    {
+        return insert_near(hint.m_node, value, value);
+    }
+
+    std::pair<const_iterator, bool> insert(const_iterator hint, T&& value)
+    {
+        return insert_near(hint.m_node, value, std::move(value));
+    }
+
+    void add(const_iterator hint, T const& value)
+    {
+        insert(hint, value);
+    }
+
+    void add(const_iterator hint, T&& value)
+    {
+        insert(hint, std::move(value));
+    }
+
+    /**
+     * @brief Adds a value constructed in place from args.
+     *
+     * @note A single argument which can be looked up directly is searched for before
+     * constructing anything. Otherwise the node is constructed first (which is cheap with a
+     * pool allocator) and discarded if its value already exists.
+     */
+    template <typename... Args>
+    std::pair<const_iterator, bool> emplace(Args&&... args)
+    {
+        if constexpr ((sizeof...(Args) == 1) && (is_lookup_key<std::remove_cvref_t<Args>> && ...)) {
+            return insert_if_new(args..., std::forward<Args>(args)...);
+        } else {
+            AVL_node* new_node = create_node(nullptr, std::forward<Args>(args)...);
+            AVL_node* parent = nullptr;
+            auto searched_node = find_node(new_node->m_value, &parent);
+            if (is_vacant(searched_node)) {
+                return { revive(searched_node, new_node), true };
+            }
+            if (searched_node != nullptr) {
+                destroy_node(new_node);
+                add_duplicate(searched_node);
+                return { const_iterator(searched_node, this), false };
+            }
+            new_node->m_parent = parent;
+            return { link_new_node(new_node), true };
+        }
+    }
+
+    /**
+     * @brief Adds a value constructed in place from args, unless a value equal to key is in
+     * the tree already - it and its count are then left untouched, and args are not used.
+     *
+     * @returns Iterator to the value equal to key, and whether it was added.
+     */
+    template <typename K, typename... Args>
+        requires is_lookup_key<K>
+    std::pair<const_iterator, bool> try_emplace(K const& key, Args&&... args)
+    {
+        AVL_node* parent = parent_after_last_added(key);
+        if (parent != nullptr) {
+            return { link_new_node(create_node(parent, std::forward<Args>(args)...)), true };
+        }
+        auto searched_node = find_node(key, &parent);
+        if (is_vacant(searched_node)) {
+            return { revive(searched_node, create_node(nullptr, std::forward<Args>(args)...)),
+                true };
+        }
+        if (searched_node != nullptr) {
+            return { const_iterator(searched_node, this), false };
+        }
+        return { link_new_node(create_node(parent, std::forward<Args>(args)...)), true };
+    }
+
+    avl_statuses remove(T const& value)
+    {
+        return remove<T>(value);
+    }
+
+    template <typename K>
+        requires is_lookup_key<K>
+    avl_statuses remove(K const& value)
+    {
+        AVL_node* to_remove = live(find_node(value, nullptr));
+        if (to_remove == nullptr) {
+            return avl_statuses::VALUE_NOT_FOUND;
+        }
+        remove_node(to_remove);
+        return avl_statuses::SUCCESS;
+    }
+
+    /**
+     * @brief Adds every value of a batch.
+     *
+     * The batch is sorted in place, then each value is searched for from the node of the value
+     * before it, climbing only as far up as needed instead of descending from the root.
+     */
+    void add_batch(std::span<T> values)
+    {
+        std::sort(values.begin(), values.end(), m_compare);
+        AVL_node* finger = nullptr;
+        for (auto const& value : values) {
+            finger = insert_below(climb_to_cover(finger, value), value, value).first.m_node;
+        }
+    }
+
+    /**
+     * @brief Removes one count of every value of a batch, searching like add_batch (and also
+     * sorting the batch in place).
+     *
+     * @returns How many of the values were found and removed.
+     */
+    size_t remove_batch(std::span<T> values)
+    {
+        std::sort(values.begin(), values.end(), m_compare);
+        AVL_node* finger = nullptr;
+        size_t removed = 0;
+        for (auto const& value : values) {
+            AVL_node* to_remove =
+                live(find_node_below(climb_to_cover(finger, value), value, nullptr));
+            if (to_remove == nullptr) {
+                continue;
+            }
+            removed += 1;
+            if constexpr (has_lazy_removes) {
+                bool is_kept = to_remove->m_count > 1;
+                remove_node(to_remove);
+                // A rebuild frees the vacated node, and leaves no vacant node.
+                finger = (is_kept || (m_lazy.m_vacant > 0)) ? to_remove : nullptr;
+                continue;
+            }
+            // The next search starts from the node before, which survives this removal (or
+            // from the root if it was the first one).
+            finger = (to_remove->m_count > 1)
+                ? to_remove
+                : std::prev(const_iterator(to_remove, this)).m_node;
+            remove_node(to_remove);
+        }
+        return removed;
+    }
+
+    /**
+     * @brief Looks every value of a batch up, searching in sorted order like add_batch.
+     *
+     * @param[out] results results[i] is set to whether values[i] is in the tree. Must be at
+     * least as long as values.
+     */
+    void contains_batch(std::span<T const> values, std::span<bool> results) const
+    {
+        // Small values are sorted along with their indices, others through their indices.
+        constexpr bool is_sorted_by_copy = std::is_trivially_copyable_v<T> && (sizeof(T) <= 16);
+        using order_entry = std::conditional_t<is_sorted_by_copy, std::pair<T, size_t>, size_t>;
+        std::vector<order_entry> order(values.size());
+        for (size_t i = 0; i < values.size(); ++i) {
+            if constexpr (is_sorted_by_copy) {
+                order[i] = { values[i], i };
+            } else {
+                order[i] = i;
+            }
+        }
+        std::sort(order.begin(), order.end(), [&](auto const& first, auto const& second) {
+            if constexpr (is_sorted_by_copy) {
+                return m_compare(first.first, second.first);
+            } else {
+                return m_compare(values[first], values[second]);
+            }
+        });
+
+        // Closest node found so far which is not bigger than the next value.
+        AVL_node* finger = nullptr;
+        for (auto const& entry : order) {
+            size_t index = 0;
+            if constexpr (is_sorted_by_copy) {
+                index = entry.second;
+            } else {
+                index = entry;
+            }
+            auto const& value = values[index];
+            AVL_node* curr_node = climb_to_cover(finger, value);
+            results[index] = false;
+            while (curr_node != nullptr) {
+                if (m_compare(value, curr_node->m_value)) {
+                    curr_node = curr_node->m_smaller;
+                } else {
+                    finger = curr_node;
+                    if (!m_compare(curr_node->m_value, value)) {
+                        results[index] = !is_vacant(curr_node);
+                        break;
                     }
+                    curr_node = curr_node->m_bigger;
                 }
-                std::cout << FILLER_CHAR;
-                if (is_empty || (m_bigger == nullptr)) {
-                    status = this->print_nth_depth(depth - 1, height - 1, true);
-                    if (status != node_statuses::SUCCESS) {
-                        return status;
-                    }
+            }
+        }
+    }
+
+    bool contains(T const& value) const
+    {
+        return contains<T>(value);
+    }
+
+    template <typename K>
+        requires is_lookup_key<K>
+    bool contains(K const& value) const
+    {
+        return live(find_node(value, nullptr)) != nullptr;
+    }
+
+    /**
+     * @returns Iterator to the value, or end() if it is not in the tree.
+     */
+    const_iterator find(T const& value) const
+    {
+        return find<T>(value);
+    }
+
+    template <typename K>
+        requires is_lookup_key<K>
+    const_iterator find(K const& value) const
+    {
+        return const_iterator(live(find_node(value, nullptr)), this);
+    }
+
+    /**
+     * @brief find, searching from finger instead of from the root: it climbs through the
+     * parents only until their subtree can hold value, in O(log d) where d is the distance
+     * between value and finger.
+     *
+     * @note An end() finger searches from the root.
+     */
+    const_iterator find(const_iterator finger, T const& value) const
+    {
+        return find<T>(finger, value);
+    }
+
+    template <typename K>
+        requires is_lookup_key<K>
+    const_iterator find(const_iterator finger, K const& value) const
+    {
+        return const_iterator(
+            live(find_node_below(climb_to_cover(finger.m_node, value), value, nullptr)), this);
+    }
+
+    /**
+     * @returns Iterator to the first value which is not smaller than value.
+     */
+    const_iterator lower_bound(T const& value) const
+    {
+        return lower_bound<T>(value);
+    }
+
+    template <typename K>
+        requires is_lookup_key<K>
+    const_iterator lower_bound(K const& value) const
+    {
+        AVL_node* curr_node = m_head;
+        AVL_node* bound = nullptr;
+        while (curr_node != nullptr) {
+            if (m_compare(curr_node->m_value, value)) {
+                curr_node = curr_node->m_bigger;
+            } else {
+                bound = curr_node;
+                curr_node = curr_node->m_smaller;
+            }
+        }
+        return live_from(bound);
+    }
+
+    /**
+     * @returns Iterator to the first value which is bigger than value.
+     */
+    const_iterator upper_bound(T const& value) const
+    {
+        return upper_bound<T>(value);
+    }
+
+    template <typename K>
+        requires is_lookup_key<K>
+    const_iterator upper_bound(K const& value) const
+    {
+        AVL_node* curr_node = m_head;
+        AVL_node* bound = nullptr;
+        while (curr_node != nullptr) {
+            if (m_compare(value, curr_node->m_value)) {
+                bound = curr_node;
+                curr_node = curr_node->m_smaller;
+            } else {
+                curr_node = curr_node->m_bigger;
+            }
+        }
+        return live_from(bound);
+    }
+
+    std::pair<const_iterator, const_iterator> equal_range(T const& value) const
+    {
+        return equal_range<T>(value);
+    }
+
+    template <typename K>
+        requires is_lookup_key<K>
+    std::pair<const_iterator, const_iterator> equal_range(K const& value) const
+    {
+        auto lower = lower_bound(value);
+        if ((lower == end()) || m_compare(value, *lower)) {
+            return { lower, lower };
+        }
+        return { lower, std::next(lower) };
+    }
+
+    /**
+     * @brief Lazy view of the values in [low, high). Costs one descent to low, and stops as soon
+     * as it reaches high.
+     */
+    auto range(T const& low, T high) const
+    {
+        return range<T>(low, std::move(high));
+    }
+
+    template <typename K>
+        requires is_lookup_key<K>
+    range_type<K> range(K const& low, K high) const
+    {
+        return range_type<K>(lower_bound(low), bound_sentinel<K>(std::move(high)));
+    }
+
+    /**
+     * @brief Looks many values up, interleaving LOOKUP_GROUP_SIZE independent searches: each
+     * search prefetches its next node and yields to the others, so the memory latency of one
+     * level is hidden behind the steps of the other searches. A finished search takes the next
+     * value right away.
+     *
+     * @param[out] results results[i] is set to whether values[i] is in the tree. Must be at
+     * least as long as values.
+     */
+    void contains_many(std::span<T const> values, std::span<bool> results) const
+    {
+        std::array<AVL_node const*, LOOKUP_GROUP_SIZE> nodes {};
+        std::array<size_t, LOOKUP_GROUP_SIZE> indices {};
+        size_t active = 0;
+        size_t next = 0;
+
+        if (m_head == nullptr) {
+            std::fill_n(results.begin(), values.size(), false);
+            return;
+        }
+        for (; (active < LOOKUP_GROUP_SIZE) && (next < values.size()); ++active, ++next) {
+            nodes[active] = m_head;
+            indices[active] = next;
+        }
+
+        while (active > 0) {
+            for (size_t slot = 0; slot < active;) {
+                AVL_node const* node = nodes[slot];
+                auto const& value = values[indices[slot]];
+                bool is_found = false;
+                if (m_compare(value, node->m_value)) {
+                    node = node->m_smaller;
+                } else if (m_compare(node->m_value, value)) {
+                    node = node->m_bigger;
                 } else {
-                    status = m_bigger->print_nth_depth(depth - 1, height - 1);
-                    if (status != node_statuses::SUCCESS) {
-                        return status;
-                    }
+                    is_found = !is_vacant(node);
+                    node = nullptr;
+                }
+
+                if (node != nullptr) {
+                    prefetch(node);
+                    nodes[slot] = node;
+                    slot += 1;
+                    continue;
                 }
+                results[indices[slot]] = is_found;
+                if (next < values.size()) {
+                    nodes[slot] = m_head;
+                    indices[slot] = next;
+                    next += 1;
+                    slot += 1;
+                } else {
+                    // Close the gap with the last search.
+                    active -= 1;
+                    nodes[slot] = nodes[active];
+                    indices[slot] = indices[active];
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Calls fn(value, count) for every value, in order.
+     */
+    template <typename F>
+    void for_each(F&& fn) const
+    {
+        visit_subtree(m_head, fn, 0);
+    }
+
+    /**
+     * @brief Calls fn(value, count) for every value, visiting the subtrees below the top
+     * levels on separate threads, so in no particular order.
+     *
+     * @note fn must be safe to call from several threads at once.
+     */
+    template <typename F>
+    void for_each(parallel_t, F&& fn) const
+    {
+        visit_subtree(m_head, fn, parallel_depth());
+    }
+
+    /**
+     * @brief Moves the values not smaller than value out into a new tree, in O(log n).
+     */
+    AVL_tree split(T const& value)
+    {
+        return split<T>(value);
+    }
+
+    template <typename K>
+        requires is_lookup_key<K>
+    AVL_tree split(K const& value)
+    {
+        auto [smaller, equal, bigger] = split_subtree(take_subtree(), value);
+        AVL_tree upper(m_compare, get_allocator());
+        if (equal != nullptr) {
+            bigger = join_subtrees({}, equal, bigger);
+        }
+        set_root(smaller);
+        upper.set_root(bigger);
+        return upper;
+    }
+
+    /**
+     * @brief Appends the values of bigger, which must all be bigger than the values of this
+     * tree, in O(log n).
+     *
+     * @note Nodes are moved over when the allocators compare equal, otherwise the values are
+     * copied in O(n).
+     */
+    void join(AVL_tree&& bigger)
+    {
+        auto other = adopt_subtree(std::move(bigger));
+        set_root(join_subtrees(take_subtree(), other));
+    }
+
+    /**
+     * @brief Adds every value of other, the counts of equal values adding up.
+     *
+     * Splits other by this tree's root and recursively unites the halves with its subtrees,
+     * then joins the results. This is O(m log(n / m + 1)) for trees of m and n values, so
+     * merging a small tree into a big one only costs about m searches.
+     */
+    void unite(AVL_tree&& other)
+    {
+        auto other_subtree = adopt_subtree(std::move(other));
+        set_root(unite_subtrees(take_subtree(), other_subtree));
+    }
+
+    /**
+     * @brief unite() in steps: moves at most budget of other's nodes (its smallest ones) into
+     * this tree, for O(log n) each. Both trees stay valid and usable between the steps.
+     *
+     * @returns Whether other is empty.
+     */
+    bool unite_step(AVL_tree& other, size_t budget)
+    {
+        for (; (budget > 0) && (other.m_head != nullptr); --budget) {
+            AVL_node* node = other.m_head->get_min();
+            other.unlink_node(node);
+            if (is_vacant(node)) {
+                other.destroy_node(node);
+                continue;
+            }
+            if constexpr (has_lazy_removes) {
+                // Fewer nodes are left around other's vacant ones.
+                other.rebuild_if_mostly_vacant();
+            }
+            move_node(other, node);
+        }
+        return other.m_head == nullptr;
+    }
+
+    /**
+     * @brief Keeps only the values also in other, with the smaller of both counts. Same cost as
+     * unite().
+     */
+    void intersect(AVL_tree&& other)
+    {
+        auto other_subtree = adopt_subtree(std::move(other));
+        set_root(intersect_subtrees(take_subtree(), other_subtree));
+    }
+
+    /**
+     * @brief Removes the values of other, as many times as other counts them. Same cost as
+     * unite().
+     */
+    void subtract(AVL_tree&& other)
+    {
+        auto other_subtree = adopt_subtree(std::move(other));
+        set_root(subtract_subtrees(take_subtree(), other_subtree));
+    }
+
+    /**
+     * @brief clear_incremental() at once, then clear_step() as a job, each resume() doing one
+     * step of budget.
+     */
+    AVL_job clear_job(size_t budget)
+    {
+        clear_incremental();
+        return clear_steps_job(budget);
+    }
+
+    AVL_job rebuild_job(size_t budget)
+        requires has_lazy_removes
+    {
+        while (!rebuild_step(budget)) {
+            co_await std::suspend_always {};
+        }
+    }
+
+    /**
+     * @brief unite_step() as a job, which owns other until the job is destroyed.
+     */
+    AVL_job unite_job(AVL_tree other, size_t budget)
+    {
+        while (!unite_step(other, budget)) {
+            co_await std::suspend_always {};
+        }
+    }
+
+    /**
+     * @brief Immutable copy of the tree laid out contiguously for fast lookups, in O(n).
+     *
+     * @note Requires AVL_snapshot.hpp to be included.
+     */
+    AVL_snapshot<T, Compare> freeze() const
+    {
+        return AVL_snapshot<T, Compare>(begin(), end(), m_compare);
+    }
+
+    /**
+     * @brief Writes the tree in the AVL_snapshot file format, in O(n).
+     *
+     * @note Requires AVL_snapshot.hpp to be included.
+     */
+    avl_file_statuses serialize(std::ostream& out) const
+        requires std::is_trivially_copyable_v<T>
+    {
+        return freeze().serialize(out);
+    }
+
+    /**
+     * @brief Reads a tree written by serialize() (or by AVL_snapshot::serialize()), in O(n).
+     *
+     * @note Requires AVL_snapshot.hpp to be included.
+     */
+    static std::expected<AVL_tree, avl_file_statuses> deserialize(std::istream& in,
+        Compare const& compare = Compare(),
+        Allocator const& alloc = Allocator())
+        requires std::is_trivially_copyable_v<T>
+    {
+        auto snapshot = AVL_snapshot<T, Compare>::deserialize(in, compare);
+        if (!snapshot) {
+            return std::unexpected { snapshot.error() };
+        }
+        return snapshot->template thaw<Allocator, Traits>(alloc);
+    }
+
+    bool empty() const
+    {
+        return m_head == nullptr;
+    }
+
+    /**
+     * @brief Number of values in the tree, counting duplicates.
+     */
+    size_type size() const
+        requires has_order_statistics
+    {
+        return AVL_node::get_weight(m_head);
+    }
+
+    /**
+     * @brief Number of values (counting duplicates) smaller than value, in O(log n).
+     */
+    size_type rank(T const& value) const
+        requires has_order_statistics
+    {
+        return rank<T>(value);
+    }
+
+    template <typename K>
+        requires has_order_statistics && is_lookup_key<K>
+    size_type rank(K const& value) const
+    {
+        AVL_node* curr_node = m_head;
+        size_type smaller_total = 0;
+        while (curr_node != nullptr) {
+            if (m_compare(curr_node->m_value, value)) {
+                smaller_total += AVL_node::get_weight(curr_node->m_smaller) + curr_node->m_count;
+                curr_node = curr_node->m_bigger;
+            } else {
+                curr_node = curr_node->m_smaller;
+            }
+        }
+        return smaller_total;
+    }
+
+    /**
+     * @brief The value at position index of the sorted values (counting duplicates), in
+     * O(log n).
+     *
+     * @returns Iterator to the value, or end() if index >= size().
+     */
+    const_iterator select(size_type index) const
+        requires has_order_statistics
+    {
+        AVL_node* curr_node = m_head;
+        while (curr_node != nullptr) {
+            auto smaller_weight = AVL_node::get_weight(curr_node->m_smaller);
+            if (index < smaller_weight) {
+                curr_node = curr_node->m_smaller;
+            } else if (index - smaller_weight < curr_node->m_count) {
+                break;
+            } else {
+                index -= smaller_weight + curr_node->m_count;
+                curr_node = curr_node->m_bigger;
+            }
+        }
+        return const_iterator(curr_node, this);
+    }
+
+    /**
+     * @brief The value at fraction q (clamped to 0..1) of the sorted values, that is
+     * select(floor(q * (size() - 1))).
+     *
+     * @returns Iterator to the value, or end() if the tree is empty.
+     */
+    const_iterator quantile(double q) const
+        requires has_order_statistics
+    {
+        if (m_head == nullptr) {
+            return end();
+        }
+        auto last_index = static_cast<double>(size() - 1);
+        return select(static_cast<size_type>(std::clamp(q, 0.0, 1.0) * last_index));
+    }
+
+    /**
+     * @brief Height of the tree, 0 when empty, in O(1).
+     */
+    size_type height() const
+    {
+        return m_height;
+    }
+
+    /**
+     * @brief Checks every invariant of the tree: the order of all the values, the parent links,
+     * the balances against the actual heights, the tree's height, and the counts and weights.
+     *
+     * A single iterative pass, which climbs back up through the parent links and only keeps
+     * the child heights along the current path.
+     *
+     * @returns Why the tree is invalid, empty if it is valid.
+     */
+    std::string validate() const
+    {
+        return validate_tree(0);
+    }
+
+    /**
+     * @brief validate(), with the subtrees below the top levels checked on separate threads.
+     */
+    std::string validate(parallel_t) const
+    {
+        return validate_tree(parallel_depth());
+    }
+
+    /**
+     * @brief Copy of the operation counters, for export.
+     */
+    AVL_tree_stats stats() const
+        requires has_statistics
+    {
+        return m_stats;
+    }
+
+    void reset_stats()
+        requires has_statistics
+    {
+        m_stats = {};
+    }
+
+    const_iterator begin() const
+    {
+        return live_from((m_head == nullptr) ? nullptr : m_head->get_min());
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(nullptr, this);
+    }
+
+    const_iterator cbegin() const
+    {
+        return begin();
+    }
+
+    const_iterator cend() const
+    {
+        return end();
+    }
+
+    const_reverse_iterator rbegin() const
+    {
+        return const_reverse_iterator(end());
+    }
+
+    const_reverse_iterator rend() const
+    {
+        return const_reverse_iterator(begin());
+    }
+
+#ifdef DEBUG
+    /**
+     * @brief Prints the tree to the console.
+     *
+     * @note    * Debug function.
+     *          * Only looks good for values whose char representation is the
+     *              size of 1.
+     */
+    void print_tree()
+    {
+        for (size_t i = 0; i < m_height; ++i) {
+            m_head->print_nth_depth(i, m_height);
+            std::cout << "\n";
+        }
+    }
+
+    std::string test_tree()
+    {
+        return validate();
+    }
+#endif // ifdef DEBUG
+
+private:
+    // Enough searches in flight to cover a DRAM access with the steps of the others.
+    static constexpr size_t LOOKUP_GROUP_SIZE = 16;
+    // Trees at least this high (over 2^15 nodes) are freed in parallel.
+    static constexpr size_type PARALLEL_DESTROY_HEIGHT = 16;
+    // Whether create_node() and destroy_node() may run on several threads at once.
+    static constexpr bool is_parallel_safe = std::is_same_v<Allocator, std::allocator<T>>;
+
+    enum class node_statuses {
+        UNINITIALIZED = -1,
+        SUCCESS = 0,
+        INVALID_HEIGHT,
+    };
+
+    struct no_weight { };
+    using weight_type = std::conditional_t<has_order_statistics, size_type, no_weight>;
+    struct no_stats { };
+    using stats_type = std::conditional_t<has_statistics, AVL_tree_stats, no_stats>;
+
+    static constexpr size_type UNKNOWN_NODE_COUNT = std::numeric_limits<size_type>::max();
+    // Counts of the nodes, with the vacant ones, for the rebuilds of LAZY_REMOVES. Bulk
+    // operations do not count their nodes, so the next remove counts them if needed.
+    struct lazy_counts {
+        size_type m_nodes = UNKNOWN_NODE_COUNT;
+        size_type m_vacant = 0;
+        // Where the next rebuild_step() starts, nullptr for the smallest node.
+        AVL_node* m_rebuild_next = nullptr;
+    };
+    struct no_lazy_counts { };
+    using lazy_counts_type = std::conditional_t<has_lazy_removes, lazy_counts, no_lazy_counts>;
+
+    // The count of every value of a set, which takes no space in its nodes.
+    struct unit_count {
+        constexpr operator uint32_t() const
+        {
+            return 1;
+        }
+    };
+    // A vacant node of LAZY_REMOVES has a count of 0, so even a set's nodes need a count then.
+    using count_type =
+        std::conditional_t<is_multiset || has_lazy_removes, uint32_t, unit_count>;
+
+    /**
+     * @brief The fields of a node, for values aligned at least like the count.
+     */
+    struct wide_node_fields {
+        template <typename... Args>
+        explicit wide_node_fields(AVL_node* parent, Args&&... args):
+            m_parent(parent),
+            m_value(std::forward<Args>(args)...)
+        {
+        }
+
+        AVL_node* m_smaller = nullptr;
+        AVL_node* m_bigger = nullptr;
+        AVL_node* m_parent = nullptr;
+        T m_value;
+        [[no_unique_address]] count_type m_count {};
+        int8_t m_balance = BALANCED;
+        // Total count of the subtree, only stored with order statistics.
+        [[no_unique_address]] weight_type m_weight {};
+    };
+
+    /**
+     * @brief The fields of a node for small values (like char or int16_t), which go after the
+     * count and the balance so that they fill the padding there instead of adding their own.
+     */
+    struct narrow_node_fields {
+        template <typename... Args>
+        explicit narrow_node_fields(AVL_node* parent, Args&&... args):
+            m_parent(parent),
+            m_value(std::forward<Args>(args)...)
+        {
+        }
+
+        AVL_node* m_smaller = nullptr;
+        AVL_node* m_bigger = nullptr;
+        AVL_node* m_parent = nullptr;
+        [[no_unique_address]] count_type m_count {};
+        int8_t m_balance = BALANCED;
+        T m_value;
+        [[no_unique_address]] weight_type m_weight {};
+    };
+
+    using node_fields =
+        std::conditional_t<(alignof(T) < alignof(uint32_t)), narrow_node_fields, wide_node_fields>;
+
+    class AVL_node : public node_fields {
+    public:
+        using node_fields::m_balance;
+        using node_fields::m_bigger;
+        using node_fields::m_count;
+        using node_fields::m_parent;
+        using node_fields::m_smaller;
+        using node_fields::m_value;
+        using node_fields::m_weight;
+
+        template <typename... Args>
+        explicit AVL_node(AVL_node* parent, Args&&... args):
+            node_fields(parent, std::forward<Args>(args)...)
+        {
+            set_count(1);
+            if constexpr (has_order_statistics) {
+                m_weight = 1;
+            }
+        }
+
+        /**
+         * @brief Sets the count of the value - a set's values always count 1 (or 0 in a vacant
+         * node).
+         */
+        void set_count(uint32_t count)
+        {
+            if constexpr (is_multiset) {
+                m_count = count;
+            } else if constexpr (has_lazy_removes) {
+                m_count = std::min<uint32_t>(count, 1);
+            }
+        }
+
+        /**
+         * @brief Get the minimal node in the subtree.
+         */
+        AVL_node* get_min()
+        {
+            AVL_node* curr_node = this;
+            while (curr_node->m_smaller != nullptr) {
+                curr_node = curr_node->m_smaller;
+            }
+
+            return curr_node;
+        }
+
+        /**
+         * @brief Get the maximal node in the subtree.
+         */
+        AVL_node* get_max()
+        {
+            AVL_node* curr_node = this;
+            while (curr_node->m_bigger != nullptr) {
+                curr_node = curr_node->m_bigger;
+            }
+
+            return curr_node;
+        }
+
+        /**
+         * @brief Total count of the values in a subtree.
+         */
+        static size_type get_weight(AVL_node const* node)
+            requires has_order_statistics
+        {
+            return (node == nullptr) ? 0 : node->m_weight;
+        }
+
+        /**
+         * @brief Recomputes the node's weight from its count and its children's weights.
+         */
+        void update_weight()
+        {
+            if constexpr (has_order_statistics) {
+                m_weight = m_count + get_weight(m_smaller) + get_weight(m_bigger);
+            }
+        }
+
+#ifdef DEBUG
+        node_statuses print_nth_depth(size_t depth, size_t height, bool is_empty = false)
+        {
+            const char FILLER_CHAR = ' ';
+            const char BRANCH_CHAR = '_';
+            node_statuses status = node_statuses::UNINITIALIZED;
+            size_t power = 0;
+
+            if (height == 0) {
+                return node_statuses::INVALID_HEIGHT;
+            }
+
+            if (depth == 0) {
+                if (is_empty) {
+                    for (size_t i = 1; i < std::pow(2, height); ++i) {
+                        std::cout << FILLER_CHAR;
+                    }
+                    return node_statuses::SUCCESS;
+                }
+
+                if (height == 1) {
+                    // std::cout << int(m_balance) + 1;
+                    std::cout << m_value;
+                    return node_statuses::SUCCESS;
+                }
+
+                power = height - 2;
+                for (size_t i = 0; i < std::pow(2, power); ++i) {
+                    std::cout << FILLER_CHAR;
+                }
+                for (size_t i = 0; i < std::pow(2, power) - 1; ++i) {
+                    if (m_smaller == nullptr) {
+                        std::cout << FILLER_CHAR;
+                    } else {
+                        std::cout << BRANCH_CHAR;
+                    }
+                }
+
+                // std::cout << int(m_balance) + 1;
+                std::cout << m_value;
+
+                for (size_t i = 0; i < std::pow(2, power) - 1; ++i) {
+                    if (m_bigger == nullptr) {
+                        std::cout << FILLER_CHAR;
+                    } else {
+                        std::cout << BRANCH_CHAR;
+                    }
+                }
+                for (size_t i = 0; i < std::pow(2, power); ++i) {
+                    std::cout << FILLER_CHAR;
+                }
+            } else {
+                if (is_empty || (m_smaller == nullptr)) {
+                    status = this->print_nth_depth(depth - 1, height - 1, true);
+                    if (status != node_statuses::SUCCESS) {
+                        return status;
+                    }
+                } else {
+                    status = m_smaller->print_nth_depth(depth - 1, height - 1);
+                    if (status != node_statuses::SUCCESS) {
+                        return status;
+                    }
+                }
+                std::cout << FILLER_CHAR;
+                if (is_empty || (m_bigger == nullptr)) {
+                    status = this->print_nth_depth(depth - 1, height - 1, true);
+                    if (status != node_statuses::SUCCESS) {
+                        return status;
+                    }
+                } else {
+                    status = m_bigger->print_nth_depth(depth - 1, height - 1);
+                    if (status != node_statuses::SUCCESS) {
+                        return status;
+                    }
+                }
+            }
+
+            return node_statuses::SUCCESS;
+        }
+
+#endif // ifdef DEBUG
+    };
+
+    using node_allocator =
+        typename std::allocator_traits<Allocator>::template rebind_alloc<AVL_node>;
+    using node_traits = std::allocator_traits<node_allocator>;
+
+    template <typename... Args>
+    AVL_node* create_node(Args&&... args)
+    {
+        AVL_node* node = std::to_address(node_traits::allocate(m_alloc, 1));
+        try {
+            node_traits::construct(m_alloc, node, std::forward<Args>(args)...);
+        } catch (...) {
+            node_traits::deallocate(m_alloc, node, 1);
+            throw;
+        }
+        return node;
+    }
+
+    void destroy_node(AVL_node* node)
+    {
+        node_traits::destroy(m_alloc, node);
+        node_traits::deallocate(m_alloc, node, 1);
+    }
+
+    /**
+     * @brief The link owning a node - its parent's child pointer, or m_head for the root.
+     */
+    AVL_node*& owner_link(AVL_node* node)
+    {
+        auto parent = node->m_parent;
+        if (parent == nullptr) {
+            return m_head;
+        }
+        return (node == parent->m_smaller) ? parent->m_smaller : parent->m_bigger;
+    }
+
+    /**
+     * @brief Applies update to the statistics, compiled out without them.
+     */
+    template <typename F>
+    void record(F&& update) const
+    {
+        if constexpr (has_statistics) {
+            update(m_stats);
+        }
+    }
+
+    /**
+     * @brief Adds a value equal to node's, as one more count of it - or not at all in a set.
+     */
+    void add_duplicate(AVL_node* node)
+    {
+        record([](auto& stats) {
+            stats.adds += 1;
+            stats.duplicate_adds += 1;
+        });
+        if constexpr (is_multiset) {
+            node->m_count += 1;
+            update_weights_uptree(node);
+        }
+    }
+
+    /**
+     * @brief Whether node is a node emptied by a remove of LAZY_REMOVES, which only stays for
+     * the balance until the next rebuild.
+     */
+    static bool is_vacant(AVL_node const* node)
+    {
+        if constexpr (has_lazy_removes) {
+            return (node != nullptr) && (node->m_count == 0);
+        } else {
+            return false;
+        }
+    }
+
+    /**
+     * @brief node, or nullptr if it is vacant.
+     */
+    static AVL_node* live(AVL_node* node)
+    {
+        return is_vacant(node) ? nullptr : node;
+    }
+
+    /**
+     * @brief Iterator to node, or to the first value after it if it is vacant.
+     */
+    const_iterator live_from(AVL_node* node) const
+    {
+        const_iterator it(node, this);
+        if (is_vacant(node)) {
+            ++it;
+        }
+        return it;
+    }
+
+    /**
+     * @brief Empties a node instead of removing it, and rebuilds the tree once the vacant nodes
+     * outnumber the others.
+     */
+    void vacate(AVL_node* node)
+        requires has_lazy_removes
+    {
+        node->set_count(0);
+        update_weights_uptree(node);
+        m_lazy.m_vacant += 1;
+        rebuild_if_mostly_vacant();
+    }
+
+    /**
+     * @brief Rebuilds the tree if the vacant nodes outnumber the others, counting the nodes first
+     * if needed.
+     */
+    void rebuild_if_mostly_vacant()
+        requires has_lazy_removes
+    {
+        if (m_lazy.m_vacant == 0) {
+            return;
+        }
+        if (m_lazy.m_nodes == UNKNOWN_NODE_COUNT) {
+            m_lazy.m_nodes = 0;
+            for (const_iterator it(m_head->get_min(), this); it.m_node != nullptr;
+                 it.step_forward()) {
+                m_lazy.m_nodes += 1;
+            }
+        }
+        if (m_lazy.m_vacant * 2 > m_lazy.m_nodes) {
+            rebalance();
+        }
+    }
+
+    /**
+     * @brief Puts new_node, whose value equals the vacant node's, in its place.
+     */
+    const_iterator revive(AVL_node* vacant, AVL_node* new_node)
+    {
+        record([](auto& stats) { stats.adds += 1; });
+        if (vacant == m_last_added_next) {
+            forget_last_added();
+        }
+        owner_link(vacant) = new_node;
+        new_node->m_parent = vacant->m_parent;
+        link_children(new_node, vacant->m_smaller, vacant->m_bigger);
+        new_node->m_balance = vacant->m_balance;
+        destroy_node(vacant);
+        if constexpr (has_lazy_removes) {
+            m_lazy.m_vacant -= 1;
+            if (vacant == m_lazy.m_rebuild_next) {
+                m_lazy.m_rebuild_next = new_node;
+            }
+        }
+        update_weights_uptree(new_node);
+        return const_iterator(new_node, this);
+    }
+
+    /**
+     * @brief Links the next count nodes of a list (chained through their bigger links) into a
+     * perfectly balanced subtree, consuming them in order like build_sorted.
+     */
+    AVL_node* link_sorted(AVL_node*& list, size_t count, AVL_node* parent)
+    {
+        if (count == 0) {
+            return nullptr;
+        }
+        size_t smaller_count = (count - 1) / 2;
+        size_t bigger_count = count - 1 - smaller_count;
+
+        AVL_node* smaller = link_sorted(list, smaller_count, nullptr);
+        AVL_node* node = list;
+        list = list->m_bigger;
+        node->m_parent = parent;
+        node->m_smaller = smaller;
+        if (smaller != nullptr) {
+            smaller->m_parent = node;
+        }
+        node->m_bigger = link_sorted(list, bigger_count, node);
+        node->m_balance =
+            static_cast<int8_t>(std::bit_width(bigger_count) - std::bit_width(smaller_count));
+        node->update_weight();
+        return node;
+    }
+
+    void record_rotation(bool is_double) const
+    {
+        record([is_double](auto& stats) {
+            (is_double ? stats.double_rotations : stats.single_rotations) += 1;
+        });
+    }
+
+    static void prefetch(void const* address)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(address);
+#else
+        (void)address;
+#endif // if defined(__GNUC__) || defined(__clang__)
+    }
+
+    /**
+     * @brief condition ? if_true : if_false with masks, which compilers do not turn back into a
+     * branch (as they do with the ternary operator in a search loop).
+     */
+    static AVL_node* select(bool condition, AVL_node* if_true, AVL_node* if_false)
+    {
+        auto mask = uintptr_t { 0 } - uintptr_t { condition };
+        return reinterpret_cast<AVL_node*>((reinterpret_cast<uintptr_t>(if_true) & mask) |
+            (reinterpret_cast<uintptr_t>(if_false) & ~mask));
+    }
+
+    /**
+     * @brief Recomputes the weights from a node whose subtree changed up to the root.
+     */
+    void update_weights_uptree(AVL_node* node)
+    {
+        if constexpr (has_order_statistics) {
+            for (; node != nullptr; node = node->m_parent) {
+                node->update_weight();
+            }
+        }
+    }
+
+    /**
+     * @brief Single rotation lifting node's smaller child into node's place.
+     *
+     * @note Only links are changed, values never move between nodes.
+     *
+     * @returns The new root of the subtree.
+     */
+    AVL_node* rotate_smaller_up(AVL_node* node)
+    {
+        AVL_node*& link = owner_link(node);
+        AVL_node* pivot = node->m_smaller;
+
+        node->m_smaller = pivot->m_bigger;
+        if (node->m_smaller != nullptr) {
+            node->m_smaller->m_parent = node;
+        }
+        pivot->m_bigger = node;
+        pivot->m_parent = node->m_parent;
+        node->m_parent = pivot;
+        link = pivot;
+
+        node->update_weight();
+        pivot->update_weight();
+        node->m_balance = node->m_balance - SMALLER_SIGN - std::min(pivot->m_balance, BALANCED);
+        pivot->m_balance = pivot->m_balance - SMALLER_SIGN + std::max(node->m_balance, BALANCED);
+        return pivot;
+    }
+
+    /**
+     * @brief Single rotation lifting node's bigger child into node's place.
+     *
+     * @note Only links are changed, values never move between nodes.
+     *
+     * @returns The new root of the subtree.
+     */
+    AVL_node* rotate_bigger_up(AVL_node* node)
+    {
+        AVL_node*& link = owner_link(node);
+        AVL_node* pivot = node->m_bigger;
+
+        node->m_bigger = pivot->m_smaller;
+        if (node->m_bigger != nullptr) {
+            node->m_bigger->m_parent = node;
+        }
+        pivot->m_smaller = node;
+        pivot->m_parent = node->m_parent;
+        node->m_parent = pivot;
+        link = pivot;
+
+        node->update_weight();
+        pivot->update_weight();
+        node->m_balance = node->m_balance - BIGGER_SIGN - std::max(pivot->m_balance, BALANCED);
+        pivot->m_balance = pivot->m_balance - BIGGER_SIGN + std::min(node->m_balance, BALANCED);
+        return pivot;
+    }
+
+    /**
+     * @brief Rebalances a node which is 2 levels heavier on its smaller side, with a double
+     * rotation if the smaller child leans the other way.
+     *
+     * @returns The new root of the subtree.
+     */
+    AVL_node* rotate_to_smaller(AVL_node* node)
+    {
+        bool is_double = node->m_smaller->m_balance == BIGGER_HEAVY;
+        record_rotation(is_double);
+        if (is_double) {
+            rotate_bigger_up(node->m_smaller);
+        }
+        return rotate_smaller_up(node);
+    }
+
+    /**
+     * @brief Rebalances a node which is 2 levels heavier on its bigger side, with a double
+     * rotation if the bigger child leans the other way.
+     *
+     * @returns The new root of the subtree.
+     */
+    AVL_node* rotate_to_bigger(AVL_node* node)
+    {
+        bool is_double = node->m_bigger->m_balance == SMALLER_HEAVY;
+        record_rotation(is_double);
+        if (is_double) {
+            rotate_smaller_up(node->m_bigger);
+        }
+        return rotate_bigger_up(node);
+    }
+
+    /**
+     * @brief Updates balances from a node whose subtree height changed up towards the root,
+     * rotating where a node goes out of balance, until a subtree's height stays the same.
+     *
+     * @param[in] node The parent of the subtree whose height changed.
+     * @param[in] smaller_called Whether that subtree is node's smaller child.
+     * @param[in] balance_change 1 if the subtree grew, -1 if it shrank.
+     *
+     * @note Iterative - climbs through the parent links.
+     *
+     * @returns Whether the height of the whole tree changed.
+     */
+    bool rebalance_uptree(AVL_node* node, bool smaller_called, int8_t balance_change)
+    {
+        record([](auto& stats) { stats.retraces += 1; });
+        while (node != nullptr) {
+            record([](auto& stats) { stats.retrace_steps += 1; });
+            bool keep_rebalancing = ((node->m_balance == BALANCED) == (balance_change == 1));
+
+            if (smaller_called) {
+                node->m_balance += SMALLER_SIGN * balance_change;
+            } else {
+                // bigger child called.
+                node->m_balance += BIGGER_SIGN * balance_change;
+            }
+            auto parent = node->m_parent;
+
+            if (node->m_balance == SMALLER_UB) {
+                node = rotate_to_smaller(node);
+            } else if (node->m_balance == BIGGER_UB) {
+                node = rotate_to_bigger(node);
+            }
+
+            if (balance_change == -1) {
+                keep_rebalancing = keep_rebalancing && (node->m_balance == BALANCED);
+            }
+
+            if ((parent == nullptr) || !keep_rebalancing) {
+                return keep_rebalancing;
+            }
+            smaller_called = (node == parent->m_smaller);
+            node = parent;
+        }
+        return false;
+    }
+
+    /**
+     * @brief Removes one count of a node's value, and the node itself with its last count.
+     */
+    void remove_node(AVL_node* to_remove)
+    {
+        record([](auto& stats) { stats.removes += 1; });
+        if (to_remove->m_count > 1) {
+            to_remove->set_count(to_remove->m_count - 1);
+            update_weights_uptree(to_remove);
+            return;
+        }
+        if constexpr (has_lazy_removes) {
+            if ((to_remove == m_last_added) || (to_remove == m_last_added_next)) {
+                forget_last_added();
+            }
+            vacate(to_remove);
+            return;
+        }
+        unlink_node(to_remove);
+        destroy_node(to_remove);
+    }
+
+    /**
+     * @brief Takes a node out of the tree without freeing it, and rebalances from where it was.
+     */
+    void unlink_node(AVL_node* to_remove)
+    {
+        if ((to_remove == m_last_added) || (to_remove == m_last_added_next)) {
+            forget_last_added();
+        }
+        if constexpr (has_lazy_removes) {
+            if (m_lazy.m_nodes != UNKNOWN_NODE_COUNT) {
+                m_lazy.m_nodes -= 1;
+            }
+            m_lazy.m_vacant -= is_vacant(to_remove) ? 1 : 0;
+            if (to_remove == m_lazy.m_rebuild_next) {
+                m_lazy.m_rebuild_next = nullptr;
+            }
+        }
+
+        /* to_remove has 2 children - its minimal bigger child takes its place in the tree
+        (by relinking, so no value moves between nodes), and the retrace starts from where that
+        child was. */
+        if ((to_remove->m_bigger != nullptr) && (to_remove->m_smaller != nullptr)) {
+            AVL_node* successor = to_remove->m_bigger->get_min();
+            AVL_node* parent = successor->m_parent;
+            bool is_removing_smaller = true;
+
+            if (parent == to_remove) {
+                parent = successor;
+                is_removing_smaller = false;
+            } else {
+                // successor, being the minimum of its tree, has no smaller child.
+                parent->m_smaller = successor->m_bigger;
+                if (successor->m_bigger != nullptr) {
+                    successor->m_bigger->m_parent = parent;
+                }
+                successor->m_bigger = to_remove->m_bigger;
+                successor->m_bigger->m_parent = successor;
+            }
+            successor->m_smaller = to_remove->m_smaller;
+            successor->m_smaller->m_parent = successor;
+            successor->m_balance = to_remove->m_balance;
+            owner_link(to_remove) = successor;
+            successor->m_parent = to_remove->m_parent;
+
+            update_weights_uptree(parent);
+            if (rebalance_uptree(parent, is_removing_smaller, -1)) {
+                m_height -= 1;
+            }
+            return;
+        }
+
+        // Get to_remove's child if exists, or nullptr if it has no child.
+        AVL_node* replacement = nullptr;
+        auto parent = to_remove->m_parent;
+        if (to_remove->m_smaller != nullptr) {
+            replacement = to_remove->m_smaller;
+            replacement->m_parent = parent;
+        } else if (to_remove->m_bigger != nullptr) {
+            replacement = to_remove->m_bigger;
+            replacement->m_parent = parent;
+        }
+
+        bool is_removing_smaller = false;
+
+        // Only the tree's root has no parent.
+        if (parent == nullptr) {
+            m_head = replacement;
+            m_height -= 1;
+            return;
+        }
+        if (to_remove == parent->m_smaller) {
+            parent->m_smaller = replacement;
+            is_removing_smaller = true;
+        } else {
+            parent->m_bigger = replacement;
+            is_removing_smaller = false;
+        }
+
+        update_weights_uptree(parent);
+        if (rebalance_uptree(parent, is_removing_smaller, -1)) {
+            m_height -= 1;
+        }
+    }
+
+    /**
+     * @brief A detached subtree and its height, which split and join need and nodes do not
+     * store.
+     */
+    struct subtree {
+        AVL_node* root = nullptr;
+        int height = 0;
+    };
+
+    /**
+     * @brief Detaches the whole tree, leaving it empty.
+     */
+    subtree take_subtree()
+    {
+        if constexpr (has_lazy_removes) {
+            if (m_lazy.m_vacant > 0) {
+                rebalance();
+            }
+            m_lazy = { UNKNOWN_NODE_COUNT, 0 };
+        }
+        subtree whole { m_head, static_cast<int>(m_height) };
+        m_head = nullptr;
+        m_height = 0;
+        forget_last_added();
+        return whole;
+    }
+
+    void set_root(subtree whole)
+    {
+        m_head = whole.root;
+        m_height = static_cast<size_type>(whole.height);
+        forget_last_added();
+        if constexpr (has_lazy_removes) {
+            m_lazy = { UNKNOWN_NODE_COUNT, 0 };
+        }
+    }
+
+    /**
+     * @brief Detaches the whole of other, copying its values first if its nodes cannot be freed
+     * by this tree's allocator.
+     */
+    subtree adopt_subtree(AVL_tree&& other)
+    {
+        if constexpr (!node_traits::is_always_equal::value) {
+            if (!(m_alloc == other.m_alloc)) {
+                AVL_tree copy(from_sorted, other.begin(), other.end(), m_compare, get_allocator());
+                return copy.take_subtree();
+            }
+        }
+        return other.take_subtree();
+    }
+
+    /**
+     * @brief One child of a subtree's root, its height derived from the root's.
+     */
+    static subtree get_child(subtree parent, bool is_bigger)
+    {
+        AVL_node* child = is_bigger ? parent.root->m_bigger : parent.root->m_smaller;
+        int8_t away_sign = is_bigger ? SMALLER_SIGN : BIGGER_SIGN;
+        // Only the child on the side away from the root's lean is 2 levels lower.
+        return { child, parent.height - ((parent.root->m_balance == away_sign) ? 2 : 1) };
+    }
+
+    static subtree detach_child(subtree parent, bool is_bigger)
+    {
+        auto child = get_child(parent, is_bigger);
+        if (child.root != nullptr) {
+            child.root->m_parent = nullptr;
+        }
+        return child;
+    }
+
+    /**
+     * @brief Joins two subtrees and a middle node whose value lies between theirs, in
+     * O(|height difference| + 1).
+     *
+     * The middle node goes down the facing side of the higher subtree to the first node at most
+     * 1 level higher than the lower subtree, takes its place with both below it, and the
+     * retrace of an insertion restores the balance above.
+     *
+     * @note Uses m_head as the root of the joined tree while rebalancing.
+     */
+    subtree join_subtrees(subtree smaller, AVL_node* middle, subtree bigger)
+    {
+        if ((bigger.height - smaller.height <= BIGGER_HEAVY) &&
+            (bigger.height - smaller.height >= SMALLER_HEAVY)) {
+            link_children(middle, smaller.root, bigger.root);
+            middle->m_parent = nullptr;
+            middle->m_balance = static_cast<int8_t>(bigger.height - smaller.height);
+            middle->update_weight();
+            return { middle, std::max(smaller.height, bigger.height) + 1 };
+        }
+
+        bool is_bigger = smaller.height > bigger.height;
+        subtree higher = is_bigger ? smaller : bigger;
+        subtree lower = is_bigger ? bigger : smaller;
+        AVL_node* parent = nullptr;
+        subtree spine = higher;
+        while (spine.height > lower.height + 1) {
+            parent = spine.root;
+            spine = get_child(spine, is_bigger);
+        }
+        if (is_bigger) {
+            link_children(middle, spine.root, lower.root);
+        } else {
+            link_children(middle, lower.root, spine.root);
+        }
+        middle->m_balance =
+            static_cast<int8_t>((lower.height - spine.height) * (is_bigger ? 1 : -1));
+        middle->update_weight();
+        middle->m_parent = parent;
+        (is_bigger ? parent->m_bigger : parent->m_smaller) = middle;
+
+        m_head = higher.root;
+        update_weights_uptree(parent);
+        bool has_grown = rebalance_uptree(parent, !is_bigger, 1);
+        subtree joined { m_head, higher.height + (has_grown ? 1 : 0) };
+        m_head = nullptr;
+        return joined;
+    }
+
+    /**
+     * @brief Joins two subtrees whose values are all in order, the smallest node of bigger
+     * becoming the middle node.
+     */
+    subtree join_subtrees(subtree smaller, subtree bigger)
+    {
+        if (bigger.root == nullptr) {
+            return smaller;
+        }
+        auto rest = split_subtree(bigger, bigger.root->get_min()->m_value);
+        return join_subtrees(smaller, rest.equal, rest.bigger);
+    }
+
+    static void link_children(AVL_node* node, AVL_node* smaller, AVL_node* bigger)
+    {
+        node->m_smaller = smaller;
+        node->m_bigger = bigger;
+        if (smaller != nullptr) {
+            smaller->m_parent = node;
+        }
+        if (bigger != nullptr) {
+            bigger->m_parent = node;
+        }
+    }
+
+    struct split_result {
+        subtree smaller {};
+        // The node holding the value, detached, nullptr if the value is not in the tree.
+        AVL_node* equal = nullptr;
+        subtree bigger {};
+    };
+
+    /**
+     * @brief Splits a subtree around a value, in O(log n): the path to the value is cut, and
+     * the pieces on each side are joined back from the bottom up.
+     */
+    template <typename K>
+    split_result split_subtree(subtree tree, K const& value)
+    {
+        if (tree.root == nullptr) {
+            return {};
+        }
+        AVL_node* node = tree.root;
+        auto smaller = detach_child(tree, false);
+        auto bigger = detach_child(tree, true);
+        if (m_compare(value, node->m_value)) {
+            auto result = split_subtree(smaller, value);
+            result.bigger = join_subtrees(result.bigger, node, bigger);
+            return result;
+        }
+        if (m_compare(node->m_value, value)) {
+            auto result = split_subtree(bigger, value);
+            result.smaller = join_subtrees(smaller, node, result.smaller);
+            return result;
+        }
+        link_children(node, nullptr, nullptr);
+        node->m_balance = BALANCED;
+        node->update_weight();
+        return { smaller, node, bigger };
+    }
+
+    subtree unite_subtrees(subtree first, subtree second)
+    {
+        if (first.root == nullptr) {
+            return second;
+        }
+        if (second.root == nullptr) {
+            return first;
+        }
+        AVL_node* node = first.root;
+        auto first_smaller = detach_child(first, false);
+        auto first_bigger = detach_child(first, true);
+        auto [second_smaller, equal, second_bigger] = split_subtree(second, node->m_value);
+        if (equal != nullptr) {
+            node->set_count(node->m_count + equal->m_count);
+            destroy_node(equal);
+        }
+        auto smaller = unite_subtrees(first_smaller, second_smaller);
+        auto bigger = unite_subtrees(first_bigger, second_bigger);
+        return join_subtrees(smaller, node, bigger);
+    }
+
+    subtree intersect_subtrees(subtree first, subtree second)
+    {
+        if ((first.root == nullptr) || (second.root == nullptr)) {
+            destroy_subtree(first.root);
+            destroy_subtree(second.root);
+            return {};
+        }
+        AVL_node* node = first.root;
+        auto first_smaller = detach_child(first, false);
+        auto first_bigger = detach_child(first, true);
+        auto [second_smaller, equal, second_bigger] = split_subtree(second, node->m_value);
+        auto smaller = intersect_subtrees(first_smaller, second_smaller);
+        auto bigger = intersect_subtrees(first_bigger, second_bigger);
+        if (equal == nullptr) {
+            destroy_node(node);
+            return join_subtrees(smaller, bigger);
+        }
+        node->set_count(std::min<uint32_t>(node->m_count, equal->m_count));
+        destroy_node(equal);
+        return join_subtrees(smaller, node, bigger);
+    }
+
+    subtree subtract_subtrees(subtree first, subtree second)
+    {
+        if ((first.root == nullptr) || (second.root == nullptr)) {
+            destroy_subtree(second.root);
+            return first;
+        }
+        AVL_node* node = first.root;
+        auto first_smaller = detach_child(first, false);
+        auto first_bigger = detach_child(first, true);
+        auto [second_smaller, equal, second_bigger] = split_subtree(second, node->m_value);
+        auto smaller = subtract_subtrees(first_smaller, second_smaller);
+        auto bigger = subtract_subtrees(first_bigger, second_bigger);
+        if ((equal != nullptr) && (equal->m_count >= node->m_count)) {
+            destroy_node(equal);
+            destroy_node(node);
+            return join_subtrees(smaller, bigger);
+        }
+        if (equal != nullptr) {
+            node->set_count(node->m_count - equal->m_count);
+            destroy_node(equal);
+        }
+        return join_subtrees(smaller, node, bigger);
+    }
+
+    /**
+     * @brief Adds an unlinked node of other to this tree, its count adding to an equal value's,
+     * and its value moved to a new node if other's allocator cannot be used here.
+     */
+    void move_node(AVL_tree& other, AVL_node* node)
+    {
+        AVL_node* parent = nullptr;
+        AVL_node* found = find_node(node->m_value, &parent);
+        if ((found != nullptr) && !is_vacant(found)) {
+            found->set_count(found->m_count + node->m_count);
+            update_weights_uptree(found);
+            other.destroy_node(node);
+            return;
+        }
+        if constexpr (!node_traits::is_always_equal::value) {
+            if (!(m_alloc == other.m_alloc)) {
+                AVL_node* moved = create_node(parent, std::move(node->m_value));
+                moved->set_count(node->m_count);
+                moved->update_weight();
+                other.destroy_node(node);
+                node = moved;
             }
+        }
+        node->m_parent = parent;
+        link_children(node, nullptr, nullptr);
+        node->m_balance = BALANCED;
+        node->update_weight();
+        if (found != nullptr) {
+            revive(found, node);
+        } else {
+            link_new_node(node);
+        }
+    }
 
-            return node_statuses::SUCCESS;
+    /**
+     * @brief Looks key up and only constructs a node from args if it is not found.
+     */
+    template <typename K, typename... Args>
+    std::pair<const_iterator, bool> insert_if_new(K const& key, Args&&... args)
+    {
+        if (auto parent = parent_after_last_added(key); parent != nullptr) {
+            return { link_new_node(create_node(parent, std::forward<Args>(args)...)), true };
         }
+        return insert_below(m_head, key, std::forward<Args>(args)...);
+    }
 
-        /**
-         * @brief Tests if the tree starting at current node is a valid AVL tree.
-         *
-         * @return height of subtree, message explaining why its not a valid tree. message is empty
-         * if it is a valid tree. value of height is only valid if message is empty (no error).
-         */
-        std::expected<size_t, std::string> test_subtree()
-        {
-            size_t height_smaller = 0;
-            size_t height_bigger = 0;
+    /**
+     * @brief insert_if_new, searching from finger (or from the root without one).
+     */
+    template <typename K, typename... Args>
+    std::pair<const_iterator, bool> insert_near(AVL_node* finger, K const& key, Args&&... args)
+    {
+        if (finger == nullptr) {
+            return insert_if_new(key, std::forward<Args>(args)...);
+        }
+        return insert_below(climb_to_cover(finger, key), key, std::forward<Args>(args)...);
+    }
+
+    /**
+     * @brief The parent a new node of key hangs from, if key falls right after the last added
+     * value (and before its successor) - which it does all along an ascending run of adds.
+     *
+     * @returns nullptr if key is anywhere else, or there is no last added value.
+     */
+    template <typename K>
+    AVL_node* parent_after_last_added(K const& key) const
+    {
+        if ((m_last_added == nullptr) || !m_compare(m_last_added->m_value, key) ||
+            ((m_last_added_next != nullptr) && !m_compare(key, m_last_added_next->m_value))) {
+            return nullptr;
+        }
+        record([](auto& stats) {
+            stats.searches += 1;
+            stats.misses += 1;
+            stats.depth_histogram[1] += 1;
+        });
+        // Of 2 neighbouring nodes, either the first has no bigger child or the second has no
+        // smaller child.
+        return (m_last_added->m_bigger == nullptr) ? m_last_added : m_last_added_next;
+    }
+
+    AVL_job clear_steps_job(size_t budget)
+    {
+        while (!clear_step(budget)) {
+            co_await std::suspend_always {};
+        }
+    }
+
+    void forget_last_added()
+    {
+        m_last_added = nullptr;
+        m_last_added_next = nullptr;
+    }
+
+    /**
+     * @brief insert_if_new, searching only the subtree of start (which must be able to hold key).
+     */
+    template <typename K, typename... Args>
+    std::pair<const_iterator, bool> insert_below(AVL_node* start, K const& key, Args&&... args)
+    {
+        AVL_node* parent = nullptr;
+        auto searched_node = find_node_below(start, key, &parent);
+        if (is_vacant(searched_node)) {
+            return { revive(searched_node, create_node(nullptr, std::forward<Args>(args)...)),
+                true };
+        }
+        // value already exists.
+        if (searched_node != nullptr) {
+            add_duplicate(searched_node);
+            return { const_iterator(searched_node, this), false };
+        }
 
-            if (!((m_balance <= BIGGER_HEAVY) && (m_balance >= SMALLER_HEAVY))) {
-                return std::unexpected { "saved balance is: " + std::to_string(m_balance) };
+        return { link_new_node(create_node(parent, std::forward<Args>(args)...)), true };
+    }
+
+    /**
+     * @brief Hangs a new leaf under its parent (already set in the node) and rebalances.
+     *
+     * @returns Iterator to the new value.
+     */
+    const_iterator link_new_node(AVL_node* new_node)
+    {
+        record([](auto& stats) { stats.adds += 1; });
+        if constexpr (has_lazy_removes) {
+            if (m_lazy.m_nodes != UNKNOWN_NODE_COUNT) {
+                m_lazy.m_nodes += 1;
             }
-            if ((m_smaller == nullptr) && (m_bigger == nullptr)) {
-                if (m_balance != BALANCED) {
-                    return std::unexpected { "leaf node with balance: " +
-                        std::to_string(m_balance) };
+        }
+        auto parent = new_node->m_parent;
+        if (parent == nullptr) {
+            m_head = new_node;
+            m_height = 1;
+            m_last_added = new_node;
+            m_last_added_next = nullptr;
+            return const_iterator(new_node, this);
+        }
+
+        bool is_smaller_child = false;
+        if (m_compare(new_node->m_value, parent->m_value)) {
+            parent->m_smaller = new_node;
+            is_smaller_child = true;
+            m_last_added_next = parent;
+        } else {
+            parent->m_bigger = new_node;
+            is_smaller_child = false;
+            // The successor of parent, which had no bigger child, is the first ancestor it is
+            // smaller than. Only a long run of bigger links (ascending order) makes this climb
+            // long, and the successor is then already known.
+            if (parent != m_last_added) {
+                AVL_node* node = parent;
+                while ((node->m_parent != nullptr) && (node == node->m_parent->m_bigger)) {
+                    node = node->m_parent;
                 }
-                return 1;
+                m_last_added_next = node->m_parent;
             }
+        }
+        m_last_added = new_node;
+        update_weights_uptree(parent);
+        if (rebalance_uptree(parent, is_smaller_child, 1)) {
+            m_height += 1;
+        }
+        return const_iterator(new_node, this);
+    }
 
-            if (m_bigger != nullptr) {
-                if (m_value >= m_bigger->m_value) {
-                    return std::unexpected { "value >= bigger value" };
-                }
+    /**
+     * @brief Search for a value in the tree and return its node if found, and optionaly its
+     * (potential) parent.
+     *
+     * @param[in] value The node value to search for
+     * @param[out] parent Optional parent of the node or potential parent if not found.
+     *
+     * @returns The node if found, nullptr otherwise.
+     */
+    template <typename K>
+    AVL_node* find_node(K const& value, AVL_node** parent) const
+    {
+        return find_node_below(m_head, value, parent);
+    }
 
-                auto bigger_out = m_bigger->test_subtree();
-                if (!bigger_out) {
-                    return std::unexpected { bigger_out.error() };
+    /**
+     * @brief find_node, searching only the subtree of start (which must be able to hold value).
+     */
+    template <typename K>
+    AVL_node* find_node_below(AVL_node* start, K const& value, AVL_node** parent) const
+    {
+        AVL_node* curr_node = start;
+        AVL_node* curr_parent = (start == nullptr) ? nullptr : start->m_parent;
+        [[maybe_unused]] size_t depth = 0;
+
+        if constexpr (is_select_search<K>) {
+            // Down to a leaf, keeping the last node not smaller than value: it is the one equal
+            // to value, if any.
+            AVL_node* candidate = nullptr;
+            while (curr_node != nullptr) {
+                if constexpr (has_statistics) {
+                    depth += 1;
                 }
-                height_bigger = *bigger_out;
+                bool is_bigger = m_compare(curr_node->m_value, value);
+                candidate = select(is_bigger, candidate, curr_node);
+                curr_parent = curr_node;
+                curr_node = select(is_bigger, curr_node->m_bigger, curr_node->m_smaller);
             }
-
-            if (m_smaller != nullptr) {
-                if (m_value <= m_smaller->m_value) {
-                    return std::unexpected { "value <= smaller_value" };
+            if ((candidate != nullptr) && !m_compare(value, candidate->m_value)) {
+                curr_node = candidate;
+                curr_parent = candidate->m_parent;
+            }
+        } else {
+            while (curr_node != nullptr) {
+                if constexpr (has_statistics) {
+                    depth += 1;
                 }
-
-                auto smaller_out = m_smaller->test_subtree();
-                if (!smaller_out) {
-                    return std::unexpected { smaller_out.error() };
+                if (m_compare(value, curr_node->m_value)) {
+                    curr_parent = curr_node;
+                    curr_node = curr_node->m_smaller;
+                } else if (m_compare(curr_node->m_value, value)) {
+                    curr_parent = curr_node;
+                    curr_node = curr_node->m_bigger;
+                } else {
+                    break;
                 }
-                height_smaller = *smaller_out;
             }
+        }
 
-            auto balance = height_bigger - height_smaller;
-            if (balance != m_balance) {
-                return std::unexpected { "calculated balance differs from saved balance: " +
-                    std::to_string(balance) + " != " + std::to_string(m_balance) };
-            }
+        if (parent != nullptr) {
+            *parent = curr_parent;
+        }
+        record([is_hit = curr_node != nullptr, depth](auto& stats) {
+            stats.searches += 1;
+            (is_hit ? stats.hits : stats.misses) += 1;
+            stats.depth_histogram[std::min(depth, AVL_tree_stats::DEPTH_BUCKETS - 1)] += 1;
+        });
+        return curr_node;
+    }
 
-            return std::max(height_bigger, height_smaller) + 1;
+    /**
+     * @brief The lowest ancestor of finger (finger included) whose subtree can hold key. The
+     * root if there is no finger.
+     *
+     * @note Costs O(log d) where d is the distance between key and finger.
+     */
+    template <typename K>
+    AVL_node* climb_to_cover(AVL_node* finger, K const& key) const
+    {
+        if (finger == nullptr) {
+            return m_head;
         }
-#endif // ifdef DEBUG
+        // Only the bound on the side of key can exclude it, the other one is beyond finger.
+        bool is_below = m_compare(key, finger->m_value);
+        while (finger->m_parent != nullptr) {
+            auto parent = finger->m_parent;
+            // A smaller child's subtree holds everything up to parent, a bigger child's
+            // everything down from it.
+            if (is_below ? ((finger == parent->m_bigger) && m_compare(parent->m_value, key))
+                         : ((finger == parent->m_smaller) && m_compare(key, parent->m_value))) {
+                break;
+            }
+            finger = parent;
+        }
+        return finger;
+    }
 
-        std::unique_ptr<AVL_node> m_smaller = nullptr;
-        std::unique_ptr<AVL_node> m_bigger = nullptr;
-        AVL_node* m_parent = nullptr;
-        T m_value;
-        uint32_t m_count;
-        int8_t m_balance;
+    size_t count_duplicates(std::vector<T> const& sorted) const
+    {
+        size_t duplicates = 0;
+        for (size_t i = 1; i < sorted.size(); ++i) {
+            if (!m_compare(sorted[i - 1], sorted[i])) {
+                duplicates += 1;
+            }
+        }
+        return duplicates;
+    }
 
-    private:
-        void rotate_to_smaller(bool is_first_rotation = true)
-        {
-            if ((m_smaller->m_balance == BIGGER_HEAVY) && (is_first_rotation)) {
-                m_smaller->rotate_to_bigger(false);
+    /**
+     * @brief Builds a balanced subtree out of the next unique_count distinct values of a
+     * sorted range, consuming them in order.
+     *
+     * @note The recursion depth is the height of the built subtree.
+     */
+    template <typename It, typename S>
+    AVL_node* build_sorted(It& first, S const& last, size_t unique_count, AVL_node* parent)
+    {
+        if (unique_count == 0) {
+            return nullptr;
+        }
+        size_t smaller_count = (unique_count - 1) / 2;
+        size_t bigger_count = unique_count - 1 - smaller_count;
+
+        AVL_node* smaller = build_sorted(first, last, smaller_count, nullptr);
+        AVL_node* node = nullptr;
+        try {
+            node = create_node(parent, *first);
+            node->set_count(AVL_iterator_count(first));
+            ++first;
+            while ((first != last) && !m_compare(node->m_value, *first)) {
+                node->set_count(node->m_count + AVL_iterator_count(first));
+                ++first;
             }
-            // Swap contents of this and m_bigger.
-            // The ownership of the head node is inaccessible so changing location is the only
-            // solution.
-            swap_contents(this, m_smaller.get());
+        } catch (...) {
+            if (node != nullptr) {
+                destroy_node(node);
+            }
+            destroy_subtree(smaller);
+            throw;
+        }
 
-            // Move subtrees to achieve BST property again.
-            std::swap(m_bigger, m_smaller);
-            std::swap(m_bigger->m_smaller, m_bigger->m_bigger);
-            std::swap(m_bigger->m_bigger, m_smaller);
-            if (m_smaller != nullptr) {
-                m_smaller->m_parent = this;
+        node->m_smaller = smaller;
+        if (smaller != nullptr) {
+            smaller->m_parent = node;
+        }
+        try {
+            node->m_bigger = build_sorted(first, last, bigger_count, node);
+        } catch (...) {
+            destroy_subtree(node);
+            throw;
+        }
+        // A subtree of n nodes built this way is bit_width(n) high.
+        node->m_balance = static_cast<int8_t>(
+            std::bit_width(bigger_count) - std::bit_width(smaller_count));
+        node->update_weight();
+
+        return node;
+    }
+
+    // More levels than any AVL tree which fits in memory, so a deeper path means a broken tree.
+    static constexpr size_t MAX_VALID_HEIGHT = 128;
+
+    /**
+     * @brief Summary of a checked subtree, for checking its parent.
+     */
+    struct subtree_check {
+        size_t height = 0;
+        AVL_node const* first = nullptr;
+        AVL_node const* last = nullptr;
+    };
+
+    std::string validate_tree(int depth) const
+    {
+        if (m_head == nullptr) {
+            return (m_height == 0) ? "" : "empty tree with height: " + std::to_string(m_height);
+        }
+        if (m_head->m_parent != nullptr) {
+            return "root has a parent";
+        }
+        auto check = (depth == 0) ? check_subtree(m_head) : check_subtree_parallel(m_head, depth);
+        if (!check) {
+            return check.error();
+        }
+        if (check->height != m_height) {
+            return "saved height is: " + std::to_string(m_height) +
+                ", actual height: " + std::to_string(check->height);
+        }
+        if constexpr (has_lazy_removes) {
+            size_type nodes = 0;
+            size_type vacant = 0;
+            for (const_iterator it(m_head->get_min(), this); it.m_node != nullptr;
+                 it.step_forward()) {
+                nodes += 1;
+                vacant += is_vacant(it.m_node) ? 1 : 0;
             }
-            if (m_bigger->m_smaller != nullptr) {
-                m_bigger->m_smaller->m_parent = m_bigger.get();
+            if ((vacant != m_lazy.m_vacant) ||
+                ((m_lazy.m_nodes != UNKNOWN_NODE_COUNT) && (nodes != m_lazy.m_nodes))) {
+                return "saved node counts differ from the actual ones: " + std::to_string(nodes) +
+                    " nodes, " + std::to_string(vacant) + " vacant";
             }
-            if (m_bigger->m_bigger != nullptr) {
-                m_bigger->m_bigger->m_parent = m_bigger.get();
+            if (vacant * 2 > nodes) {
+                return "more vacant nodes than others";
             }
+        }
+        return "";
+    }
 
-            auto tmp = m_balance;
-            if ((tmp == SMALLER_HEAVY) && (m_bigger->m_balance == SMALLER_HEAVY)) {
-                m_balance = BIGGER_HEAVY;
-            } else if ((tmp == SMALLER_UB) && (m_bigger->m_balance == SMALLER_UB)) {
-                m_balance = BALANCED;
-            } else {
-                m_balance = m_bigger->m_balance + BIGGER_HEAVY;
+    /**
+     * @brief Checks a node's own invariants, given the actual heights of its subtrees.
+     */
+    std::string check_node(AVL_node const* node, size_t smaller_height, size_t bigger_height) const
+    {
+        if ((node->m_count == 0) && !has_lazy_removes) {
+            return "node with a count of 0";
+        }
+        auto balance =
+            static_cast<ptrdiff_t>(bigger_height) - static_cast<ptrdiff_t>(smaller_height);
+        if ((balance > BIGGER_HEAVY) || (balance < SMALLER_HEAVY)) {
+            return "unbalanced node, heights: " + std::to_string(smaller_height) + ", " +
+                std::to_string(bigger_height);
+        }
+        if (balance != node->m_balance) {
+            return "calculated balance differs from saved balance: " + std::to_string(balance) +
+                " != " + std::to_string(node->m_balance);
+        }
+        if constexpr (has_order_statistics) {
+            if (node->m_weight !=
+                node->m_count + AVL_node::get_weight(node->m_smaller) +
+                    AVL_node::get_weight(node->m_bigger)) {
+                return "saved weight is: " + std::to_string(node->m_weight);
             }
+        }
+        return "";
+    }
 
-            if ((tmp == SMALLER_HEAVY) && (m_bigger->m_balance == BIGGER_HEAVY)) {
-                m_bigger->m_balance = BALANCED;
-            } else {
-                m_bigger->m_balance = tmp + BIGGER_HEAVY - m_bigger->m_balance;
+    /**
+     * @brief Checks a subtree in order without recursion. Each node is visited three times:
+     * coming from its parent, from its smaller subtree and from its bigger subtree.
+     */
+    std::expected<subtree_check, std::string> check_subtree(AVL_node const* root) const
+    {
+        enum class visits { FROM_PARENT, FROM_SMALLER, FROM_BIGGER };
+        // heights[d] holds the heights of the smaller and bigger subtrees of the node at depth
+        // d - 1 on the current path.
+        std::array<std::array<size_t, 2>, MAX_VALID_HEIGHT + 1> heights {};
+        subtree_check check {};
+        AVL_node const* node = root;
+        size_t depth = 0;
+        auto visit = visits::FROM_PARENT;
+
+        while (true) {
+            if (visit == visits::FROM_PARENT) {
+                if (depth == MAX_VALID_HEIGHT) {
+                    return std::unexpected { "path deeper than any AVL tree" };
+                }
+                heights[depth + 1] = { 0, 0 };
+                if (node->m_smaller != nullptr) {
+                    if (node->m_smaller->m_parent != node) {
+                        return std::unexpected { "child's parent link is wrong" };
+                    }
+                    node = node->m_smaller;
+                    depth += 1;
+                    continue;
+                }
+                visit = visits::FROM_SMALLER;
             }
-        }
 
-        void rotate_to_bigger(bool is_first_rotation = true)
-        {
-            if ((m_bigger->m_balance == SMALLER_HEAVY) && (is_first_rotation)) {
-                m_bigger->rotate_to_smaller(false);
+            if (visit == visits::FROM_SMALLER) {
+                if ((check.last != nullptr) && !m_compare(check.last->m_value, node->m_value)) {
+                    return std::unexpected { "values are out of order" };
+                }
+                if (check.first == nullptr) {
+                    check.first = node;
+                }
+                check.last = node;
+                if (node->m_bigger != nullptr) {
+                    if (node->m_bigger->m_parent != node) {
+                        return std::unexpected { "child's parent link is wrong" };
+                    }
+                    node = node->m_bigger;
+                    depth += 1;
+                    visit = visits::FROM_PARENT;
+                    continue;
+                }
             }
-            // Swap contents of this and m_bigger.
-            // The ownership of the head node is inaccessible so changing location is the only
-            // solution.
-            swap_contents(this, m_bigger.get());
 
-            // Move the subtrees to achieve BST property again.
-            std::swap(m_smaller, m_bigger);
-            std::swap(m_smaller->m_smaller, m_smaller->m_bigger);
-            std::swap(m_smaller->m_smaller, m_bigger);
-            if (m_bigger != nullptr) {
-                m_bigger->m_parent = this;
+            auto [smaller_height, bigger_height] = heights[depth + 1];
+            auto error = check_node(node, smaller_height, bigger_height);
+            if (!error.empty()) {
+                return std::unexpected { error };
             }
-            if (m_smaller->m_smaller != nullptr) {
-                m_smaller->m_smaller->m_parent = m_smaller.get();
+            auto height = std::max(smaller_height, bigger_height) + 1;
+            if (node == root) {
+                check.height = height;
+                return check;
             }
-            if (m_smaller->m_bigger != nullptr) {
-                m_smaller->m_bigger->m_parent = m_smaller.get();
+            bool is_bigger = node == node->m_parent->m_bigger;
+            heights[depth][is_bigger] = height;
+            visit = is_bigger ? visits::FROM_BIGGER : visits::FROM_SMALLER;
+            node = node->m_parent;
+            depth -= 1;
+        }
+    }
+
+    /**
+     * @brief check_subtree, with the subtrees of the depth top levels checked on their own
+     * threads.
+     */
+    std::expected<subtree_check, std::string> check_subtree_parallel(AVL_node const* node,
+        int depth) const
+    {
+        if (node == nullptr) {
+            return subtree_check {};
+        }
+        if (depth == 0) {
+            return check_subtree(node);
+        }
+        for (AVL_node const* child : { node->m_smaller, node->m_bigger }) {
+            if ((child != nullptr) && (child->m_parent != node)) {
+                return std::unexpected { "child's parent link is wrong" };
             }
+        }
 
-            auto tmp = m_balance;
-            if ((tmp == BIGGER_HEAVY) && (m_smaller->m_balance == BIGGER_HEAVY)) {
-                m_balance = SMALLER_HEAVY;
-            } else if ((tmp == BIGGER_UB) && (m_smaller->m_balance == BIGGER_UB)) {
-                m_balance = BALANCED;
-            } else {
-                m_balance = m_smaller->m_balance + SMALLER_HEAVY;
+        std::expected<subtree_check, std::string> smaller {};
+        std::expected<subtree_check, std::string> bigger {};
+        fork_join([&] { smaller = check_subtree_parallel(node->m_smaller, depth - 1); },
+            [&] { bigger = check_subtree_parallel(node->m_bigger, depth - 1); });
+        if (!smaller) {
+            return smaller;
+        }
+        if (!bigger) {
+            return bigger;
+        }
+        if (((smaller->last != nullptr) && !m_compare(smaller->last->m_value, node->m_value)) ||
+            ((bigger->first != nullptr) && !m_compare(node->m_value, bigger->first->m_value))) {
+            return std::unexpected { "values are out of order" };
+        }
+        auto error = check_node(node, smaller->height, bigger->height);
+        if (!error.empty()) {
+            return std::unexpected { error };
+        }
+        return subtree_check { std::max(smaller->height, bigger->height) + 1,
+            (smaller->first != nullptr) ? smaller->first : node,
+            (bigger->last != nullptr) ? bigger->last : node };
+    }
+
+    /**
+     * @brief How many top levels of a tree to split across threads - enough for a subtree per
+     * hardware thread, and at least 2 subtrees.
+     */
+    static int parallel_depth()
+    {
+        auto thread_count = std::max(std::thread::hardware_concurrency(), 2U);
+        return static_cast<int>(std::bit_width(thread_count - 1));
+    }
+
+    /**
+     * @brief Runs forked on a new thread and local on this one, and rethrows the exception of
+     * either once both are done. Runs both here if no thread can be started.
+     */
+    template <typename F, typename G>
+    static void fork_join(F&& forked, G&& local)
+    {
+        std::exception_ptr forked_error {};
+        std::thread worker {};
+        try {
+            worker = std::thread([&forked, &forked_error] {
+                try {
+                    forked();
+                } catch (...) {
+                    forked_error = std::current_exception();
+                }
+            });
+        } catch (std::system_error const&) {
+            forked();
+            local();
+            return;
+        }
+
+        std::exception_ptr local_error {};
+        try {
+            local();
+        } catch (...) {
+            local_error = std::current_exception();
+        }
+        worker.join();
+        if (local_error) {
+            std::rethrow_exception(local_error);
+        }
+        if (forked_error) {
+            std::rethrow_exception(forked_error);
+        }
+    }
+
+    /**
+     * @brief Number of runs of equal values in a sorted range.
+     */
+    template <typename It, typename S>
+    size_t count_runs(It first, S const& last) const
+    {
+        size_t run_count = 0;
+        for (auto it = first; it != last;) {
+            auto run_start = it;
+            do {
+                ++it;
+            } while ((it != last) && !m_compare(*run_start, *it));
+            run_count += 1;
+        }
+        return run_count;
+    }
+
+    /**
+     * @brief A sorted range cut into chunks at run boundaries, and the index of the first run
+     * of every chunk.
+     */
+    template <typename It>
+    struct run_index {
+        // One more than the chunks, the last one is the end of the range.
+        std::vector<It> m_chunk_firsts;
+        std::vector<size_t> m_run_offsets;
+    };
+
+    /**
+     * @brief Stores the run counts of the chunks [first_chunk, last_chunk) in m_run_offsets,
+     * counting on separate threads.
+     */
+    template <typename It>
+    void count_chunk_runs(run_index<It>& runs, size_t first_chunk, size_t last_chunk) const
+    {
+        if (last_chunk - first_chunk == 1) {
+            runs.m_run_offsets[first_chunk] =
+                count_runs(runs.m_chunk_firsts[first_chunk], runs.m_chunk_firsts[last_chunk]);
+            return;
+        }
+        size_t middle_chunk = first_chunk + (last_chunk - first_chunk) / 2;
+        fork_join([&] { count_chunk_runs(runs, first_chunk, middle_chunk); },
+            [&] { count_chunk_runs(runs, middle_chunk, last_chunk); });
+    }
+
+    /**
+     * @brief Iterator to the first value of a run, scanning only its chunk.
+     */
+    template <typename It>
+    It find_run(run_index<It> const& runs, size_t run) const
+    {
+        auto chunk = static_cast<size_t>(
+            std::upper_bound(runs.m_run_offsets.begin(), runs.m_run_offsets.end() - 1, run) -
+            runs.m_run_offsets.begin() - 1);
+        auto it = runs.m_chunk_firsts[chunk];
+        for (auto skipped = runs.m_run_offsets[chunk]; skipped < run; ++skipped) {
+            auto run_start = it;
+            do {
+                ++it;
+            } while (!m_compare(*run_start, *it));
+        }
+        return it;
+    }
+
+    /**
+     * @brief build_sorted for the runs [first_run, first_run + unique_count), with the
+     * smaller subtree of each of the depth top levels built on its own thread.
+     */
+    template <typename It>
+    AVL_node* build_sorted_parallel(run_index<It> const& runs,
+        size_t first_run,
+        size_t unique_count,
+        AVL_node* parent,
+        int depth)
+    {
+        auto last = runs.m_chunk_firsts.back();
+        if ((depth == 0) || (unique_count < 2)) {
+            auto first = find_run(runs, first_run);
+            return build_sorted(first, last, unique_count, parent);
+        }
+        size_t smaller_count = (unique_count - 1) / 2;
+        size_t bigger_count = unique_count - 1 - smaller_count;
+
+        AVL_node* smaller = nullptr;
+        AVL_node* node = nullptr;
+        try {
+            fork_join(
+                [&] {
+                    smaller = build_sorted_parallel(runs, first_run, smaller_count, nullptr,
+                        depth - 1);
+                },
+                [&] {
+                    auto it = find_run(runs, first_run + smaller_count);
+                    node = create_node(parent, *it);
+                    node->set_count(AVL_iterator_count(it));
+                    for (++it; (it != last) && !m_compare(node->m_value, *it); ++it) {
+                        node->set_count(node->m_count + AVL_iterator_count(it));
+                    }
+                    node->m_bigger = build_sorted_parallel(runs,
+                        first_run + smaller_count + 1,
+                        bigger_count,
+                        node,
+                        depth - 1);
+                });
+        } catch (...) {
+            destroy_subtree(smaller);
+            destroy_subtree(node);
+            throw;
+        }
+
+        node->m_smaller = smaller;
+        if (smaller != nullptr) {
+            smaller->m_parent = node;
+        }
+        node->m_balance = static_cast<int8_t>(
+            std::bit_width(bigger_count) - std::bit_width(smaller_count));
+        node->update_weight();
+        return node;
+    }
+
+    /**
+     * @brief Calls fn(value, count) for a subtree in order, or with the smaller subtrees of the
+     * depth top levels visited on their own threads.
+     */
+    template <typename F>
+    static void visit_subtree(AVL_node const* node, F& fn, int depth)
+    {
+        if (node == nullptr) {
+            return;
+        }
+        if (depth == 0) {
+            visit_subtree(node->m_smaller, fn, 0);
+            if (!is_vacant(node)) {
+                fn(std::as_const(node->m_value), uint32_t { node->m_count });
             }
+            visit_subtree(node->m_bigger, fn, 0);
+            return;
+        }
+        fork_join([&] { visit_subtree(node->m_smaller, fn, depth - 1); },
+            [&] {
+                if (!is_vacant(node)) {
+                    fn(std::as_const(node->m_value), uint32_t { node->m_count });
+                }
+                visit_subtree(node->m_bigger, fn, depth - 1);
+            });
+    }
+
+    /**
+     * @brief destroy_subtree, with the subtrees of the depth top levels freed on their own
+     * threads.
+     */
+    void destroy_subtree_parallel(AVL_node* node, int depth)
+    {
+        if ((node == nullptr) || (depth == 0)) {
+            destroy_subtree(node);
+            return;
+        }
+        fork_join([&] { destroy_subtree_parallel(node->m_smaller, depth - 1); },
+            [&] { destroy_subtree_parallel(node->m_bigger, depth - 1); });
+        destroy_node(node);
+    }
+
+    /**
+     * @brief Frees a subtree in O(n) without a stack: a node with a smaller child is rotated
+     * below it, so the subtree unrolls into a chain of bigger links which is freed as it goes.
+     */
+    void destroy_subtree(AVL_node* node)
+    {
+        destroy_steps(node, std::numeric_limits<size_t>::max());
+    }
 
-            if ((tmp == BIGGER_HEAVY) && (m_smaller->m_balance == SMALLER_HEAVY)) {
-                m_smaller->m_balance = BALANCED;
+    /**
+     * @brief At most steps steps of destroy_subtree, each a rotation or a free. Only the links
+     * to children are used, so what is left can be resumed from its root.
+     *
+     * @returns The root of the nodes left.
+     */
+    AVL_node* destroy_steps(AVL_node* node, size_t steps)
+    {
+        for (; (node != nullptr) && (steps > 0); --steps) {
+            if (auto smaller = node->m_smaller; smaller != nullptr) {
+                node->m_smaller = smaller->m_bigger;
+                smaller->m_bigger = node;
+                node = smaller;
             } else {
-                m_smaller->m_balance = tmp + SMALLER_HEAVY - m_smaller->m_balance;
+                auto bigger = node->m_bigger;
+                destroy_node(node);
+                node = bigger;
             }
         }
+        return node;
+    }
 
-        static void swap_contents(AVL_node* first, AVL_node* second)
-        {
-            std::swap(first->m_value, second->m_value);
-            std::swap(first->m_count, second->m_count);
+    /**
+     * @brief Frees every node. An arena allocator which is solely owned by this tree is
+     * simply released in O(1) when the nodes need no destruction.
+     */
+    void destroy_tree()
+    {
+        forget_last_added();
+        if constexpr (has_lazy_removes) {
+            m_lazy = { 0, 0 };
         }
-    };
+        if constexpr (std::is_trivially_destructible_v<AVL_node> &&
+            requires(node_allocator& alloc) {
+                { alloc.release() } -> std::same_as<bool>;
+            }) {
+            if (((m_head != nullptr) || (m_teardown != nullptr)) && m_alloc.release()) {
+                m_head = nullptr;
+                m_teardown = nullptr;
+                m_height = 0;
+                return;
+            }
+        }
+        destroy_subtree(std::exchange(m_teardown, nullptr));
+        if constexpr (is_parallel_safe) {
+            if ((std::thread::hardware_concurrency() > 1) &&
+                (m_height >= PARALLEL_DESTROY_HEIGHT)) {
+                destroy_subtree_parallel(m_head, parallel_depth());
+                m_head = nullptr;
+                m_height = 0;
+                return;
+            }
+        }
+        destroy_subtree(m_head);
+        m_head = nullptr;
+        m_height = 0;
+    }
 
-    std::unique_ptr<AVL_node> m_head = nullptr;
+    [[no_unique_address]] Compare m_compare {};
+    [[no_unique_address]] node_allocator m_alloc {};
+    AVL_node* m_head = nullptr;
+    // Kept up to date by every update, for an O(1) height().
+    size_type m_height = 0;
+    // The node of the last added value and its successor (nullptr for none), between which an
+    // ascending run of adds is linked without a search.
+    AVL_node* m_last_added = nullptr;
+    AVL_node* m_last_added_next = nullptr;
+    // Nodes left to free by clear_step().
+    AVL_node* m_teardown = nullptr;
+    [[no_unique_address]] lazy_counts_type m_lazy {};
+    // Updated by the const lookups too.
+    [[no_unique_address]] mutable stats_type m_stats {};
 };
 
 #endif // AVL_TREE_H
\ No newline at end of file
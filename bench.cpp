@@ -0,0 +1,607 @@
+/*
+   Benchmark suite for the AVL_tree library, compared against std::set and std::multiset, and
+   read scaling of concurrent_AVL_tree against a mutex protected AVL_tree.
+
+   Usage: bench [--max-size=N] [--filter=SUBSTRING]
+       --max-size    largest tree size to run, rounded down to a power of 10 (default 10^6,
+                     up to 10^8).
+       --filter      only run benchmarks whose name contains SUBSTRING.
+*/
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#if defined(__linux__) && __has_include(<linux/perf_event.h>)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define BENCH_HAS_PERF 1
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif // ifdef __GLIBC__
+
+#include "AVL_pool_allocator.hpp"
+#include "AVL_tree.hpp"
+#include "compact_AVL_tree.hpp"
+#include "concurrent_AVL_tree.hpp"
+
+/**
+ * @brief Bytes currently allocated on the heap, where the C library can tell.
+ */
+static std::optional<size_t> heap_in_use()
+{
+#ifdef __GLIBC__
+    auto info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#else
+    return std::nullopt;
+#endif // ifdef __GLIBC__
+}
+
+/**
+ * @brief Counts last level cache misses of this thread, where the kernel allows it.
+ */
+class cache_miss_counter {
+public:
+    cache_miss_counter()
+    {
+#ifdef BENCH_HAS_PERF
+        perf_event_attr attr {};
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        m_fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif // ifdef BENCH_HAS_PERF
+    }
+
+    cache_miss_counter(cache_miss_counter const&) = delete;
+    cache_miss_counter& operator=(cache_miss_counter const&) = delete;
+
+    ~cache_miss_counter()
+    {
+#ifdef BENCH_HAS_PERF
+        if (m_fd >= 0) {
+            close(m_fd);
+        }
+#endif // ifdef BENCH_HAS_PERF
+    }
+
+    void start()
+    {
+#ifdef BENCH_HAS_PERF
+        if (m_fd >= 0) {
+            ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif // ifdef BENCH_HAS_PERF
+    }
+
+    std::optional<uint64_t> stop()
+    {
+#ifdef BENCH_HAS_PERF
+        uint64_t count = 0;
+        if ((m_fd >= 0) && (ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0) == 0) &&
+            (read(m_fd, &count, sizeof(count)) == sizeof(count))) {
+            return count;
+        }
+#endif // ifdef BENCH_HAS_PERF
+        return std::nullopt;
+    }
+
+private:
+    int m_fd = -1;
+};
+
+/**
+ * @brief Keeps the optimizer from dropping a computed value.
+ */
+template <typename V>
+inline void do_not_optimize(V const& value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "r,m"(value) : "memory");
+#else
+    static volatile V sink;
+    sink = value;
+#endif
+}
+
+static uint64_t mix64(uint64_t value)
+{
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+/**
+ * @brief Zipf distributed ranks in [0, n) using the method of Gray et al. (as in YCSB).
+ */
+class zipf_generator {
+public:
+    zipf_generator(uint64_t n, double theta, uint64_t seed):
+        m_n(n),
+        m_theta(theta),
+        m_state(seed)
+    {
+        m_zetan = zeta(n, theta);
+        double zeta2 = 1.0 + 1.0 / std::pow(2.0, theta);
+        m_alpha = 1.0 / (1.0 - theta);
+        m_eta = (1.0 - std::pow(2.0 / static_cast<double>(n), 1.0 - theta)) /
+            (1.0 - zeta2 / m_zetan);
+    }
+
+    uint64_t next()
+    {
+        m_state = mix64(m_state + 0x9e3779b97f4a7c15ULL);
+        double u = static_cast<double>(m_state >> 11) * 0x1.0p-53;
+        double uz = u * m_zetan;
+        if (uz < 1.0) {
+            return 0;
+        }
+        if (uz < 1.0 + std::pow(0.5, m_theta)) {
+            return 1;
+        }
+        auto rank = static_cast<uint64_t>(
+            static_cast<double>(m_n) * std::pow(m_eta * u - m_eta + 1.0, m_alpha));
+        return std::min(rank, m_n - 1);
+    }
+
+private:
+    /**
+     * @brief sum of 1 / i^theta for i in [1, n]. O(n), so cached between generators.
+     */
+    static double zeta(uint64_t n, double theta)
+    {
+        static std::map<std::pair<uint64_t, double>, double> cache {};
+        auto [it, is_new] = cache.try_emplace({ n, theta }, 0.0);
+        if (is_new) {
+            for (uint64_t i = 1; i <= n; ++i) {
+                it->second += 1.0 / std::pow(static_cast<double>(i), theta);
+            }
+        }
+        return it->second;
+    }
+
+    uint64_t m_n;
+    double m_theta;
+    double m_zetan = 0;
+    double m_alpha = 0;
+    double m_eta = 0;
+    uint64_t m_state;
+};
+
+enum class distribution {
+    SEQUENTIAL,
+    RANDOM,
+    ZIPF,
+};
+
+static std::string_view distribution_name(distribution dist)
+{
+    switch (dist) {
+    case distribution::SEQUENTIAL:
+        return "sequential";
+    case distribution::RANDOM:
+        return "random";
+    case distribution::ZIPF:
+        return "zipf";
+    }
+    return "";
+}
+
+/**
+ * @brief count keys out of a domain of domain_size distinct keys, in the given distribution.
+ * Sequential keys are ascending, random ones are uniform over the domain and zipf ones repeat
+ * the popular keys (scrambled so they are not all neighbours).
+ */
+static std::vector<uint64_t> make_keys(distribution dist,
+    size_t count,
+    size_t domain_size,
+    uint64_t seed)
+{
+    std::vector<uint64_t> keys {};
+    keys.reserve(count);
+    if (dist == distribution::ZIPF) {
+        zipf_generator zipf { domain_size, 0.99, seed };
+        for (size_t i = 0; i < count; ++i) {
+            keys.push_back(mix64(zipf.next()));
+        }
+        return keys;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (dist == distribution::SEQUENTIAL) {
+            keys.push_back(i % domain_size);
+        } else {
+            keys.push_back(mix64(mix64(i + seed) % domain_size));
+        }
+    }
+    return keys;
+}
+
+/* Uniform interface over the benchmarked containers. */
+template <typename Container>
+void bench_add(Container& container, uint64_t key)
+{
+    if constexpr (requires { container.add(key); }) {
+        container.add(key);
+    } else {
+        container.insert(key);
+    }
+}
+
+template <typename Container>
+bool bench_contains(Container const& container, uint64_t key)
+{
+    return container.contains(key);
+}
+
+template <typename Container>
+void bench_remove(Container& container, uint64_t key)
+{
+    if constexpr (requires { container.remove(key); }) {
+        container.remove(key);
+    } else {
+        auto it = container.find(key);
+        if (it != container.end()) {
+            container.erase(it);
+        }
+    }
+}
+
+/* Batched operations, for the containers which have them. */
+template <typename Container>
+constexpr bool has_batches = requires(Container& container, std::span<uint64_t> keys) {
+    container.add_batch(keys);
+};
+
+struct bench_result {
+    double ns_per_op;
+    std::optional<double> bytes_per_element;
+    std::optional<uint64_t> cache_misses;
+    size_t operations;
+};
+
+enum class workload {
+    INSERT,
+    CONTAINS,
+    REMOVE,
+    CONTAINS_AFTER_REMOVE,
+    MIXED,
+    INSERT_BATCH,
+    CONTAINS_BATCH,
+    CONTAINS_MANY,
+};
+
+static std::string_view workload_name(workload load)
+{
+    switch (load) {
+    case workload::INSERT:
+        return "insert";
+    case workload::CONTAINS:
+        return "contains";
+    case workload::REMOVE:
+        return "remove";
+    case workload::CONTAINS_AFTER_REMOVE:
+        return "contains_after_remove";
+    case workload::MIXED:
+        return "mixed";
+    case workload::INSERT_BATCH:
+        return "insert_batch";
+    case workload::CONTAINS_BATCH:
+        return "contains_batch";
+    case workload::CONTAINS_MANY:
+        return "contains_many";
+    }
+    return "";
+}
+
+/**
+ * @brief Runs one workload on a fresh container.
+ *
+ * insert:   adds size keys to an empty container.
+ * contains: looks size keys up in a container filled with size random keys (half hit).
+ * remove:   removes size keys from a container filled with exactly those keys.
+ * contains_after_remove: looks size keys up in a container filled with exactly those keys,
+ *           of which every other one was removed (untimed) - the cost of lazy removes.
+ * mixed:    size operations - 50% contains, 25% add, 25% remove - on a half full container.
+ * *_batch:  insert and contains, in batches of BATCH_SIZE keys.
+ * contains_many: contains, through the interleaved lookup in batches of BATCH_SIZE keys.
+ */
+static constexpr size_t BATCH_SIZE = 10'000;
+
+template <typename Container>
+bench_result run_workload(workload load, distribution dist, size_t size)
+{
+    cache_miss_counter misses {};
+    auto keys = make_keys(dist, size, size, 1);
+    // Allocated before the memory sample, which only counts the container.
+    auto results = std::make_unique<bool[]>(BATCH_SIZE);
+    auto before_build = heap_in_use();
+    Container container {};
+
+    if ((load != workload::INSERT) && (load != workload::INSERT_BATCH)) {
+        bool is_filled_with_keys =
+            (load == workload::REMOVE) || (load == workload::CONTAINS_AFTER_REMOVE);
+        auto fill = is_filled_with_keys ? keys : make_keys(distribution::RANDOM, size, size, 1);
+        if (load == workload::MIXED) {
+            fill.resize(size / 2);
+        }
+        for (auto key : fill) {
+            bench_add(container, key);
+        }
+    }
+    if (load == workload::CONTAINS_AFTER_REMOVE) {
+        for (size_t i = 0; i < keys.size(); i += 2) {
+            bench_remove(container, keys[i]);
+        }
+    }
+    if ((load == workload::CONTAINS) || (load == workload::CONTAINS_BATCH) ||
+        (load == workload::CONTAINS_MANY)) {
+        // Half of the lookups miss.
+        for (size_t i = 0; i < keys.size(); i += 2) {
+            keys[i] = mix64(keys[i]);
+        }
+    }
+
+    size_t operations = keys.size();
+    size_t hits = 0;
+    misses.start();
+    auto start = std::chrono::steady_clock::now();
+    switch (load) {
+    case workload::INSERT:
+        for (auto key : keys) {
+            bench_add(container, key);
+        }
+        break;
+    case workload::CONTAINS:
+    case workload::CONTAINS_AFTER_REMOVE:
+        for (auto key : keys) {
+            hits += bench_contains(container, key);
+        }
+        break;
+    case workload::REMOVE:
+        for (auto key : keys) {
+            bench_remove(container, key);
+        }
+        break;
+    case workload::MIXED:
+        for (size_t i = 0; i < keys.size(); ++i) {
+            switch (mix64(i) % 4) {
+            case 0:
+                bench_add(container, keys[i]);
+                break;
+            case 1:
+                bench_remove(container, keys[i]);
+                break;
+            default:
+                hits += bench_contains(container, keys[i]);
+                break;
+            }
+        }
+        break;
+    case workload::INSERT_BATCH:
+    case workload::CONTAINS_BATCH:
+    case workload::CONTAINS_MANY:
+        if constexpr (has_batches<Container>) {
+            for (size_t first = 0; first < keys.size(); first += BATCH_SIZE) {
+                std::span<uint64_t> batch(keys.data() + first,
+                    std::min(BATCH_SIZE, keys.size() - first));
+                std::span<bool> batch_results(results.get(), batch.size());
+                if (load == workload::INSERT_BATCH) {
+                    container.add_batch(batch);
+                    continue;
+                }
+                if (load == workload::CONTAINS_BATCH) {
+                    container.contains_batch(batch, batch_results);
+                } else {
+                    container.contains_many(batch, batch_results);
+                }
+                hits += std::ranges::count(batch_results, true);
+            }
+        }
+        break;
+    }
+    auto stop = std::chrono::steady_clock::now();
+    auto cache_misses = misses.stop();
+    do_not_optimize(hits);
+
+    // Memory of the container after the workload.
+    std::optional<double> bytes_per_element = std::nullopt;
+    auto after = heap_in_use();
+    if (before_build && after) {
+        bytes_per_element = static_cast<double>(*after - *before_build) / static_cast<double>(size);
+    }
+    auto nanoseconds = std::chrono::duration<double, std::nano>(stop - start).count();
+    return bench_result {
+        .ns_per_op = nanoseconds / static_cast<double>(operations),
+        .bytes_per_element = bytes_per_element,
+        .cache_misses = cache_misses,
+        .operations = operations,
+    };
+}
+
+struct bench_options {
+    size_t max_size = 1'000'000;
+    std::string filter {};
+};
+
+template <typename Container>
+void run_container(std::string_view container_name, bench_options const& options)
+{
+    auto loads = { workload::INSERT,
+        workload::CONTAINS,
+        workload::REMOVE,
+        workload::CONTAINS_AFTER_REMOVE,
+        workload::MIXED,
+        workload::INSERT_BATCH,
+        workload::CONTAINS_BATCH,
+        workload::CONTAINS_MANY };
+    for (auto load : loads) {
+        bool is_batch = (load == workload::INSERT_BATCH) || (load == workload::CONTAINS_BATCH) ||
+            (load == workload::CONTAINS_MANY);
+        if (is_batch && !has_batches<Container>) {
+            continue;
+        }
+        for (auto dist : { distribution::SEQUENTIAL, distribution::RANDOM, distribution::ZIPF }) {
+            for (size_t size = 1000; size <= options.max_size; size *= 10) {
+                std::string name = std::string(container_name) + "/" +
+                    std::string(workload_name(load)) + "/" + std::string(distribution_name(dist)) +
+                    "/" + std::to_string(size);
+                if (name.find(options.filter) == std::string::npos) {
+                    continue;
+                }
+
+                auto result = run_workload<Container>(load, dist, size);
+                std::cout << std::left << std::setw(48) << name << std::right << std::fixed;
+                std::cout << std::setprecision(1) << std::setw(12) << result.ns_per_op << " ns/op";
+                std::cout << std::setw(12);
+                if (result.bytes_per_element) {
+                    std::cout << *result.bytes_per_element;
+                } else {
+                    std::cout << "n/a";
+                }
+                std::cout << " B/elem";
+                std::cout << std::setw(16) << std::setprecision(2);
+                if (result.cache_misses) {
+                    auto operations = static_cast<double>(result.operations);
+                    std::cout << static_cast<double>(*result.cache_misses) / operations;
+                } else {
+                    std::cout << "n/a";
+                }
+                std::cout << " miss/op" << std::endl;
+            }
+        }
+    }
+}
+
+/**
+ * @brief AVL_tree behind one mutex, the baseline for concurrent_AVL_tree.
+ */
+class locked_AVL_tree {
+public:
+    void add(uint64_t key)
+    {
+        std::lock_guard lock(m_mutex);
+        m_tree.add(key);
+    }
+
+    bool contains(uint64_t key) const
+    {
+        std::lock_guard lock(m_mutex);
+        return m_tree.contains(key);
+    }
+
+private:
+    mutable std::mutex m_mutex {};
+    AVL_tree<uint64_t> m_tree {};
+};
+
+/**
+ * @brief Random lookups (half hit) from 1 thread up to the hardware concurrency, on a tree of
+ * size keys. The time is the wall time divided by the operations of all threads.
+ */
+template <typename Container>
+void run_read_scaling(std::string_view container_name, size_t size, bench_options const& options)
+{
+    auto keys = make_keys(distribution::RANDOM, size, size, 1);
+    Container container {};
+    for (auto key : keys) {
+        bench_add(container, key);
+    }
+    for (size_t i = 0; i < keys.size(); i += 2) {
+        keys[i] = mix64(keys[i]);
+    }
+
+    size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+        std::string name = std::string(container_name) + "/contains/threads:" +
+            std::to_string(thread_count) + "/" + std::to_string(size);
+        if (name.find(options.filter) == std::string::npos) {
+            continue;
+        }
+
+        std::vector<std::thread> threads {};
+        auto start = std::chrono::steady_clock::now();
+        for (size_t t = 0; t < thread_count; ++t) {
+            threads.emplace_back([&, t] {
+                size_t hits = 0;
+                for (size_t i = 0; i < keys.size(); ++i) {
+                    hits += bench_contains(container, keys[(i + t * 7919) % keys.size()]);
+                }
+                do_not_optimize(hits);
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        auto stop = std::chrono::steady_clock::now();
+
+        auto nanoseconds = std::chrono::duration<double, std::nano>(stop - start).count();
+        auto operations = static_cast<double>(keys.size() * thread_count);
+        std::cout << std::left << std::setw(48) << name << std::right << std::fixed;
+        std::cout << std::setprecision(1) << std::setw(12) << nanoseconds / operations << " ns/op"
+                  << std::endl;
+    }
+}
+
+static bench_options parse_options(int argc, char** argv)
+{
+    bench_options options {};
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg.starts_with("--max-size=")) {
+            options.max_size = static_cast<size_t>(std::stod(std::string(arg.substr(11))));
+        } else if (arg.starts_with("--filter=")) {
+            options.filter = arg.substr(9);
+        } else {
+            std::cerr << "unknown argument: " << arg << std::endl;
+            std::exit(1);
+        }
+    }
+    options.max_size = std::min<size_t>(options.max_size, 100'000'000);
+    return options;
+}
+
+int main(int argc, char** argv)
+{
+    auto options = parse_options(argc, argv);
+
+    std::cout << std::left << std::setw(48) << "benchmark" << std::right;
+    std::cout << std::setw(18) << "time" << std::setw(19) << "memory" << std::setw(24)
+              << "cache misses" << std::endl;
+    run_container<AVL_tree<uint64_t>>("AVL_tree", options);
+    run_container<AVL_tree<uint64_t, std::less<uint64_t>, AVL_pool_allocator<uint64_t>>>(
+        "AVL_tree<pool>", options);
+    run_container<AVL_tree<uint64_t, std::less<uint64_t>, std::allocator<uint64_t>,
+        AVL_lazy_removes_traits>>("AVL_tree<lazy_removes>", options);
+    run_container<compact_AVL_tree<uint64_t>>("compact_AVL_tree", options);
+    run_container<std::set<uint64_t>>("std::set", options);
+    run_container<std::multiset<uint64_t>>("std::multiset", options);
+
+    size_t scaling_size = std::min<size_t>(options.max_size, 1'000'000);
+    run_read_scaling<concurrent_AVL_tree<uint64_t>>("concurrent_AVL_tree", scaling_size, options);
+    run_read_scaling<locked_AVL_tree>("locked_AVL_tree", scaling_size, options);
+
+    return 0;
+}
@@ -0,0 +1,405 @@
+/*
+Purpose:    compact_AVL_tree class declaration - an AVL_tree storing its nodes contiguously
+            and linking them by 30 bit indices.
+*/
+
+#ifndef COMPACT_AVL_TREE_H
+#define COMPACT_AVL_TREE_H
+
+#include <array>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#ifdef DEBUG
+#include <expected>
+#include <string>
+#endif // ifdef DEBUG
+
+#include "AVL_tree.hpp"
+
+/**
+ * @brief Counted AVL set with the same semantics as AVL_tree, but every node lives in one
+ * std::vector and refers to its children by index.
+ *
+ * A node holds the value, two 32 bit links and a 32 bit count. The balance factor is packed
+ * into the 2 spare bits of the smaller link, and no parent link is stored: the descent path is
+ * kept on a fixed size stack and retraced from there. For AVL_tree<int> this is 16 bytes per
+ * node instead of 40.
+ *
+ * @note Removed slots are recycled through a free list. Up to MAX_NODES distinct values.
+ */
+template <std::totally_ordered T>
+class compact_AVL_tree {
+public:
+    using index_type = uint32_t;
+
+    static constexpr index_type NIL = (index_type(1) << 30) - 1;
+    static constexpr size_t MAX_NODES = NIL;
+
+    compact_AVL_tree() = default;
+
+    void reserve(size_t count)
+    {
+        m_nodes.reserve(count);
+    }
+
+    void add(T value)
+    {
+        path_stack path {};
+        size_t depth = 0;
+        index_type curr = m_head;
+
+        while (curr != NIL) {
+            auto& node = m_nodes[curr];
+            if (value == node.m_value) {
+                node.m_count += 1;
+                return;
+            }
+            bool is_bigger = node.m_value < value;
+            path[depth++] = { curr, is_bigger };
+            curr = node.child(is_bigger);
+        }
+
+        auto new_index = allocate_node(std::move(value));
+        if (depth == 0) {
+            m_head = new_index;
+            return;
+        }
+        auto [parent, is_bigger] = path[depth - 1];
+        m_nodes[parent].set_child(is_bigger, new_index);
+        retrace_insert(path, depth);
+    }
+
+    avl_statuses remove(T const value)
+    {
+        path_stack path {};
+        size_t depth = 0;
+        index_type curr = m_head;
+
+        while ((curr != NIL) && (value != m_nodes[curr].m_value)) {
+            bool is_bigger = m_nodes[curr].m_value < value;
+            path[depth++] = { curr, is_bigger };
+            curr = m_nodes[curr].child(is_bigger);
+        }
+        if (curr == NIL) {
+            return avl_statuses::VALUE_NOT_FOUND;
+        }
+        if (m_nodes[curr].m_count > 1) {
+            m_nodes[curr].m_count -= 1;
+            return avl_statuses::SUCCESS;
+        }
+
+        /* curr has 2 children - continue the same descent to its minimal bigger child, move
+        that value up and unlink the child instead. */
+        index_type to_remove = curr;
+        if ((m_nodes[curr].smaller() != NIL) && (m_nodes[curr].m_bigger != NIL)) {
+            path[depth++] = { curr, true };
+            to_remove = m_nodes[curr].m_bigger;
+            while (m_nodes[to_remove].smaller() != NIL) {
+                path[depth++] = { to_remove, false };
+                to_remove = m_nodes[to_remove].smaller();
+            }
+            m_nodes[curr].m_value = std::move(m_nodes[to_remove].m_value);
+            m_nodes[curr].m_count = m_nodes[to_remove].m_count;
+        }
+
+        auto const& removed = m_nodes[to_remove];
+        index_type replacement =
+            (removed.smaller() != NIL) ? removed.smaller() : removed.m_bigger;
+        if (depth == 0) {
+            m_head = replacement;
+        } else {
+            auto [parent, is_bigger] = path[depth - 1];
+            m_nodes[parent].set_child(is_bigger, replacement);
+        }
+        free_node(to_remove);
+        retrace_remove(path, depth);
+
+        return avl_statuses::SUCCESS;
+    }
+
+    bool contains(T const value) const
+    {
+        index_type curr = m_head;
+        while (curr != NIL) {
+            auto const& node = m_nodes[curr];
+            if (value == node.m_value) {
+                return true;
+            }
+            curr = node.child(node.m_value < value);
+        }
+        return false;
+    }
+
+    /**
+     * @brief Number of distinct values.
+     */
+    size_t unique_size() const
+    {
+        return m_nodes.size() - m_free_count;
+    }
+
+    /**
+     * @brief Bytes reserved by the node storage.
+     */
+    size_t memory_usage() const
+    {
+        return m_nodes.capacity() * sizeof(compact_node);
+    }
+
+#ifdef DEBUG
+    std::string test_tree() const
+    {
+        if (m_head == NIL) {
+            return "";
+        }
+        auto test_out = test_subtree(m_head);
+        if (!test_out) {
+            return test_out.error();
+        }
+        return "";
+    }
+#endif // ifdef DEBUG
+
+private:
+    static constexpr index_type INDEX_MASK = NIL;
+    static constexpr unsigned BALANCE_SHIFT = 30;
+    // With 2^30 nodes the worst AVL tree height is 43.
+    static constexpr size_t MAX_HEIGHT = 48;
+
+    struct compact_node {
+        compact_node(T&& value):
+            m_value(std::move(value))
+        {
+        }
+
+        index_type smaller() const
+        {
+            return m_smaller_balance & INDEX_MASK;
+        }
+
+        int8_t balance() const
+        {
+            return static_cast<int8_t>(m_smaller_balance >> BALANCE_SHIFT) - 1;
+        }
+
+        void set_smaller(index_type index)
+        {
+            m_smaller_balance = (m_smaller_balance & ~INDEX_MASK) | index;
+        }
+
+        void set_balance(int8_t balance)
+        {
+            m_smaller_balance = (m_smaller_balance & INDEX_MASK) |
+                (static_cast<index_type>(balance + 1) << BALANCE_SHIFT);
+        }
+
+        index_type child(bool is_bigger) const
+        {
+            return is_bigger ? m_bigger : smaller();
+        }
+
+        void set_child(bool is_bigger, index_type index)
+        {
+            if (is_bigger) {
+                m_bigger = index;
+            } else {
+                set_smaller(index);
+            }
+        }
+
+        T m_value;
+        // Smaller child index in the low 30 bits, balance + 1 in the high 2 bits.
+        index_type m_smaller_balance = NIL | (index_type(BALANCED + 1) << BALANCE_SHIFT);
+        index_type m_bigger = NIL;
+        uint32_t m_count = 1;
+    };
+
+    struct path_entry {
+        index_type m_node;
+        bool m_is_bigger;
+    };
+    using path_stack = std::array<path_entry, MAX_HEIGHT>;
+
+    index_type allocate_node(T&& value)
+    {
+        if (m_free != NIL) {
+            auto index = m_free;
+            m_free = m_nodes[index].m_bigger;
+            m_free_count -= 1;
+            m_nodes[index] = compact_node(std::move(value));
+            return index;
+        }
+        if (m_nodes.size() >= MAX_NODES) {
+            throw std::length_error("compact_AVL_tree is limited to 2^30 - 1 nodes");
+        }
+        m_nodes.emplace_back(std::move(value));
+        return static_cast<index_type>(m_nodes.size() - 1);
+    }
+
+    void free_node(index_type index)
+    {
+        m_nodes[index].m_bigger = m_free;
+        m_free = index;
+        m_free_count += 1;
+    }
+
+    /**
+     * @brief Rotates the subtree rooted at index towards its lighter side.
+     *
+     * @returns The new root of the subtree and whether the subtree's height decreased.
+     */
+    std::pair<index_type, bool> rotate(index_type index)
+    {
+        auto& node = m_nodes[index];
+        bool heavy_bigger = node.balance() > 0;
+        int8_t sign = heavy_bigger ? BIGGER_SIGN : SMALLER_SIGN;
+        index_type child_index = node.child(heavy_bigger);
+        auto& child = m_nodes[child_index];
+
+        if (child.balance() == -sign) {
+            // Double rotation - the grandchild becomes the subtree root.
+            index_type grand_index = child.child(!heavy_bigger);
+            auto& grand = m_nodes[grand_index];
+            child.set_child(!heavy_bigger, grand.child(heavy_bigger));
+            grand.set_child(heavy_bigger, child_index);
+            node.set_child(heavy_bigger, grand.child(!heavy_bigger));
+            grand.set_child(!heavy_bigger, index);
+
+            auto grand_balance = grand.balance();
+            node.set_balance((grand_balance == sign) ? -sign : BALANCED);
+            child.set_balance((grand_balance == -sign) ? sign : BALANCED);
+            grand.set_balance(BALANCED);
+            return { grand_index, true };
+        }
+
+        node.set_child(heavy_bigger, child.child(!heavy_bigger));
+        child.set_child(!heavy_bigger, index);
+        if (child.balance() == BALANCED) {
+            // Only possible after a removal, the height stays the same.
+            node.set_balance(sign);
+            child.set_balance(-sign);
+            return { child_index, false };
+        }
+        node.set_balance(BALANCED);
+        child.set_balance(BALANCED);
+        return { child_index, true };
+    }
+
+    void relink(path_stack const& path, size_t depth, index_type index)
+    {
+        if (depth == 0) {
+            m_head = index;
+        } else {
+            m_nodes[path[depth - 1].m_node].set_child(path[depth - 1].m_is_bigger, index);
+        }
+    }
+
+    void retrace_insert(path_stack const& path, size_t depth)
+    {
+        while (depth > 0) {
+            depth -= 1;
+            auto [index, is_bigger] = path[depth];
+            auto& node = m_nodes[index];
+            auto balance =
+                static_cast<int8_t>(node.balance() + (is_bigger ? BIGGER_SIGN : SMALLER_SIGN));
+
+            if (balance == BALANCED) {
+                node.set_balance(balance);
+                return;
+            }
+            if ((balance == SMALLER_UB) || (balance == BIGGER_UB)) {
+                // An insertion rotation always restores the subtree's previous height.
+                relink(path, depth, rotate_heavy(index, is_bigger).first);
+                return;
+            }
+            node.set_balance(balance);
+        }
+    }
+
+    void retrace_remove(path_stack const& path, size_t depth)
+    {
+        while (depth > 0) {
+            depth -= 1;
+            auto [index, is_bigger] = path[depth];
+            auto& node = m_nodes[index];
+            auto balance =
+                static_cast<int8_t>(node.balance() - (is_bigger ? BIGGER_SIGN : SMALLER_SIGN));
+
+            if ((balance == SMALLER_UB) || (balance == BIGGER_UB)) {
+                auto [new_root, height_decreased] = rotate_heavy(index, !is_bigger);
+                relink(path, depth, new_root);
+                if (!height_decreased) {
+                    return;
+                }
+                continue;
+            }
+            node.set_balance(balance);
+            if (balance != BALANCED) {
+                // The subtree kept its height.
+                return;
+            }
+        }
+    }
+
+    /**
+     * @brief Rotates a node which just became doubly heavy on the given side.
+     *
+     * The packed balance can only hold -1..1, so the out of bounds state is passed implicitly
+     * by marking the node as heavy on that side before rotating.
+     */
+    std::pair<index_type, bool> rotate_heavy(index_type index, bool heavy_bigger)
+    {
+        m_nodes[index].set_balance(heavy_bigger ? BIGGER_HEAVY : SMALLER_HEAVY);
+        return rotate(index);
+    }
+
+#ifdef DEBUG
+    std::expected<size_t, std::string> test_subtree(index_type index) const
+    {
+        auto const& node = m_nodes[index];
+        size_t height_smaller = 0;
+        size_t height_bigger = 0;
+
+        if (node.smaller() != NIL) {
+            if (!(m_nodes[node.smaller()].m_value < node.m_value)) {
+                return std::unexpected { "value <= smaller_value" };
+            }
+            auto smaller_out = test_subtree(node.smaller());
+            if (!smaller_out) {
+                return smaller_out;
+            }
+            height_smaller = *smaller_out;
+        }
+        if (node.m_bigger != NIL) {
+            if (!(node.m_value < m_nodes[node.m_bigger].m_value)) {
+                return std::unexpected { "value >= bigger value" };
+            }
+            auto bigger_out = test_subtree(node.m_bigger);
+            if (!bigger_out) {
+                return bigger_out;
+            }
+            height_bigger = *bigger_out;
+        }
+
+        auto balance =
+            static_cast<ptrdiff_t>(height_bigger) - static_cast<ptrdiff_t>(height_smaller);
+        if (balance != node.balance()) {
+            return std::unexpected { "calculated balance differs from saved balance: " +
+                std::to_string(balance) + " != " + std::to_string(node.balance()) };
+        }
+        return std::max(height_bigger, height_smaller) + 1;
+    }
+#endif // ifdef DEBUG
+
+    std::vector<compact_node> m_nodes {};
+    index_type m_head = NIL;
+    // Free slots are chained through their bigger link.
+    index_type m_free = NIL;
+    size_t m_free_count = 0;
+};
+
+#endif // COMPACT_AVL_TREE_H
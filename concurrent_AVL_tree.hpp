@@ -0,0 +1,695 @@
+/*
+Purpose:    concurrent_AVL_tree class declaration - a counted AVL set whose lookups run without
+            locks alongside a writer, after Bronson et al.'s optimistic AVL tree.
+*/
+
+#ifndef CONCURRENT_AVL_TREE_H
+#define CONCURRENT_AVL_TREE_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+#ifdef DEBUG
+#include <cstdlib>
+#include <expected>
+#include <string>
+#endif // ifdef DEBUG
+
+#include "AVL_tree.hpp"
+
+/**
+ * @brief Counted AVL set safe for any number of concurrent readers and writers.
+ *
+ * contains() and count() take no lock, and only write the reader slot of their thread (see
+ * below), never a node. Every node carries a version
+ * which a rotation bumps when the node moves down (the only way its key range shrinks), and a
+ * reader validates the version of each node it passes through before trusting the link it read.
+ * A failed validation only retries from the last node which is still valid, not from the root,
+ * and a reader inside a node being rotated down waits (yielding) for the rotation to end.
+ *
+ * add() and remove() are serialized by a writer mutex. A removed value whose node has two
+ * children stays in the tree as a routing node with a count of 0, and is unlinked once a later
+ * retrace finds it with at most one child.
+ *
+ * Unlinked nodes may still be visited by readers, so they are retired rather than freed, and
+ * reclaimed by epochs: a reader marks itself in the reader slot of its thread for the parity of
+ * the current epoch, and the writer only advances the epoch once no reader is marked for the
+ * previous one. Once the epoch moved twice past the retirement of a node, every reader which could
+ * have reached it is gone, and the node goes back to the allocator (so to its pool with
+ * AVL_pool_allocator). There is a slot per hardware thread, and the threads alive at once get
+ * distinct slots up to that number, so a read costs two uncontended atomic updates of a cache line
+ * of its own. Reads never take the writer mutex, nor wait for a reclamation.
+ */
+template <typename T, typename Compare = std::less<T>, typename Allocator = std::allocator<T>>
+    requires AVL_comparator<Compare, T>
+class concurrent_AVL_tree {
+    template <typename K>
+    static constexpr bool is_lookup_key = AVL_lookup_key<K, T, Compare>;
+
+public:
+    using value_type = T;
+    using key_type = T;
+    using key_compare = Compare;
+    using size_type = size_t;
+    using allocator_type = Allocator;
+
+    concurrent_AVL_tree() = default;
+    explicit concurrent_AVL_tree(Compare const& compare, Allocator const& alloc = Allocator()):
+        m_compare(compare),
+        m_alloc(alloc)
+    {
+    }
+
+    concurrent_AVL_tree(concurrent_AVL_tree const&) = delete;
+    concurrent_AVL_tree& operator=(concurrent_AVL_tree const&) = delete;
+
+    /**
+     * @note No other thread may use the tree anymore.
+     */
+    ~concurrent_AVL_tree()
+    {
+        destroy_subtree(m_root.load(std::memory_order_relaxed));
+        for (auto [node, epoch] : m_retired) {
+            destroy_node(node);
+        }
+    }
+
+    void add(T value)
+    {
+        std::lock_guard lock(m_write_mutex);
+        AVL_node* parent = nullptr;
+        bool is_bigger = false;
+        AVL_node* curr_node = m_root.load(std::memory_order_relaxed);
+
+        while (curr_node != nullptr) {
+            if (m_compare(value, curr_node->m_value)) {
+                is_bigger = false;
+            } else if (m_compare(curr_node->m_value, value)) {
+                is_bigger = true;
+            } else {
+                // Also revives a routing node.
+                auto count = curr_node->m_count.load(std::memory_order_relaxed);
+                curr_node->m_count.store(count + 1, std::memory_order_release);
+                return;
+            }
+            parent = curr_node;
+            curr_node = parent->get_child(is_bigger);
+        }
+
+        AVL_node* new_node = create_node(parent, std::move(value));
+        if (parent == nullptr) {
+            m_root.store(new_node, std::memory_order_release);
+            return;
+        }
+        parent->set_child(is_bigger, new_node);
+        fix_uptree(parent);
+    }
+
+    avl_statuses remove(T const& value)
+    {
+        return remove<T>(value);
+    }
+
+    template <typename K>
+        requires is_lookup_key<K>
+    avl_statuses remove(K const& value)
+    {
+        std::lock_guard lock(m_write_mutex);
+        AVL_node* to_remove = find_node(value);
+        if (to_remove == nullptr) {
+            return avl_statuses::VALUE_NOT_FOUND;
+        }
+        auto count = to_remove->m_count.load(std::memory_order_relaxed);
+        if (count == 0) {
+            return avl_statuses::VALUE_NOT_FOUND;
+        }
+        // Readers finding the node from now on see the value as removed.
+        to_remove->m_count.store(count - 1, std::memory_order_release);
+        if ((count > 1) || ((to_remove->get_child(false) != nullptr) &&
+                               (to_remove->get_child(true) != nullptr))) {
+            return avl_statuses::SUCCESS;
+        }
+
+        auto parent = to_remove->m_parent;
+        unlink(to_remove);
+        fix_uptree(parent);
+        return avl_statuses::SUCCESS;
+    }
+
+    /**
+     * @note Lock free.
+     */
+    bool contains(T const& value) const
+    {
+        return count(value) != 0;
+    }
+
+    template <typename K>
+        requires is_lookup_key<K>
+    bool contains(K const& value) const
+    {
+        return count(value) != 0;
+    }
+
+    /**
+     * @brief How many times the value was added, 0 if it is not in the tree.
+     *
+     * @note Lock free.
+     */
+    uint32_t count(T const& value) const
+    {
+        return count<T>(value);
+    }
+
+    template <typename K>
+        requires is_lookup_key<K>
+    uint32_t count(K const& value) const
+    {
+        read_guard guard(*this);
+        while (true) {
+            AVL_node* root = m_root.load(std::memory_order_acquire);
+            if (root == nullptr) {
+                return 0;
+            }
+            bool is_bigger = false;
+            if (m_compare(value, root->m_value)) {
+                is_bigger = false;
+            } else if (m_compare(root->m_value, value)) {
+                is_bigger = true;
+            } else {
+                return root->m_count.load(std::memory_order_acquire);
+            }
+
+            auto root_version = root->m_version.load(std::memory_order_acquire);
+            if ((root_version & (SHRINKING | UNLINKED)) != 0) {
+                wait_while_shrinking(root);
+                continue;
+            }
+            if (root != m_root.load(std::memory_order_acquire)) {
+                continue;
+            }
+            auto found = attempt_count(value, root, is_bigger, root_version);
+            if (found) {
+                return *found;
+            }
+        }
+    }
+
+    /**
+     * @brief Number of unlinked nodes which readers may still be visiting.
+     */
+    size_t retired_count() const
+    {
+        std::lock_guard lock(m_write_mutex);
+        return m_retired.size();
+    }
+
+    /**
+     * @brief Advances the epoch if no reader is left in the previous one, and frees the retired
+     * nodes no reader can reach anymore. remove() does it every RECLAIM_BATCH retirements.
+     *
+     * @returns Number of nodes freed.
+     */
+    size_t reclaim()
+    {
+        std::lock_guard lock(m_write_mutex);
+        return reclaim_retired();
+    }
+
+#ifdef DEBUG
+    std::string test_tree() const
+    {
+        std::lock_guard lock(m_write_mutex);
+        auto root = m_root.load(std::memory_order_relaxed);
+        if (root == nullptr) {
+            return "";
+        }
+        if (root->m_parent != nullptr) {
+            return "root has a parent";
+        }
+        auto test_out = test_subtree(root);
+        if (!test_out) {
+            return test_out.error();
+        }
+        return "";
+    }
+#endif // ifdef DEBUG
+
+private:
+    // Version bits. The rest of the version counts the changes of the node.
+    static constexpr uint64_t UNLINKED = 1;
+    static constexpr uint64_t SHRINKING = 2;
+    static constexpr uint64_t VERSION_STEP = 4;
+
+    static constexpr size_t RECLAIM_BATCH = 64;
+
+    class AVL_node {
+    public:
+        template <typename... Args>
+        explicit AVL_node(AVL_node* parent, Args&&... args):
+            m_value(std::forward<Args>(args)...),
+            m_parent(parent)
+        {
+        }
+
+        AVL_node* get_child(bool is_bigger) const
+        {
+            return (is_bigger ? m_bigger : m_smaller).load(std::memory_order_acquire);
+        }
+
+        void set_child(bool is_bigger, AVL_node* child)
+        {
+            (is_bigger ? m_bigger : m_smaller).store(child, std::memory_order_release);
+        }
+
+        static int get_height(AVL_node const* node)
+        {
+            return (node == nullptr) ? 0 : node->m_height;
+        }
+
+        T const m_value;
+        std::atomic<AVL_node*> m_smaller = nullptr;
+        std::atomic<AVL_node*> m_bigger = nullptr;
+        std::atomic<uint64_t> m_version = 0;
+        // 0 for a routing node, which only guides searches.
+        std::atomic<uint32_t> m_count = 1;
+        // Only used by the writer.
+        AVL_node* m_parent = nullptr;
+        int m_height = 1;
+    };
+
+    /**
+     * @brief Readers inside the tree per epoch parity, for the threads sharing the slot. Each
+     * slot has its own cache line, so that readers on different threads do not contend.
+     */
+    struct alignas(64) reader_slot {
+        std::array<std::atomic<uint32_t>, 2> m_readers {};
+    };
+
+    /**
+     * @brief Marks the calling thread as reading for as long as it lives.
+     */
+    class read_guard {
+    public:
+        explicit read_guard(concurrent_AVL_tree const& tree):
+            m_readers(tree.m_reader_slots[reader_id() & (tree.m_reader_slots.size() - 1)]
+                    .m_readers[tree.m_epoch.load(std::memory_order_relaxed) & 1])
+        {
+            m_readers.fetch_add(1, std::memory_order_relaxed);
+            // Pairs with the writer's fence: either the writer sees this reader, or the reader
+            // sees every unlink made before the writer's check.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+
+        read_guard(read_guard const&) = delete;
+        read_guard& operator=(read_guard const&) = delete;
+
+        ~read_guard()
+        {
+            m_readers.fetch_sub(1, std::memory_order_release);
+        }
+
+    private:
+        std::atomic<uint32_t>& m_readers;
+    };
+
+    /**
+     * @brief Number of reader slots, a power of 2 of at least the hardware threads.
+     */
+    static size_t reader_slot_count()
+    {
+        return std::bit_ceil(std::max(std::thread::hardware_concurrency(), 1u));
+    }
+
+    /**
+     * @brief Small ids shared by the threads alive at a time: a thread takes the smallest free
+     * id on its first read, and frees it when it exits.
+     */
+    class thread_reader_id {
+    public:
+        thread_reader_id()
+        {
+            std::lock_guard lock(registry_mutex());
+            auto& free_ids = registry_free_ids();
+            if (free_ids.empty()) {
+                m_id = registry_next_id()++;
+            } else {
+                auto smallest = std::ranges::min_element(free_ids);
+                m_id = *smallest;
+                free_ids.erase(smallest);
+            }
+        }
+
+        thread_reader_id(thread_reader_id const&) = delete;
+        thread_reader_id& operator=(thread_reader_id const&) = delete;
+
+        ~thread_reader_id()
+        {
+            std::lock_guard lock(registry_mutex());
+            registry_free_ids().push_back(m_id);
+        }
+
+        size_t m_id = 0;
+
+    private:
+        static std::mutex& registry_mutex()
+        {
+            static std::mutex mutex {};
+            return mutex;
+        }
+
+        static std::vector<size_t>& registry_free_ids()
+        {
+            static std::vector<size_t> free_ids {};
+            return free_ids;
+        }
+
+        static size_t& registry_next_id()
+        {
+            static size_t next_id = 0;
+            return next_id;
+        }
+    };
+
+    static size_t reader_id()
+    {
+        thread_local thread_reader_id id {};
+        return id.m_id;
+    }
+
+    using node_allocator =
+        typename std::allocator_traits<Allocator>::template rebind_alloc<AVL_node>;
+    using node_traits = std::allocator_traits<node_allocator>;
+
+    template <typename... Args>
+    AVL_node* create_node(Args&&... args)
+    {
+        AVL_node* node = std::to_address(node_traits::allocate(m_alloc, 1));
+        try {
+            node_traits::construct(m_alloc, node, std::forward<Args>(args)...);
+        } catch (...) {
+            node_traits::deallocate(m_alloc, node, 1);
+            throw;
+        }
+        return node;
+    }
+
+    void destroy_node(AVL_node* node)
+    {
+        node_traits::destroy(m_alloc, node);
+        node_traits::deallocate(m_alloc, node, 1);
+    }
+
+    void destroy_subtree(AVL_node* node)
+    {
+        if (node == nullptr) {
+            return;
+        }
+        destroy_subtree(node->get_child(false));
+        destroy_subtree(node->get_child(true));
+        destroy_node(node);
+    }
+
+    static void wait_while_shrinking(AVL_node const* node)
+    {
+        while ((node->m_version.load(std::memory_order_acquire) & SHRINKING) != 0) {
+            std::this_thread::yield();
+        }
+    }
+
+    /**
+     * @brief Continues a lookup below node, which was validated at node_version and whose
+     * is_bigger subtree must hold the value.
+     *
+     * @returns The value's count, or nullopt if node changed and the caller has to retry.
+     */
+    template <typename K>
+    std::optional<uint32_t> attempt_count(K const& value,
+        AVL_node const* node,
+        bool is_bigger,
+        uint64_t node_version) const
+    {
+        while (true) {
+            AVL_node* child = node->get_child(is_bigger);
+            if (node->m_version.load(std::memory_order_acquire) != node_version) {
+                return std::nullopt;
+            }
+            if (child == nullptr) {
+                return 0;
+            }
+
+            bool child_bigger = false;
+            if (m_compare(value, child->m_value)) {
+                child_bigger = false;
+            } else if (m_compare(child->m_value, value)) {
+                child_bigger = true;
+            } else {
+                return child->m_count.load(std::memory_order_acquire);
+            }
+
+            auto child_version = child->m_version.load(std::memory_order_acquire);
+            if ((child_version & (SHRINKING | UNLINKED)) != 0) {
+                // Either way node's link is about to change, reread it.
+                wait_while_shrinking(child);
+                continue;
+            }
+            if (child != node->get_child(is_bigger)) {
+                continue;
+            }
+            if (node->m_version.load(std::memory_order_acquire) != node_version) {
+                return std::nullopt;
+            }
+
+            auto found = attempt_count(value, child, child_bigger, child_version);
+            if (found) {
+                return found;
+            }
+        }
+    }
+
+    template <typename K>
+    AVL_node* find_node(K const& value) const
+    {
+        AVL_node* curr_node = m_root.load(std::memory_order_relaxed);
+        while (curr_node != nullptr) {
+            if (m_compare(value, curr_node->m_value)) {
+                curr_node = curr_node->get_child(false);
+            } else if (m_compare(curr_node->m_value, value)) {
+                curr_node = curr_node->get_child(true);
+            } else {
+                break;
+            }
+        }
+        return curr_node;
+    }
+
+    void set_owner_link(AVL_node* node, AVL_node* replacement)
+    {
+        auto parent = node->m_parent;
+        if (parent == nullptr) {
+            m_root.store(replacement, std::memory_order_release);
+        } else {
+            parent->set_child(node == parent->get_child(true), replacement);
+        }
+    }
+
+    /**
+     * @brief Removes a node with at most one child from the tree, its child taking its place.
+     */
+    void unlink(AVL_node* node)
+    {
+        AVL_node* child = node->get_child(false);
+        if (child == nullptr) {
+            child = node->get_child(true);
+        }
+        // Readers still inside node keep a valid path through it to child.
+        auto version = node->m_version.load(std::memory_order_relaxed);
+        node->m_version.store(version | UNLINKED, std::memory_order_release);
+        set_owner_link(node, child);
+        if (child != nullptr) {
+            child->m_parent = node->m_parent;
+        }
+        retire(node);
+    }
+
+    void retire(AVL_node* node)
+    {
+        m_retired.push_back({ node, m_epoch.load(std::memory_order_relaxed) });
+        if (m_retired.size() % RECLAIM_BATCH == 0) {
+            reclaim_retired();
+        }
+    }
+
+    /**
+     * @brief Whether no reader is marked for the parity of epoch.
+     */
+    bool is_parity_idle(uint64_t epoch) const
+    {
+        return std::ranges::all_of(m_reader_slots, [epoch](reader_slot const& slot) {
+            return slot.m_readers[epoch & 1].load(std::memory_order_acquire) == 0;
+        });
+    }
+
+    /**
+     * @brief A node retired at epoch e was unlinked before the check which allowed the epoch to
+     * reach e + 1, and the readers which started before that check were all gone at the check
+     * allowing e + 2. Readers both before and after a change of the epoch can be marked for
+     * either parity, so the two checks catch them all.
+     */
+    size_t reclaim_retired()
+    {
+        // Pairs with the readers' fence.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto epoch = m_epoch.load(std::memory_order_relaxed);
+        if (is_parity_idle(epoch + 1)) {
+            m_epoch.store(++epoch, std::memory_order_relaxed);
+        }
+        auto freed = std::ranges::partition(m_retired, [epoch](retired_node const& retired) {
+            return retired.m_epoch + 2 > epoch;
+        });
+        for (auto [node, retired_epoch] : freed) {
+            destroy_node(node);
+        }
+        size_t freed_count = freed.size();
+        m_retired.erase(freed.begin(), freed.end());
+        return freed_count;
+    }
+
+    static void update_height(AVL_node* node)
+    {
+        node->m_height = 1 +
+            std::max(AVL_node::get_height(node->get_child(false)),
+                AVL_node::get_height(node->get_child(true)));
+    }
+
+    /**
+     * @brief Single rotation lifting node's child on the is_bigger side into node's place.
+     *
+     * @note node is marked as shrinking for the duration, so that readers inside it wait and
+     * then retry from its parent.
+     *
+     * @returns The new root of the subtree.
+     */
+    AVL_node* rotate_up(AVL_node* node, bool is_bigger)
+    {
+        AVL_node* pivot = node->get_child(is_bigger);
+        AVL_node* moved = pivot->get_child(!is_bigger);
+        auto version = node->m_version.load(std::memory_order_relaxed);
+        node->m_version.store(version | SHRINKING, std::memory_order_relaxed);
+        // The links below are released after the shrinking mark.
+
+        node->set_child(is_bigger, moved);
+        if (moved != nullptr) {
+            moved->m_parent = node;
+        }
+        pivot->set_child(!is_bigger, node);
+        set_owner_link(node, pivot);
+        pivot->m_parent = node->m_parent;
+        node->m_parent = pivot;
+
+        node->m_version.store(version + VERSION_STEP, std::memory_order_release);
+        update_height(node);
+        update_height(pivot);
+        return pivot;
+    }
+
+    /**
+     * @brief Restores the heights and balance from node up to the root, rotating where needed
+     * and unlinking routing nodes left with at most one child.
+     */
+    void fix_uptree(AVL_node* node)
+    {
+        while (node != nullptr) {
+            AVL_node* smaller = node->get_child(false);
+            AVL_node* bigger = node->get_child(true);
+            if ((node->m_count.load(std::memory_order_relaxed) == 0) &&
+                ((smaller == nullptr) || (bigger == nullptr))) {
+                auto parent = node->m_parent;
+                unlink(node);
+                node = parent;
+                continue;
+            }
+
+            int balance = AVL_node::get_height(bigger) - AVL_node::get_height(smaller);
+            if ((balance > BIGGER_HEAVY) || (balance < SMALLER_HEAVY)) {
+                bool is_bigger = balance > 0;
+                AVL_node* child = is_bigger ? bigger : smaller;
+                if (AVL_node::get_height(child->get_child(!is_bigger)) >
+                    AVL_node::get_height(child->get_child(is_bigger))) {
+                    rotate_up(child, !is_bigger);
+                }
+                rotate_up(node, is_bigger);
+                // Continue from the node moved down, in case it is a routing node to unlink.
+                continue;
+            }
+            update_height(node);
+            node = node->m_parent;
+        }
+    }
+
+#ifdef DEBUG
+    std::expected<int, std::string> test_subtree(AVL_node const* node) const
+    {
+        int heights[2] = { 0, 0 };
+        for (bool is_bigger : { false, true }) {
+            AVL_node const* child = node->get_child(is_bigger);
+            if (child == nullptr) {
+                continue;
+            }
+            if (child->m_parent != node) {
+                return std::unexpected { "child's parent link is wrong" };
+            }
+            if (is_bigger ? !m_compare(node->m_value, child->m_value)
+                          : !m_compare(child->m_value, node->m_value)) {
+                return std::unexpected { "children are out of order" };
+            }
+            auto child_out = test_subtree(child);
+            if (!child_out) {
+                return child_out;
+            }
+            heights[is_bigger] = *child_out;
+        }
+
+        auto version = node->m_version.load(std::memory_order_relaxed);
+        if ((version & (SHRINKING | UNLINKED)) != 0) {
+            return std::unexpected { "linked node is marked: " + std::to_string(version) };
+        }
+        if (std::abs(heights[1] - heights[0]) > BIGGER_HEAVY) {
+            return std::unexpected { "unbalanced node, heights: " + std::to_string(heights[0]) +
+                ", " + std::to_string(heights[1]) };
+        }
+        if (node->m_height != std::max(heights[0], heights[1]) + 1) {
+            return std::unexpected { "saved height is: " + std::to_string(node->m_height) };
+        }
+        return node->m_height;
+    }
+#endif // ifdef DEBUG
+
+    [[no_unique_address]] Compare m_compare {};
+    [[no_unique_address]] node_allocator m_alloc {};
+    std::atomic<AVL_node*> m_root = nullptr;
+    mutable std::mutex m_write_mutex {};
+
+    struct retired_node {
+        AVL_node* m_node;
+        // Epoch when the node was unlinked.
+        uint64_t m_epoch;
+    };
+
+    // Only changed by the writer.
+    std::atomic<uint64_t> m_epoch = 0;
+    mutable std::vector<reader_slot> m_reader_slots =
+        std::vector<reader_slot>(reader_slot_count());
+    std::vector<retired_node> m_retired {};
+};
+
+#endif // CONCURRENT_AVL_TREE_H
@@ -0,0 +1,621 @@
+/*
+Purpose:    persistent_AVL_tree class declaration - an immutable counted AVL set whose updates
+            return new versions sharing all untouched nodes with the old ones.
+*/
+
+#ifndef PERSISTENT_AVL_TREE_H
+#define PERSISTENT_AVL_TREE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
+#ifdef DEBUG
+#include <cstdlib>
+#include <expected>
+#include <string>
+#endif // ifdef DEBUG
+
+#include "AVL_tree.hpp"
+
+/**
+ * @brief Counted AVL set with path copying: a persistent_AVL_tree is a version handle, add() and
+ * remove() leave it untouched and return a new version.
+ *
+ * An update copies only the O(log n) nodes on the path to the value (and the few moved by
+ * rotations), the rest is shared between the versions. Nodes never change once built, so any
+ * number of threads can read any versions without locks, and copying a version is O(1). Nodes
+ * are reference counted and freed with the last version using them.
+ *
+ * @note A single handle object is not synchronized - threads share versions by copying handles.
+ * @note add(), remove() and the release of a version's last handle call the allocator on the
+ * calling thread. Threads other than the owning one may only do so with an allocator usable from
+ * several threads at once (std::allocator) - with others, like AVL_pool_allocator, they only read
+ * and their handles go back to the owning thread to be destroyed.
+ */
+template <typename T, typename Compare = std::less<T>, typename Allocator = std::allocator<T>>
+    requires AVL_comparator<Compare, T>
+class persistent_AVL_tree {
+    template <typename K>
+    static constexpr bool is_lookup_key = AVL_lookup_key<K, T, Compare>;
+
+    class AVL_node;
+
+public:
+    using value_type = T;
+    using key_type = T;
+    using key_compare = Compare;
+    using size_type = size_t;
+    using allocator_type = Allocator;
+
+    /**
+     * @brief In order forward iterator over one version, keeping the path from the root.
+     */
+    class const_iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T const*;
+        using reference = T const&;
+
+        const_iterator() = default;
+
+        reference operator*() const
+        {
+            return m_path.back()->m_value;
+        }
+
+        pointer operator->() const
+        {
+            return &m_path.back()->m_value;
+        }
+
+        /**
+         * @brief How many times the value was added.
+         */
+        uint32_t count() const
+        {
+            return m_path.back()->m_count;
+        }
+
+        const_iterator& operator++()
+        {
+            AVL_node const* node = m_path.back();
+            if (node->m_bigger != nullptr) {
+                push_leftmost(node->m_bigger);
+                return *this;
+            }
+            m_path.pop_back();
+            while (!m_path.empty() && (m_path.back()->m_bigger == node)) {
+                node = m_path.back();
+                m_path.pop_back();
+            }
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            auto prev = *this;
+            ++*this;
+            return prev;
+        }
+
+        bool operator==(const_iterator const& other) const
+        {
+            if (m_path.empty() || other.m_path.empty()) {
+                return m_path.empty() == other.m_path.empty();
+            }
+            return m_path.back() == other.m_path.back();
+        }
+
+    private:
+        friend class persistent_AVL_tree;
+
+        void push_leftmost(AVL_node const* node)
+        {
+            for (; node != nullptr; node = node->m_smaller) {
+                m_path.push_back(node);
+            }
+        }
+
+        // Ancestors of the current node, and the node itself. Empty at the end.
+        std::vector<AVL_node const*> m_path {};
+    };
+    using iterator = const_iterator;
+
+    persistent_AVL_tree() = default;
+    explicit persistent_AVL_tree(Compare const& compare, Allocator const& alloc = Allocator()):
+        m_compare(compare),
+        m_alloc(alloc)
+    {
+    }
+
+    /**
+     * @brief Builds a perfectly balanced first version from the sorted range [first, last), in
+     * O(n). Equal values are counted together, and iterators with count() add their counts.
+     *
+     * @note In debug builds, aborts if the range is not sorted.
+     */
+    template <std::forward_iterator It, std::sentinel_for<It> S>
+    persistent_AVL_tree(from_sorted_t,
+        It first,
+        S last,
+        Compare const& compare = Compare(),
+        Allocator const& alloc = Allocator()):
+        m_compare(compare),
+        m_alloc(alloc)
+    {
+        assign_sorted(first, last);
+    }
+
+    /**
+     * @brief Sorts a copy of the range and builds the first version from it in O(n log n).
+     */
+    template <std::input_iterator It, std::sentinel_for<It> S>
+    persistent_AVL_tree(It first,
+        S last,
+        Compare const& compare = Compare(),
+        Allocator const& alloc = Allocator()):
+        m_compare(compare),
+        m_alloc(alloc)
+    {
+        std::vector<T> values(first, last);
+        std::sort(values.begin(), values.end(), m_compare);
+        assign_sorted(values.cbegin(), values.cend());
+    }
+
+    persistent_AVL_tree(persistent_AVL_tree const& other):
+        m_compare(other.m_compare),
+        m_alloc(other.m_alloc),
+        m_root(retain(other.m_root)),
+        m_size(other.m_size)
+    {
+    }
+
+    persistent_AVL_tree(persistent_AVL_tree&& other) noexcept:
+        m_compare(other.m_compare),
+        m_alloc(other.m_alloc),
+        m_root(std::exchange(other.m_root, nullptr)),
+        m_size(std::exchange(other.m_size, 0))
+    {
+    }
+
+    persistent_AVL_tree& operator=(persistent_AVL_tree other) noexcept
+    {
+        std::swap(m_compare, other.m_compare);
+        std::swap(m_alloc, other.m_alloc);
+        std::swap(m_root, other.m_root);
+        std::swap(m_size, other.m_size);
+        return *this;
+    }
+
+    ~persistent_AVL_tree()
+    {
+        release(m_root);
+    }
+
+    /**
+     * @brief New version with the value added once more, in O(log n).
+     */
+    [[nodiscard]] persistent_AVL_tree add(T const& value) const
+    {
+        return persistent_AVL_tree(*this, insert_below(m_root, value), m_size + 1);
+    }
+
+    /**
+     * @brief New version with one occurrence of the value removed, in O(log n). Without the value
+     * it is the same version.
+     */
+    [[nodiscard]] persistent_AVL_tree remove(T const& value) const
+    {
+        return remove<T>(value);
+    }
+
+    template <typename K>
+        requires is_lookup_key<K>
+    [[nodiscard]] persistent_AVL_tree remove(K const& value) const
+    {
+        if (!contains(value)) {
+            return *this;
+        }
+        return persistent_AVL_tree(*this, remove_below(m_root, value), m_size - 1);
+    }
+
+    bool contains(T const& value) const
+    {
+        return count(value) != 0;
+    }
+
+    template <typename K>
+        requires is_lookup_key<K>
+    bool contains(K const& value) const
+    {
+        return count(value) != 0;
+    }
+
+    /**
+     * @brief How many times the value was added, 0 if it is not in this version.
+     */
+    uint32_t count(T const& value) const
+    {
+        return count<T>(value);
+    }
+
+    template <typename K>
+        requires is_lookup_key<K>
+    uint32_t count(K const& value) const
+    {
+        AVL_node const* curr_node = m_root;
+        while (curr_node != nullptr) {
+            if (m_compare(value, curr_node->m_value)) {
+                curr_node = curr_node->m_smaller;
+            } else if (m_compare(curr_node->m_value, value)) {
+                curr_node = curr_node->m_bigger;
+            } else {
+                return curr_node->m_count;
+            }
+        }
+        return 0;
+    }
+
+    bool empty() const
+    {
+        return m_root == nullptr;
+    }
+
+    /**
+     * @brief Number of values, counting repeated values as many times as they were added.
+     */
+    size_type size() const
+    {
+        return m_size;
+    }
+
+    /**
+     * @brief Whether both versions share the same root, that is hold the same values.
+     */
+    bool same_version(persistent_AVL_tree const& other) const
+    {
+        return m_root == other.m_root;
+    }
+
+    const_iterator begin() const
+    {
+        const_iterator it {};
+        it.push_leftmost(m_root);
+        return it;
+    }
+
+    const_iterator end() const
+    {
+        return {};
+    }
+
+#ifdef DEBUG
+    std::string test_tree() const
+    {
+        if (m_root == nullptr) {
+            return "";
+        }
+        auto test_out = test_subtree(m_root);
+        if (!test_out) {
+            return test_out.error();
+        }
+        return "";
+    }
+#endif // ifdef DEBUG
+
+private:
+    class AVL_node {
+    public:
+        AVL_node(T const& value, uint32_t count, AVL_node const* smaller, AVL_node const* bigger):
+            m_value(value),
+            m_smaller(smaller),
+            m_bigger(bigger),
+            m_count(count),
+            m_height(1 + std::max(get_height(smaller), get_height(bigger)))
+        {
+        }
+
+        static int get_height(AVL_node const* node)
+        {
+            return (node == nullptr) ? 0 : node->m_height;
+        }
+
+        T const m_value;
+        // Each node owns a reference to its children.
+        AVL_node const* const m_smaller;
+        AVL_node const* const m_bigger;
+        uint32_t const m_count;
+        int const m_height;
+        // Versions and parent nodes using this node.
+        mutable std::atomic<uint32_t> m_references = 1;
+    };
+
+    using node_allocator =
+        typename std::allocator_traits<Allocator>::template rebind_alloc<AVL_node>;
+    using node_traits = std::allocator_traits<node_allocator>;
+
+    persistent_AVL_tree(persistent_AVL_tree const& base, AVL_node const* root, size_type size):
+        m_compare(base.m_compare),
+        m_alloc(base.m_alloc),
+        m_root(root),
+        m_size(size)
+    {
+    }
+
+    static AVL_node const* retain(AVL_node const* node)
+    {
+        if (node != nullptr) {
+            node->m_references.fetch_add(1, std::memory_order_relaxed);
+        }
+        return node;
+    }
+
+    /**
+     * @brief Drops a reference to node, and frees it (releasing its children) with the last.
+     */
+    void release(AVL_node const* node) const
+    {
+        while ((node != nullptr) &&
+            (node->m_references.fetch_sub(1, std::memory_order_acq_rel) == 1)) {
+            release(node->m_smaller);
+            AVL_node const* bigger = node->m_bigger;
+            auto mutable_node = const_cast<AVL_node*>(node);
+            node_traits::destroy(m_alloc, mutable_node);
+            node_traits::deallocate(m_alloc, mutable_node, 1);
+            node = bigger;
+        }
+    }
+
+    /**
+     * @brief New node taking over the references to smaller and bigger.
+     */
+    AVL_node const* create_node(T const& value,
+        uint32_t count,
+        AVL_node const* smaller,
+        AVL_node const* bigger) const
+    {
+        AVL_node* node = std::to_address(node_traits::allocate(m_alloc, 1));
+        try {
+            node_traits::construct(m_alloc, node, value, count, smaller, bigger);
+        } catch (...) {
+            node_traits::deallocate(m_alloc, node, 1);
+            release(smaller);
+            release(bigger);
+            throw;
+        }
+        return node;
+    }
+
+    /**
+     * @brief New subtree holding smaller, (value, count) and bigger, whose heights differ by at
+     * most 2, rotating where needed. Takes over the references to smaller and bigger.
+     *
+     * @note The nodes the rotations move are copied, the originals may belong to other versions.
+     */
+    AVL_node const* balance(T const& value,
+        uint32_t count,
+        AVL_node const* smaller,
+        AVL_node const* bigger) const
+    {
+        int weight = AVL_node::get_height(bigger) - AVL_node::get_height(smaller);
+        if ((weight >= SMALLER_HEAVY) && (weight <= BIGGER_HEAVY)) {
+            return create_node(value, count, smaller, bigger);
+        }
+
+        if (weight < SMALLER_HEAVY) {
+            AVL_node const* pivot = smaller;
+            AVL_node const* result = nullptr;
+            if (AVL_node::get_height(pivot->m_smaller) >= AVL_node::get_height(pivot->m_bigger)) {
+                result = create_node(pivot->m_value,
+                    pivot->m_count,
+                    retain(pivot->m_smaller),
+                    create_node(value, count, retain(pivot->m_bigger), bigger));
+            } else {
+                AVL_node const* inner = pivot->m_bigger;
+                result = create_node(inner->m_value,
+                    inner->m_count,
+                    create_node(pivot->m_value,
+                        pivot->m_count,
+                        retain(pivot->m_smaller),
+                        retain(inner->m_smaller)),
+                    create_node(value, count, retain(inner->m_bigger), bigger));
+            }
+            release(pivot);
+            return result;
+        }
+
+        AVL_node const* pivot = bigger;
+        AVL_node const* result = nullptr;
+        if (AVL_node::get_height(pivot->m_bigger) >= AVL_node::get_height(pivot->m_smaller)) {
+            result = create_node(pivot->m_value,
+                pivot->m_count,
+                create_node(value, count, smaller, retain(pivot->m_smaller)),
+                retain(pivot->m_bigger));
+        } else {
+            AVL_node const* inner = pivot->m_smaller;
+            result = create_node(inner->m_value,
+                inner->m_count,
+                create_node(value, count, smaller, retain(inner->m_smaller)),
+                create_node(pivot->m_value,
+                    pivot->m_count,
+                    retain(inner->m_bigger),
+                    retain(pivot->m_bigger)));
+        }
+        release(pivot);
+        return result;
+    }
+
+    /**
+     * @brief Copy of the subtree under node with the value added, sharing the untouched nodes.
+     */
+    AVL_node const* insert_below(AVL_node const* node, T const& value) const
+    {
+        if (node == nullptr) {
+            return create_node(value, 1, nullptr, nullptr);
+        }
+        if (m_compare(value, node->m_value)) {
+            return balance(node->m_value,
+                node->m_count,
+                insert_below(node->m_smaller, value),
+                retain(node->m_bigger));
+        }
+        if (m_compare(node->m_value, value)) {
+            return balance(node->m_value,
+                node->m_count,
+                retain(node->m_smaller),
+                insert_below(node->m_bigger, value));
+        }
+        return create_node(node->m_value,
+            node->m_count + 1,
+            retain(node->m_smaller),
+            retain(node->m_bigger));
+    }
+
+    /**
+     * @brief Copy of the subtree under node without its smallest node, which is returned in
+     * smallest (with a reference the caller has to release).
+     */
+    AVL_node const* remove_smallest(AVL_node const* node, AVL_node const*& smallest) const
+    {
+        if (node->m_smaller == nullptr) {
+            smallest = retain(node);
+            return retain(node->m_bigger);
+        }
+        return balance(node->m_value,
+            node->m_count,
+            remove_smallest(node->m_smaller, smallest),
+            retain(node->m_bigger));
+    }
+
+    /**
+     * @brief Copy of the subtree under node with one occurrence of the value removed.
+     *
+     * @note The value must be in the subtree.
+     */
+    template <typename K>
+    AVL_node const* remove_below(AVL_node const* node, K const& value) const
+    {
+        if (m_compare(value, node->m_value)) {
+            return balance(node->m_value,
+                node->m_count,
+                remove_below(node->m_smaller, value),
+                retain(node->m_bigger));
+        }
+        if (m_compare(node->m_value, value)) {
+            return balance(node->m_value,
+                node->m_count,
+                retain(node->m_smaller),
+                remove_below(node->m_bigger, value));
+        }
+        if (node->m_count > 1) {
+            return create_node(node->m_value,
+                node->m_count - 1,
+                retain(node->m_smaller),
+                retain(node->m_bigger));
+        }
+        if (node->m_smaller == nullptr) {
+            return retain(node->m_bigger);
+        }
+        if (node->m_bigger == nullptr) {
+            return retain(node->m_smaller);
+        }
+
+        AVL_node const* successor = nullptr;
+        AVL_node const* bigger = remove_smallest(node->m_bigger, successor);
+        auto result =
+            balance(successor->m_value, successor->m_count, retain(node->m_smaller), bigger);
+        release(successor);
+        return result;
+    }
+
+    /**
+     * @brief Builds the first version from a sorted range, counting its runs of equal values.
+     */
+    template <std::forward_iterator It, std::sentinel_for<It> S>
+    void assign_sorted(It first, S last)
+    {
+        std::vector<std::pair<T, uint32_t>> runs {};
+        for (; first != last; ++first) {
+#ifdef DEBUG
+            if (!runs.empty() && m_compare(*first, runs.back().first)) {
+                std::abort();
+            }
+#endif // ifdef DEBUG
+            if (runs.empty() || m_compare(runs.back().first, *first)) {
+                runs.emplace_back(*first, 0);
+            }
+            runs.back().second += AVL_iterator_count(first);
+            m_size += AVL_iterator_count(first);
+        }
+        m_root = build_sorted(runs, 0, runs.size());
+    }
+
+    AVL_node const* build_sorted(std::vector<std::pair<T, uint32_t>> const& runs,
+        size_t first,
+        size_t last) const
+    {
+        if (first == last) {
+            return nullptr;
+        }
+        size_t middle = first + (last - first) / 2;
+        auto smaller = build_sorted(runs, first, middle);
+        AVL_node const* bigger = nullptr;
+        try {
+            bigger = build_sorted(runs, middle + 1, last);
+        } catch (...) {
+            release(smaller);
+            throw;
+        }
+        return create_node(runs[middle].first, runs[middle].second, smaller, bigger);
+    }
+
+#ifdef DEBUG
+    std::expected<int, std::string> test_subtree(AVL_node const* node) const
+    {
+        int heights[2] = { 0, 0 };
+        for (bool is_bigger : { false, true }) {
+            AVL_node const* child = is_bigger ? node->m_bigger : node->m_smaller;
+            if (child == nullptr) {
+                continue;
+            }
+            if (is_bigger ? !m_compare(node->m_value, child->m_value)
+                          : !m_compare(child->m_value, node->m_value)) {
+                return std::unexpected { "children are out of order" };
+            }
+            auto child_out = test_subtree(child);
+            if (!child_out) {
+                return child_out;
+            }
+            heights[is_bigger] = *child_out;
+        }
+
+        if ((node->m_count == 0) || (node->m_references.load() == 0)) {
+            return std::unexpected { "dead node is reachable" };
+        }
+        if (std::abs(heights[1] - heights[0]) > BIGGER_HEAVY) {
+            return std::unexpected { "unbalanced node, heights: " + std::to_string(heights[0]) +
+                ", " + std::to_string(heights[1]) };
+        }
+        if (node->m_height != std::max(heights[0], heights[1]) + 1) {
+            return std::unexpected { "saved height is: " + std::to_string(node->m_height) };
+        }
+        return node->m_height;
+    }
+#endif // ifdef DEBUG
+
+    [[no_unique_address]] Compare m_compare {};
+    // Allocating new versions does not change this one.
+    [[no_unique_address]] mutable node_allocator m_alloc {};
+    AVL_node const* m_root = nullptr;
+    size_type m_size = 0;
+};
+
+#endif // PERSISTENT_AVL_TREE_H
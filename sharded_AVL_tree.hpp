@@ -0,0 +1,325 @@
+/*
+Purpose:    sharded_AVL_tree class declaration - a counted AVL set split into independently
+            locked AVL_tree shards.
+*/
+
+#ifndef SHARDED_AVL_TREE_H
+#define SHARDED_AVL_TREE_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <ranges>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "AVL_pool_allocator.hpp"
+#include "AVL_tree.hpp"
+
+/**
+ * @brief Counted AVL set whose key space is split over N AVL_tree shards, each with its own
+ * mutex and its own allocator (so its own node pool with the default AVL_pool_allocator).
+ *
+ * Values are routed either by hash, or by ranges whose bounds are picked from a sample of the
+ * expected keys. Point operations lock a single shard, so writers to different shards do not
+ * contend. Iteration merges the shards back into a single sorted sequence.
+ *
+ * @note The iterators and range() do not lock - use them only while no thread modifies the tree,
+ * or use for_each_in_range() which locks the shards it visits.
+ */
+template <typename T,
+    size_t N,
+    typename Compare = std::less<T>,
+    typename Hash = std::hash<T>,
+    typename Allocator = AVL_pool_allocator<T>>
+    requires AVL_comparator<Compare, T> && (N > 0)
+class sharded_AVL_tree {
+    using shard_tree = AVL_tree<T, Compare, Allocator>;
+    using shard_iterator = typename shard_tree::const_iterator;
+
+public:
+    using value_type = T;
+    using key_type = T;
+    using key_compare = Compare;
+    using size_type = size_t;
+
+    static constexpr size_t SHARD_COUNT = N;
+
+    /**
+     * @brief Forward iterator over the values of all shards in order, picking the smallest of the
+     * N shard iterators at each step.
+     */
+    class const_iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T const*;
+        using reference = T const&;
+
+        const_iterator() = default;
+
+        reference operator*() const
+        {
+            return *m_positions[m_current].first;
+        }
+
+        pointer operator->() const
+        {
+            return &*m_positions[m_current].first;
+        }
+
+        /**
+         * @brief How many times the value was added.
+         */
+        uint32_t count() const
+        {
+            return m_positions[m_current].first.count();
+        }
+
+        const_iterator& operator++()
+        {
+            ++m_positions[m_current].first;
+            select_current();
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            auto prev = *this;
+            ++*this;
+            return prev;
+        }
+
+        bool operator==(const_iterator const& other) const
+        {
+            if ((m_current == N) || (other.m_current == N)) {
+                return m_current == other.m_current;
+            }
+            return (m_current == other.m_current) &&
+                (m_positions[m_current].first == other.m_positions[m_current].first);
+        }
+
+        friend bool operator==(const_iterator const& it, std::default_sentinel_t)
+        {
+            return it.m_current == N;
+        }
+
+    private:
+        friend class sharded_AVL_tree;
+
+        using positions_type = std::array<std::pair<shard_iterator, shard_iterator>, N>;
+
+        const_iterator(positions_type const& positions, Compare const* compare):
+            m_positions(positions),
+            m_compare(compare)
+        {
+            select_current();
+        }
+
+        void select_current()
+        {
+            m_current = N;
+            for (size_t i = 0; i < N; ++i) {
+                auto const& [position, end] = m_positions[i];
+                if ((position != end) &&
+                    ((m_current == N) || (*m_compare)(*position, *m_positions[m_current].first))) {
+                    m_current = i;
+                }
+            }
+        }
+
+        // Current position and end of every shard.
+        positions_type m_positions {};
+        Compare const* m_compare = nullptr;
+        // Shard holding the current value, N at the end.
+        size_t m_current = N;
+    };
+    using iterator = const_iterator;
+    using range_type = std::ranges::subrange<const_iterator, std::default_sentinel_t>;
+
+    /**
+     * @brief Routes the values by hash.
+     */
+    sharded_AVL_tree() = default;
+
+    /**
+     * @brief Routes the values by ranges, split at the N-quantiles of a sample of the expected
+     * values so that every shard gets about the same share.
+     *
+     * @note An empty sample falls back to routing by hash.
+     */
+    explicit sharded_AVL_tree(std::span<T const> samples, Compare const& compare = Compare()):
+        m_compare(compare)
+    {
+        for (auto& shard : m_shards) {
+            shard.m_tree = shard_tree(m_compare);
+        }
+        if (samples.empty()) {
+            return;
+        }
+        std::vector<T> sorted(samples.begin(), samples.end());
+        std::sort(sorted.begin(), sorted.end(), m_compare);
+        m_splitters.reserve(N - 1);
+        for (size_t i = 1; i < N; ++i) {
+            m_splitters.push_back(sorted[i * sorted.size() / N]);
+        }
+    }
+
+    sharded_AVL_tree(sharded_AVL_tree const&) = delete;
+    sharded_AVL_tree& operator=(sharded_AVL_tree const&) = delete;
+
+    /**
+     * @brief Whether values are routed by ranges (true) or by hash (false).
+     */
+    bool is_range_partitioned() const
+    {
+        return !m_splitters.empty();
+    }
+
+    /**
+     * @brief Index of the shard a value belongs to.
+     */
+    size_t shard_of(T const& value) const
+    {
+        if (is_range_partitioned()) {
+            return static_cast<size_t>(
+                std::upper_bound(m_splitters.begin(), m_splitters.end(), value, m_compare) -
+                m_splitters.begin());
+        }
+        // Fibonacci hashing, so that weak hashes (like the identity for integers) still spread.
+        uint64_t hash = static_cast<uint64_t>(m_hash(value)) * 0x9E3779B97F4A7C15ULL;
+        return static_cast<size_t>((hash >> 32) % N);
+    }
+
+    void add(T const& value)
+    {
+        auto& shard = m_shards[shard_of(value)];
+        std::lock_guard lock(shard.m_mutex);
+        shard.m_tree.add(value);
+    }
+
+    void add(T&& value)
+    {
+        auto& shard = m_shards[shard_of(value)];
+        std::lock_guard lock(shard.m_mutex);
+        shard.m_tree.add(std::move(value));
+    }
+
+    avl_statuses remove(T const& value)
+    {
+        auto& shard = m_shards[shard_of(value)];
+        std::lock_guard lock(shard.m_mutex);
+        return shard.m_tree.remove(value);
+    }
+
+    bool contains(T const& value) const
+    {
+        auto const& shard = m_shards[shard_of(value)];
+        std::lock_guard lock(shard.m_mutex);
+        return shard.m_tree.contains(value);
+    }
+
+    bool empty() const
+    {
+        return std::ranges::all_of(m_shards, [](auto const& shard) {
+            std::lock_guard lock(shard.m_mutex);
+            return shard.m_tree.empty();
+        });
+    }
+
+    const_iterator begin() const
+    {
+        typename const_iterator::positions_type positions {};
+        for (size_t i = 0; i < N; ++i) {
+            positions[i] = { m_shards[i].m_tree.begin(), m_shards[i].m_tree.end() };
+        }
+        return const_iterator(positions, &m_compare);
+    }
+
+    std::default_sentinel_t end() const
+    {
+        return std::default_sentinel;
+    }
+
+    /**
+     * @brief Lazy view of the values in [low, high), merged from every shard. Costs 2 descents
+     * per shard. Empty if high is smaller than low.
+     */
+    range_type range(T const& low, T const& high) const
+    {
+        typename const_iterator::positions_type positions {};
+        bool is_empty = m_compare(high, low);
+        for (size_t i = 0; i < N; ++i) {
+            auto const& tree = m_shards[i].m_tree;
+            positions[i] = is_empty ? std::pair { tree.end(), tree.end() }
+                                    : std::pair { tree.lower_bound(low), tree.lower_bound(high) };
+        }
+        return range_type(const_iterator(positions, &m_compare), std::default_sentinel);
+    }
+
+    /**
+     * @brief Calls fn(value, count) for the values in [low, high) in order, holding the locks of
+     * the shards which may contain such values.
+     *
+     * @note With range routing these are only the overlapping shards, visited one after another.
+     * With hash routing all shards are locked together (in index order) for the merge.
+     */
+    template <typename F>
+    void for_each_in_range(T const& low, T const& high, F&& fn) const
+    {
+        if (m_compare(high, low)) {
+            return;
+        }
+        if (is_range_partitioned()) {
+            auto last_shard = shard_of(high);
+            for (auto i = shard_of(low); i <= last_shard; ++i) {
+                std::lock_guard lock(m_shards[i].m_mutex);
+                for (auto it = m_shards[i].m_tree.lower_bound(low);
+                     (it != m_shards[i].m_tree.end()) && m_compare(*it, high);
+                     ++it) {
+                    fn(*it, it.count());
+                }
+            }
+            return;
+        }
+
+        std::array<std::unique_lock<std::mutex>, N> locks {};
+        for (size_t i = 0; i < N; ++i) {
+            locks[i] = std::unique_lock(m_shards[i].m_mutex);
+        }
+        for (auto it = range(low, high).begin(); it != std::default_sentinel; ++it) {
+            fn(*it, it.count());
+        }
+    }
+
+    /**
+     * @brief Direct access to a shard's tree.
+     *
+     * @note Not synchronized.
+     */
+    shard_tree const& shard(size_t index) const
+    {
+        return m_shards[index].m_tree;
+    }
+
+private:
+    // Each shard on its own cache lines, so that writers to neighbour shards do not contend.
+    struct alignas(64) shard_type {
+        mutable std::mutex m_mutex {};
+        shard_tree m_tree {};
+    };
+
+    [[no_unique_address]] Compare m_compare {};
+    [[no_unique_address]] Hash m_hash {};
+    // Shard i holds the values in [m_splitters[i - 1], m_splitters[i]), empty for hash routing.
+    std::vector<T> m_splitters {};
+    std::array<shard_type, N> m_shards {};
+};
+
+#endif // SHARDED_AVL_TREE_H
@@ -1,12 +1,37 @@
 /*
    Simple manual test for the AVL_tree library.
 */
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <numeric>
 #include <print>
+#include <random>
+#include <ranges>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <tuple>
+#include <vector>
 using namespace std;
 
+#include "AVL_map.hpp"
+#include "AVL_merge_cursor.hpp"
+#include "AVL_pool_allocator.hpp"
+#include "AVL_snapshot.hpp"
 #include "AVL_tree.hpp"
+#include "compact_AVL_tree.hpp"
+#include "concurrent_AVL_tree.hpp"
+#include "persistent_AVL_tree.hpp"
+#include "sharded_AVL_tree.hpp"
 
 typedef std::tuple<bool, std::string> test_result;
 
@@ -182,12 +207,1968 @@ test_result test_add_contains()
     return test_result(true, __func__);
 }
 
+test_result test_pool_allocator()
+{
+    AVL_pool_allocator<int> alloc {};
+    AVL_tree<int, std::less<int>, AVL_pool_allocator<int>> tree { alloc };
+    for (int i = 0; i < 1000; ++i) {
+        tree.add((i * 7919) % 1000);
+    }
+    auto reserved = alloc.pool().reserved_bytes();
+    if (reserved == 0) {
+        return test_result(false, __func__);
+    }
+
+    for (int i = 0; i < 1000; i += 2) {
+        tree.remove(i);
+    }
+    for (int i = 0; i < 1000; i += 2) {
+        tree.add(i);
+    }
+    // removed nodes are recycled, so re-adding must not grow the pool.
+    if (alloc.pool().reserved_bytes() != reserved) {
+        return test_result(false, __func__);
+    }
+
+    auto err = tree.test_tree();
+    if (err != "") {
+        std::println("error in tree: {}", err);
+        return test_result(false, __func__);
+    }
+    for (int i = 0; i < 1000; ++i) {
+        if (!tree.contains(i)) {
+            return test_result(false, __func__);
+        }
+    }
+
+    AVL_tree<int, std::less<int>, AVL_pool_allocator<int>> moved { std::move(tree) };
+    if (!moved.contains(500) || tree.contains(500)) {
+        return test_result(false, __func__);
+    }
+
+    return test_result(true, __func__);
+}
+
+test_result test_compact_tree()
+{
+    compact_AVL_tree<int> tree {};
+    std::map<int, int> expected {};
+    std::mt19937 rng { 42 };
+
+    for (int i = 0; i < 20000; ++i) {
+        int value = static_cast<int>(rng() % 500);
+        if (rng() % 3 == 0) {
+            bool found = expected.contains(value);
+            if ((tree.remove(value) == avl_statuses::SUCCESS) != found) {
+                return test_result(false, __func__);
+            }
+            if (found && (--expected[value] == 0)) {
+                expected.erase(value);
+            }
+        } else {
+            tree.add(value);
+            expected[value] += 1;
+        }
+
+        if (i % 1000 == 0) {
+            auto err = tree.test_tree();
+            if (err != "") {
+                std::println("error in tree: {}", err);
+                return test_result(false, __func__);
+            }
+        }
+    }
+
+    if (tree.unique_size() != expected.size()) {
+        return test_result(false, __func__);
+    }
+    for (int value = 0; value < 500; ++value) {
+        if (tree.contains(value) != expected.contains(value)) {
+            return test_result(false, __func__);
+        }
+    }
+
+    return test_result(true, __func__);
+}
+
+test_result test_build_from_sorted()
+{
+    std::vector<int> sorted {};
+    for (int i = 0; i < 1000; ++i) {
+        sorted.push_back(i / 3);
+    }
+
+    AVL_tree<int> tree { from_sorted, sorted.begin(), sorted.end() };
+    auto err = tree.test_tree();
+    if (err != "") {
+        std::println("error in tree: {}", err);
+        return test_result(false, __func__);
+    }
+    for (auto value : sorted) {
+        if (!tree.contains(value)) {
+            return test_result(false, __func__);
+        }
+    }
+    // each value was added 3 times.
+    for (int i = 0; i < 3; ++i) {
+        if (tree.remove(10) != avl_statuses::SUCCESS) {
+            return test_result(false, __func__);
+        }
+    }
+    if (tree.contains(10) || tree.contains(-1) || tree.contains(334)) {
+        return test_result(false, __func__);
+    }
+
+    std::vector<int> unsorted { 9, 1, 8, 2, 7, 3, 6, 4, 5, 5 };
+    AVL_tree<int> sorted_tree { unsorted.begin(), unsorted.end() };
+    err = sorted_tree.test_tree();
+    if (err != "") {
+        std::println("error in tree: {}", err);
+        return test_result(false, __func__);
+    }
+    for (auto value : unsorted) {
+        if (!sorted_tree.contains(value)) {
+            return test_result(false, __func__);
+        }
+    }
+
+    AVL_tree<int> empty_tree { from_sorted, sorted.end(), sorted.end() };
+    if (empty_tree.contains(0) || (empty_tree.test_tree() != "")) {
+        return test_result(false, __func__);
+    }
+
+    return test_result(true, __func__);
+}
+
+test_result test_iterators()
+{
+    static_assert(std::bidirectional_iterator<AVL_tree<int>::const_iterator>);
+    static_assert(std::ranges::bidirectional_range<AVL_tree<int>>);
+
+    AVL_tree<int> tree {};
+    if (tree.begin() != tree.end()) {
+        return test_result(false, __func__);
+    }
+
+    std::multiset<int> expected {};
+    std::mt19937 rng { 7 };
+    for (int i = 0; i < 2000; ++i) {
+        int value = static_cast<int>(rng() % 700);
+        tree.add(value);
+        expected.insert(value);
+    }
+
+    size_t total = 0;
+    auto expected_it = expected.begin();
+    for (auto it = tree.begin(); it != tree.end(); ++it) {
+        if ((*it != *expected_it) || (it.count() != expected.count(*it))) {
+            return test_result(false, __func__);
+        }
+        total += it.count();
+        std::advance(expected_it, it.count());
+    }
+    if (total != expected.size()) {
+        return test_result(false, __func__);
+    }
+
+    auto reversed = std::ranges::subrange(tree.rbegin(), tree.rend());
+    if (!std::ranges::is_sorted(reversed, std::ranges::greater {})) {
+        return test_result(false, __func__);
+    }
+    if ((*std::ranges::max_element(tree) != *expected.rbegin()) ||
+        (*std::prev(tree.end()) != *expected.rbegin())) {
+        return test_result(false, __func__);
+    }
+
+    return test_result(true, __func__);
+}
+
+test_result test_range_queries()
+{
+    AVL_tree<int> tree {};
+    for (int i = 0; i < 100; i += 2) {
+        tree.add(i);
+    }
+    tree.add(40);
+
+    if ((*tree.lower_bound(41) != 42) || (*tree.lower_bound(40) != 40) ||
+        (*tree.upper_bound(40) != 42) || (tree.lower_bound(99) != tree.end()) ||
+        (*tree.lower_bound(-5) != 0) || (tree.upper_bound(98) != tree.end())) {
+        return test_result(false, __func__);
+    }
+
+    auto [first, last] = tree.equal_range(40);
+    if ((std::distance(first, last) != 1) || (first.count() != 2)) {
+        return test_result(false, __func__);
+    }
+    auto [missing_first, missing_last] = tree.equal_range(41);
+    if ((missing_first != missing_last) || (*missing_first != 42)) {
+        return test_result(false, __func__);
+    }
+
+    std::vector<int> in_range {};
+    for (auto value : tree.range(11, 21)) {
+        in_range.push_back(value);
+    }
+    if (in_range != std::vector<int> { 12, 14, 16, 18, 20 }) {
+        return test_result(false, __func__);
+    }
+    if (!std::ranges::empty(tree.range(13, 14)) || !std::ranges::empty(tree.range(200, 300))) {
+        return test_result(false, __func__);
+    }
+    if (std::ranges::distance(tree.range(-10, 1000)) != 50) {
+        return test_result(false, __func__);
+    }
+    if ((tree.find(13) != tree.end()) || (*tree.find(14) != 14)) {
+        return test_result(false, __func__);
+    }
+
+    return test_result(true, __func__);
+}
+
+test_result test_transparent_lookup()
+{
+    AVL_tree<std::string, std::less<>> tree {};
+    for (auto word : { "delta", "alpha", "charlie", "bravo", "echo" }) {
+        tree.add(word);
+    }
+
+    std::string_view probe = "charlie";
+    if (!tree.contains(probe) || tree.contains(std::string_view("zulu")) ||
+        !tree.contains("alpha")) {
+        return test_result(false, __func__);
+    }
+    if ((*tree.lower_bound(std::string_view("c")) != "charlie") ||
+        (std::ranges::distance(tree.range(std::string_view("b"), std::string_view("d"))) != 2)) {
+        return test_result(false, __func__);
+    }
+    if ((tree.remove(std::string_view("bravo")) != avl_statuses::SUCCESS) ||
+        tree.contains("bravo")) {
+        return test_result(false, __func__);
+    }
+
+    // a custom comparator orders the tree.
+    AVL_tree<int, std::greater<int>> reversed {};
+    for (int i = 0; i < 10; ++i) {
+        reversed.add(i);
+    }
+    if ((*reversed.begin() != 9) || (reversed.test_tree() != "")) {
+        return test_result(false, __func__);
+    }
+    if ((*reversed.lower_bound(5) != 5) || (*reversed.upper_bound(5) != 4)) {
+        return test_result(false, __func__);
+    }
+
+    return test_result(true, __func__);
+}
+
+// Counts how it is constructed, to catch redundant copies and moves.
+class counted {
+public:
+    counted(int value):
+        val(value)
+    {
+        constructions += 1;
+    }
+    counted(counted const& other):
+        val(other.val)
+    {
+        copies += 1;
+    }
+    counted(counted&& other) noexcept:
+        val(other.val)
+    {
+        moves += 1;
+    }
+    counted& operator=(counted const&) = default;
+    counted& operator=(counted&&) = default;
+    auto operator<=>(const counted& other) const
+    {
+        return val <=> other.val;
+    }
+
+    int val;
+    static inline int constructions = 0;
+    static inline int copies = 0;
+    static inline int moves = 0;
+};
+
+test_result test_insert_and_emplace()
+{
+    AVL_tree<counted> tree {};
+    counted five { 5 };
+    auto [first_it, first_new] = tree.insert(five);
+    auto [second_it, second_new] = tree.insert(five);
+    // the existing value is only counted, never copied again.
+    if (!first_new || second_new || (first_it != second_it) || (counted::copies != 1) ||
+        (second_it.count() != 2)) {
+        return test_result(false, __func__);
+    }
+
+    for (int i = 0; i < 100; ++i) {
+        auto [it, is_new] = tree.emplace(i);
+        if ((it->val != i) || (is_new == (i == 5))) {
+            return test_result(false, __func__);
+        }
+    }
+    // every value is constructed once, in its node, and rotations do not copy.
+    if ((counted::constructions != 101) || (counted::copies != 1)) {
+        return test_result(false, __func__);
+    }
+
+    auto moves = counted::moves;
+    tree.add(counted { 5 });
+    if (counted::moves != moves) {
+        return test_result(false, __func__);
+    }
+    tree.add(counted { 500 });
+    // rotations relink nodes, so the new value is moved exactly once, into its node.
+    if ((counted::moves != moves + 1) || (tree.find(counted { 5 }).count() != 4)) {
+        return test_result(false, __func__);
+    }
+
+    // nodes stay put while other values are added and removed around them.
+    auto pinned = tree.find(counted { 50 });
+    for (int i = 1000; i < 2000; ++i) {
+        tree.add(counted { i });
+    }
+    for (int i = 0; i < 100; ++i) {
+        if (i != 50) {
+            tree.remove(counted { i });
+        }
+    }
+    if ((pinned->val != 50) || (tree.find(counted { 50 }) != pinned)) {
+        return test_result(false, __func__);
+    }
+
+    AVL_tree<std::unique_ptr<int>> move_only {};
+    move_only.add(std::make_unique<int>(1));
+    move_only.emplace(new int(2));
+
+    return test_result(true, __func__);
+}
+
+test_result test_random_operations()
+{
+    AVL_tree<int> tree {};
+    std::multiset<int> expected {};
+    std::mt19937 rng { 1234 };
+
+    for (int i = 0; i < 30000; ++i) {
+        int value = static_cast<int>(rng() % 2000);
+        if (rng() % 2 == 0) {
+            bool found = expected.contains(value);
+            if ((tree.remove(value) == avl_statuses::SUCCESS) != found) {
+                return test_result(false, __func__);
+            }
+            if (found) {
+                expected.erase(expected.find(value));
+            }
+        } else {
+            tree.add(value);
+            expected.insert(value);
+        }
+
+        if (i % 1000 == 0) {
+            auto err = tree.test_tree();
+            if (err != "") {
+                std::println("error in tree: {}", err);
+                return test_result(false, __func__);
+            }
+        }
+    }
+
+    size_t total = 0;
+    for (auto it = tree.begin(); it != tree.end(); ++it) {
+        if (it.count() != expected.count(*it)) {
+            return test_result(false, __func__);
+        }
+        total += it.count();
+    }
+    if (total != expected.size()) {
+        return test_result(false, __func__);
+    }
+
+    return test_result(true, __func__);
+}
+
+test_result test_order_statistics()
+{
+    AVL_tree<int, std::less<int>, std::allocator<int>, AVL_order_statistics_traits> tree {};
+    std::multiset<int> expected {};
+    std::mt19937 rng { 4321 };
+
+    if ((tree.size() != 0) || (tree.select(0) != tree.end()) ||
+        (tree.quantile(0.5) != tree.end())) {
+        return test_result(false, __func__);
+    }
+    for (int i = 0; i < 20000; ++i) {
+        int value = static_cast<int>(rng() % 500);
+        if (rng() % 3 == 0) {
+            if (expected.contains(value)) {
+                expected.erase(expected.find(value));
+            }
+            tree.remove(value);
+        } else {
+            tree.add(value);
+            expected.insert(value);
+        }
+
+        if (i % 1000 == 0) {
+            auto err = tree.test_tree();
+            if (err != "") {
+                std::println("error in tree: {}", err);
+                return test_result(false, __func__);
+            }
+        }
+    }
+
+    if (tree.size() != expected.size()) {
+        return test_result(false, __func__);
+    }
+    size_t index = 0;
+    for (auto value : expected) {
+        if (*tree.select(index) != value) {
+            return test_result(false, __func__);
+        }
+        index += 1;
+    }
+    if (tree.select(expected.size()) != tree.end()) {
+        return test_result(false, __func__);
+    }
+    for (int value = -1; value <= 500; ++value) {
+        auto smaller = static_cast<size_t>(
+            std::distance(expected.begin(), expected.lower_bound(value)));
+        if (tree.rank(value) != smaller) {
+            return test_result(false, __func__);
+        }
+    }
+    if ((*tree.quantile(0.0) != *expected.begin()) || (*tree.quantile(1.0) != *expected.rbegin()) ||
+        (*tree.quantile(0.5) != *std::next(expected.begin(), (expected.size() - 1) / 2))) {
+        return test_result(false, __func__);
+    }
+
+    std::vector<int> sorted { 1, 1, 2, 3, 3, 3, 7 };
+    AVL_tree<int, std::less<int>, std::allocator<int>, AVL_order_statistics_traits> built {
+        from_sorted, sorted.begin(), sorted.end()
+    };
+    if ((built.size() != 7) || (built.rank(3) != 3) || (*built.select(5) != 3) ||
+        (built.test_tree() != "")) {
+        return test_result(false, __func__);
+    }
+
+    return test_result(true, __func__);
+}
+
+test_result test_concurrent_tree()
+{
+    concurrent_AVL_tree<int> tree {};
+    std::atomic<bool> is_failed = false;
+    std::atomic<int> writers_done = 0;
+    const int KEY_COUNT = 4000;
+    const int WRITER_COUNT = 2;
+
+    // Even values always stay in the tree, odd ones are added and removed by the writers.
+    for (int i = 0; i < KEY_COUNT; i += 2) {
+        tree.add(i);
+    }
+
+    std::vector<std::thread> threads {};
+    for (int w = 0; w < WRITER_COUNT; ++w) {
+        threads.emplace_back([&, w] {
+            std::mt19937 rng(w);
+            for (int i = 0; i < 40000; ++i) {
+                int value = static_cast<int>(rng() % (KEY_COUNT / 2)) * 2 + 1;
+                if (rng() % 2 == 0) {
+                    tree.add(value);
+                } else {
+                    tree.remove(value);
+                }
+            }
+            writers_done += 1;
+        });
+    }
+    for (int r = 0; r < 4; ++r) {
+        threads.emplace_back([&, r] {
+            std::mt19937 rng(100 + r);
+            while (writers_done < WRITER_COUNT) {
+                int value = static_cast<int>(rng() % KEY_COUNT);
+                if (((value % 2 == 0) && !tree.contains(value)) ||
+                    tree.contains(KEY_COUNT + value)) {
+                    is_failed = true;
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (is_failed || (tree.test_tree() != "")) {
+        return test_result(false, __func__);
+    }
+
+    // With the writers done, removing every odd value leaves only the even ones.
+    for (int i = 1; i < KEY_COUNT; i += 2) {
+        while (tree.remove(i) == avl_statuses::SUCCESS) { }
+    }
+    for (int i = 0; i < KEY_COUNT; ++i) {
+        if ((tree.count(i) == 1) != (i % 2 == 0)) {
+            return test_result(false, __func__);
+        }
+    }
+    auto err = tree.test_tree();
+    if (err != "") {
+        std::println("error in tree: {}", err);
+        return test_result(false, __func__);
+    }
+
+    // Without readers, two epochs later every unlinked node is freed.
+    size_t retired = tree.retired_count();
+    if ((retired == 0) || (tree.reclaim() + tree.reclaim() != retired) ||
+        (tree.retired_count() != 0) || (tree.count(0) != 1)) {
+        return test_result(false, __func__);
+    }
+
+    return test_result(true, __func__);
+}
+
+test_result test_sharded_tree()
+{
+    std::vector<int> samples {};
+    for (int i = 0; i < 1000; i += 10) {
+        samples.push_back(i);
+    }
+    sharded_AVL_tree<int, 4> hashed {};
+    sharded_AVL_tree<int, 4> ranged { samples };
+    if (hashed.is_range_partitioned() || !ranged.is_range_partitioned() || !ranged.empty()) {
+        return test_result(false, __func__);
+    }
+    if ((ranged.shard_of(0) != 0) || (ranged.shard_of(999) != 3) || (ranged.shard_of(260) != 1)) {
+        return test_result(false, __func__);
+    }
+
+    // Writers on all shards at once.
+    std::vector<std::thread> threads {};
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t] {
+            for (int i = t; i < 1000; i += 4) {
+                hashed.add(i);
+                ranged.add(i);
+                if (i % 3 == 0) {
+                    hashed.add(i);
+                    ranged.add(i);
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    std::multiset<int> expected {};
+    for (int i = 0; i < 1000; ++i) {
+        expected.insert(i);
+        if (i % 3 == 0) {
+            expected.insert(i);
+        }
+    }
+    for (int i = 0; i < 1000; i += 7) {
+        hashed.remove(i);
+        ranged.remove(i);
+        expected.erase(expected.find(i));
+    }
+
+    for (auto const* tree : { &hashed, &ranged }) {
+        std::vector<int> walked {};
+        for (auto it = tree->begin(); it != tree->end(); ++it) {
+            for (uint32_t i = 0; i < it.count(); ++i) {
+                walked.push_back(*it);
+            }
+        }
+        if (!std::ranges::equal(walked, expected)) {
+            return test_result(false, __func__);
+        }
+
+        std::vector<int> ranged_values {};
+        for (auto value : tree->range(100, 300)) {
+            ranged_values.push_back(value);
+        }
+        std::vector<int> locked_values {};
+        tree->for_each_in_range(100, 300, [&](int value, uint32_t) {
+            locked_values.push_back(value);
+        });
+        auto expected_range = std::ranges::subrange(expected.lower_bound(100),
+                                  expected.lower_bound(300)) |
+            std::views::filter([last = -1](int value) mutable {
+                return std::exchange(last, value) != value;
+            });
+        if (!std::ranges::equal(ranged_values, expected_range) ||
+            (ranged_values != locked_values) || !tree->range(300, 100).empty()) {
+            return test_result(false, __func__);
+        }
+        if (tree->contains(7) || !tree->contains(8) || tree->contains(1000)) {
+            return test_result(false, __func__);
+        }
+    }
+    for (size_t i = 0; i < 4; ++i) {
+        if (ranged.shard(i).empty() || hashed.shard(i).empty()) {
+            return test_result(false, __func__);
+        }
+    }
+
+    return test_result(true, __func__);
+}
+
+test_result test_batch_operations()
+{
+    AVL_tree<int> tree {};
+    AVL_tree<int, std::less<int>, std::allocator<int>, AVL_order_statistics_traits> counted {};
+    std::multiset<int> expected {};
+    std::mt19937 rng { 99 };
+
+    for (int round = 0; round < 20; ++round) {
+        std::vector<int> batch(1000);
+        for (auto& value : batch) {
+            value = static_cast<int>(rng() % 5000);
+        }
+        auto copy = batch;
+        if (round % 3 == 2) {
+            size_t removed = 0;
+            for (auto value : batch) {
+                if (expected.contains(value)) {
+                    expected.erase(expected.find(value));
+                    removed += 1;
+                }
+            }
+            if ((tree.remove_batch(batch) != removed) || (counted.remove_batch(copy) != removed)) {
+                return test_result(false, __func__);
+            }
+        } else {
+            expected.insert(batch.begin(), batch.end());
+            tree.add_batch(batch);
+            counted.add_batch(copy);
+        }
+        if ((tree.test_tree() != "") || (counted.test_tree() != "") ||
+            (counted.size() != expected.size())) {
+            return test_result(false, __func__);
+        }
+    }
+
+    std::vector<int> lookups {};
+    for (int i = -10; i < 5010; ++i) {
+        lookups.push_back((i * 7919) % 5020 - 10);
+    }
+    auto results = std::make_unique<bool[]>(lookups.size());
+    tree.contains_batch(lookups, std::span<bool>(results.get(), lookups.size()));
+    for (size_t i = 0; i < lookups.size(); ++i) {
+        if (results[i] != expected.contains(lookups[i])) {
+            return test_result(false, __func__);
+        }
+    }
+    for (auto it = tree.begin(); it != tree.end(); ++it) {
+        if (it.count() != expected.count(*it)) {
+            return test_result(false, __func__);
+        }
+    }
+
+    return test_result(true, __func__);
+}
+
+test_result test_contains_many()
+{
+    AVL_tree<int> tree {};
+    std::vector<int> values {};
+    auto results = std::make_unique<bool[]>(3000);
+
+    tree.contains_many(std::span<int const>(), std::span<bool>());
+    values.push_back(1);
+    tree.contains_many(values, std::span<bool>(results.get(), 1));
+    if (results[0]) {
+        return test_result(false, __func__);
+    }
+
+    for (int i = 0; i < 3000; i += 3) {
+        tree.add(i);
+    }
+    // Fewer, as many and more values than searches run at once.
+    for (size_t count : { 5, 16, 3000 }) {
+        values.clear();
+        for (size_t i = 0; i < count; ++i) {
+            values.push_back(static_cast<int>((i * 7919) % 3100));
+        }
+        tree.contains_many(values, std::span<bool>(results.get(), count));
+        for (size_t i = 0; i < count; ++i) {
+            if (results[i] != tree.contains(values[i])) {
+                return test_result(false, __func__);
+            }
+        }
+    }
+
+    return test_result(true, __func__);
+}
+
+test_result test_snapshot()
+{
+    AVL_tree<int> tree {};
+    std::mt19937 rng { 7 };
+    for (int i = 0; i < 2000; ++i) {
+        tree.add(static_cast<int>(rng() % 3000));
+    }
+
+    auto snapshot = tree.freeze();
+    if (!std::ranges::equal(snapshot, tree)) {
+        return test_result(false, __func__);
+    }
+    size_t total = 0;
+    for (auto it = tree.begin(); it != tree.end(); ++it) {
+        total += it.count();
+    }
+    if (snapshot.size() != total) {
+        return test_result(false, __func__);
+    }
+    for (int value = -1; value <= 3000; ++value) {
+        auto lower = tree.lower_bound(value);
+        auto upper = tree.upper_bound(value);
+        auto snapshot_lower = snapshot.lower_bound(value);
+        auto snapshot_upper = snapshot.upper_bound(value);
+        if (((lower == tree.end()) != (snapshot_lower == snapshot.end())) ||
+            ((lower != tree.end()) && (*lower != *snapshot_lower)) ||
+            ((upper == tree.end()) != (snapshot_upper == snapshot.end())) ||
+            ((upper != tree.end()) && (*upper != *snapshot_upper))) {
+            return test_result(false, __func__);
+        }
+        auto found = tree.find(value);
+        if (snapshot.count(value) != ((found == tree.end()) ? 0 : found.count())) {
+            return test_result(false, __func__);
+        }
+    }
+
+    auto thawed = snapshot.thaw();
+    if ((thawed.test_tree() != "") || !std::ranges::equal(thawed, tree)) {
+        return test_result(false, __func__);
+    }
+    for (auto it = thawed.begin(); it != thawed.end(); ++it) {
+        if (it.count() != tree.find(*it).count()) {
+            return test_result(false, __func__);
+        }
+    }
+
+    AVL_snapshot<int> empty_snapshot = AVL_tree<int>().freeze();
+    if (!empty_snapshot.empty() || (empty_snapshot.begin() != empty_snapshot.end()) ||
+        empty_snapshot.contains(0) || !empty_snapshot.thaw().empty()) {
+        return test_result(false, __func__);
+    }
+
+    return test_result(true, __func__);
+}
+
+/**
+ * @brief A stream buffer which cannot seek, like that of a pipe.
+ */
+struct unseekable_buffer : std::stringbuf {
+    using std::stringbuf::stringbuf;
+
+protected:
+    pos_type seekoff(off_type, std::ios::seekdir, std::ios::openmode) override
+    {
+        return pos_type(off_type(-1));
+    }
+
+    pos_type seekpos(pos_type, std::ios::openmode) override
+    {
+        return pos_type(off_type(-1));
+    }
+};
+
+test_result test_serialization()
+{
+    AVL_tree<int> tree {};
+    std::mt19937 rng { 11 };
+    for (int i = 0; i < 3000; ++i) {
+        tree.add(static_cast<int>(rng() % 5000));
+    }
+    auto same_counts = [&tree](auto const& other) {
+        for (auto it = other.begin(); it != other.end(); ++it) {
+            if (it.count() != tree.find(*it).count()) {
+                return false;
+            }
+        }
+        return std::ranges::equal(other, tree);
+    };
+
+    std::stringstream stream {};
+    if (tree.serialize(stream) != avl_file_statuses::SUCCESS) {
+        return test_result(false, __func__);
+    }
+    std::string image = stream.str();
+    auto read_tree = AVL_tree<int>::deserialize(stream);
+    if (!read_tree || (read_tree->test_tree() != "") || !same_counts(*read_tree)) {
+        return test_result(false, __func__);
+    }
+
+    auto read_snapshot = [](std::string const& bytes) {
+        std::istringstream in(bytes);
+        return AVL_snapshot<int>::deserialize(in);
+    };
+    auto status_of = [](auto const& result) {
+        return result ? avl_file_statuses::SUCCESS : result.error();
+    };
+    auto snapshot = read_snapshot(image);
+    if (!snapshot || !same_counts(*snapshot) || !snapshot->contains(*tree.begin())) {
+        return test_result(false, __func__);
+    }
+    std::string corrupt = image;
+    corrupt[corrupt.size() - 1] ^= 1;
+    std::string bad_magic = image;
+    bad_magic[0] = 'X';
+    std::string truncated = image.substr(0, image.size() - 1);
+    std::istringstream wrong_type_stream(image);
+    if ((status_of(read_snapshot(corrupt)) != avl_file_statuses::CORRUPT) ||
+        (status_of(read_snapshot(bad_magic)) != avl_file_statuses::BAD_MAGIC) ||
+        (status_of(read_snapshot(truncated)) != avl_file_statuses::IO_ERROR) ||
+        (status_of(read_snapshot("")) != avl_file_statuses::IO_ERROR) ||
+        (status_of(AVL_snapshot<int64_t>::deserialize(wrong_type_stream)) !=
+            avl_file_statuses::LAYOUT_MISMATCH)) {
+        return test_result(false, __func__);
+    }
+
+    // Header fields outside the checksum are checked against each other and the stream, and
+    // never size an allocation beyond what the stream holds.
+    auto with_field = [&image](size_t offset, uint64_t value) {
+        std::string changed = image;
+        std::memcpy(changed.data() + offset, &value, sizeof(value));
+        return changed;
+    };
+    size_t const unique_count_offset = offsetof(AVL_file_header, m_unique_count);
+    size_t const total_count_offset = offsetof(AVL_file_header, m_total_count);
+    size_t const file_size_offset = offsetof(AVL_file_header, m_file_size);
+    uint64_t huge_count = uint64_t { 1 } << 40;
+    std::string huge_claim = with_field(unique_count_offset, huge_count);
+    AVL_file_header huge_header {};
+    std::memcpy(&huge_header, huge_claim.data(), sizeof(huge_header));
+    huge_header.m_counts_offset = huge_header.m_values_offset + huge_count * sizeof(int);
+    huge_header.m_file_size = huge_header.m_counts_offset + huge_count * sizeof(uint32_t);
+    huge_header.m_total_count = huge_count;
+    std::memcpy(huge_claim.data(), &huge_header, sizeof(huge_header));
+    auto read_unseekable = [](std::string const& bytes) {
+        unseekable_buffer buffer(bytes);
+        std::istream in(&buffer);
+        return AVL_snapshot<int>::deserialize(in);
+    };
+    if ((status_of(read_snapshot(with_field(file_size_offset, UINT64_MAX / 4))) !=
+            avl_file_statuses::CORRUPT) ||
+        (status_of(read_snapshot(with_field(total_count_offset, snapshot->size() + 1))) !=
+            avl_file_statuses::CORRUPT) ||
+        (status_of(read_snapshot(with_field(unique_count_offset, huge_count))) !=
+            avl_file_statuses::CORRUPT) ||
+        (status_of(read_snapshot(huge_claim)) != avl_file_statuses::IO_ERROR) ||
+        (status_of(read_unseekable(huge_claim)) != avl_file_statuses::IO_ERROR) ||
+        (status_of(read_unseekable(truncated)) != avl_file_statuses::IO_ERROR) ||
+        !read_unseekable(image) || !same_counts(*read_unseekable(image))) {
+        return test_result(false, __func__);
+    }
+
+    // Past the first read, a stream of unknown length is read into a growing buffer.
+    std::vector<int> many(300000);
+    std::iota(many.begin(), many.end(), 0);
+    std::stringstream big_stream {};
+    AVL_tree<int>(from_sorted, many.begin(), many.end()).serialize(big_stream);
+    auto big = read_unseekable(big_stream.str());
+    if (!big || (big->size() != many.size()) || !big->contains(299999) || big->contains(300000)) {
+        return test_result(false, __func__);
+    }
+
+    std::stringstream empty_stream {};
+    AVL_tree<int>().serialize(empty_stream);
+    auto empty_tree = AVL_tree<int>::deserialize(empty_stream);
+    if (!empty_tree || !empty_tree->empty()) {
+        return test_result(false, __func__);
+    }
+
+#ifdef AVL_HAS_MMAP
+    std::string path = "avl_snapshot_test.bin";
+    std::ofstream(path, std::ios::binary) << image;
+    bool mapped_ok = false;
+    {
+        auto mapped = AVL_snapshot<int>::map_file(path.c_str());
+        // Copies share the mapping, which outlives the original.
+        std::optional<AVL_snapshot<int>> copy {};
+        if (mapped) {
+            copy = *mapped;
+        }
+        mapped = std::unexpected { avl_file_statuses::IO_ERROR };
+        mapped_ok = copy && same_counts(*copy) && (copy->size() == snapshot->size());
+    }
+    std::ofstream(path, std::ios::binary) << corrupt;
+    bool corrupt_rejected =
+        status_of(AVL_snapshot<int>::map_file(path.c_str())) == avl_file_statuses::CORRUPT;
+    std::remove(path.c_str());
+    if (!mapped_ok || !corrupt_rejected ||
+        AVL_snapshot<int>::map_file(path.c_str()).has_value()) {
+        return test_result(false, __func__);
+    }
+#endif // ifdef AVL_HAS_MMAP
+
+    return test_result(true, __func__);
+}
+
+test_result test_persistent_tree()
+{
+    // Every version is checked against a copy of the reference taken when it was made.
+    std::vector<persistent_AVL_tree<int>> versions { persistent_AVL_tree<int>() };
+    std::vector<std::multiset<int>> references { {} };
+    std::mt19937 rng { 5 };
+    for (int i = 0; i < 3000; ++i) {
+        int value = static_cast<int>(rng() % 500);
+        auto const& last = versions.back();
+        if (rng() % 3 == 0) {
+            versions.push_back(last.remove(value));
+            auto reference = references.back();
+            if (auto found = reference.find(value); found != reference.end()) {
+                reference.erase(found);
+            } else if (!versions.back().same_version(versions[versions.size() - 2])) {
+                return test_result(false, __func__);
+            }
+            references.push_back(std::move(reference));
+        } else {
+            versions.push_back(last.add(value));
+            references.push_back(references.back());
+            references.back().insert(value);
+        }
+    }
+    for (size_t i = 0; i < versions.size(); i += 97) {
+        auto const& version = versions[i];
+        auto const& reference = references[i];
+        auto unique = std::set<int>(reference.begin(), reference.end());
+        if ((version.test_tree() != "") || (version.size() != reference.size()) ||
+            !std::ranges::equal(version, unique)) {
+            return test_result(false, __func__);
+        }
+        for (int value = 0; value < 500; ++value) {
+            if (version.count(value) != reference.count(value)) {
+                return test_result(false, __func__);
+            }
+        }
+    }
+
+    // Readers keep using the versions they picked while the writer makes new ones.
+    std::vector<int> sorted(1000);
+    std::iota(sorted.begin(), sorted.end(), 0);
+    persistent_AVL_tree<int> base(from_sorted, sorted.begin(), sorted.end());
+    if ((base.test_tree() != "") || (base.size() != 1000) || !std::ranges::equal(base, sorted)) {
+        return test_result(false, __func__);
+    }
+    std::vector<int> shuffled { 5, 1, 4, 1, 3 };
+    persistent_AVL_tree<int> unsorted(shuffled.begin(), shuffled.end());
+    if ((unsorted.test_tree() != "") || (unsorted.size() != 5) || (unsorted.count(1) != 2)
+        || !std::ranges::equal(unsorted, std::vector { 1, 3, 4, 5 })) {
+        return test_result(false, __func__);
+    }
+    std::atomic<bool> is_failed = false;
+    std::vector<std::thread> readers {};
+    for (int r = 0; r < 3; ++r) {
+        readers.emplace_back([&is_failed, version = base] {
+            for (int round = 0; round < 20; ++round) {
+                for (int value = 0; value < 1000; ++value) {
+                    if (version.count(value) != 1) {
+                        is_failed = true;
+                    }
+                }
+            }
+        });
+    }
+    auto current = base;
+    for (int i = 0; i < 1000; ++i) {
+        current = current.remove(i).add(i + 1000);
+    }
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    if (is_failed || (current.test_tree() != "") || (current.size() != 1000) ||
+        current.contains(999) || !current.contains(1999) || (base.count(999) != 1)) {
+        return test_result(false, __func__);
+    }
+
+    return test_result(true, __func__);
+}
+
+test_result test_set_operations()
+{
+    using counted_tree =
+        AVL_tree<int, std::less<int>, std::allocator<int>, AVL_order_statistics_traits>;
+    std::mt19937 rng { 19 };
+    auto make_random = [&rng](size_t size, int range, std::multiset<int>& reference) {
+        std::vector<int> values(size);
+        for (auto& value : values) {
+            value = static_cast<int>(rng() % static_cast<unsigned>(range));
+        }
+        reference.insert(values.begin(), values.end());
+        return counted_tree(values.begin(), values.end());
+    };
+    auto matches = [](counted_tree& tree, std::multiset<int> const& reference) {
+        if ((tree.test_tree() != "") || (tree.size() != reference.size())) {
+            return false;
+        }
+        for (auto it = tree.begin(); it != tree.end(); ++it) {
+            if (it.count() != reference.count(*it)) {
+                return false;
+            }
+        }
+        return std::ranges::equal(tree, std::set<int>(reference.begin(), reference.end()));
+    };
+
+    // Sizes far apart and close, so that joins meet subtrees of very different heights.
+    for (auto [first_size, second_size] : { std::pair<size_t, size_t> { 3000, 20 }, { 20, 3000 },
+             { 1500, 1700 }, { 0, 100 }, { 100, 0 } }) {
+        std::multiset<int> first_values {}, second_values {};
+        auto first = make_random(first_size, 4000, first_values);
+        auto second = make_random(second_size, 4000, second_values);
+
+        std::multiset<int> expected = first_values;
+        expected.insert(second_values.begin(), second_values.end());
+        first.unite(counted_tree(second_values.begin(), second_values.end()));
+        if (!matches(first, expected)) {
+            return test_result(false, __func__);
+        }
+
+        expected.clear();
+        std::ranges::set_intersection(first_values, second_values,
+            std::inserter(expected, expected.end()));
+        auto intersected = counted_tree(first_values.begin(), first_values.end());
+        intersected.intersect(counted_tree(second_values.begin(), second_values.end()));
+        if (!matches(intersected, expected)) {
+            return test_result(false, __func__);
+        }
+
+        expected.clear();
+        std::ranges::set_difference(first_values, second_values,
+            std::inserter(expected, expected.end()));
+        auto subtracted = counted_tree(first_values.begin(), first_values.end());
+        subtracted.subtract(std::move(second));
+        if (!matches(subtracted, expected) || !second.empty()) {
+            return test_result(false, __func__);
+        }
+    }
+
+    std::multiset<int> values {};
+    auto tree = make_random(5000, 3000, values);
+    for (int pivot : { -1, 0, 1234, 2999, 3000 }) {
+        auto upper = tree.split(pivot);
+        std::multiset<int> lower_values(values.begin(), values.lower_bound(pivot));
+        std::multiset<int> upper_values(values.lower_bound(pivot), values.end());
+        if (!matches(tree, lower_values) || !matches(upper, upper_values)) {
+            return test_result(false, __func__);
+        }
+        tree.join(std::move(upper));
+        if (!matches(tree, values) || !upper.empty()) {
+            return test_result(false, __func__);
+        }
+    }
+
+    // Trees with separate pools cannot share nodes, so the values are copied over.
+    AVL_tree<int, std::less<int>, AVL_pool_allocator<int>> pooled {};
+    AVL_tree<int, std::less<int>, AVL_pool_allocator<int>> other_pooled {};
+    for (int i = 0; i < 100; ++i) {
+        pooled.add(i);
+        other_pooled.add(i + 50);
+    }
+    pooled.unite(std::move(other_pooled));
+    if ((pooled.test_tree() != "") || (pooled.find(75).count() != 2) ||
+        (pooled.find(149).count() != 1)) {
+        return test_result(false, __func__);
+    }
+
+    return test_result(true, __func__);
+}
+
+test_result test_parallel_operations()
+{
+    using counted_tree =
+        AVL_tree<int, std::less<int>, std::allocator<int>, AVL_order_statistics_traits>;
+    std::mt19937 rng { 23 };
+    // Long runs of equal values, so that chunks are cut at run boundaries.
+    std::vector<int> sorted(200000);
+    for (auto& value : sorted) {
+        value = static_cast<int>(rng() % 20000);
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    counted_tree tree(parallel, from_sorted, sorted.begin(), sorted.end());
+    counted_tree serial_tree(from_sorted, sorted.begin(), sorted.end());
+    if ((tree.test_tree() != "") || (tree.size() != sorted.size()) ||
+        !std::ranges::equal(tree, serial_tree)) {
+        return test_result(false, __func__);
+    }
+    for (auto it = tree.begin(), serial_it = serial_tree.begin(); it != tree.end();
+         ++it, ++serial_it) {
+        if (it.count() != serial_it.count()) {
+            return test_result(false, __func__);
+        }
+    }
+
+    std::atomic<uint64_t> sum = 0;
+    std::atomic<size_t> total = 0;
+    tree.for_each(parallel, [&sum, &total](int value, uint32_t count) {
+        sum += static_cast<uint64_t>(value) * count;
+        total += count;
+    });
+    std::vector<int> visited {};
+    tree.for_each([&visited](int value, uint32_t) { visited.push_back(value); });
+    if ((sum != std::accumulate(sorted.begin(), sorted.end(), uint64_t { 0 })) ||
+        (total != sorted.size()) || !std::ranges::equal(visited, serial_tree)) {
+        return test_result(false, __func__);
+    }
+
+    for (size_t size : { 0, 1, 2, 5 }) {
+        std::vector<int> small(size, 7);
+        AVL_tree<int> small_tree(parallel, from_sorted, small.begin(), small.end());
+        if ((small_tree.test_tree() != "") || (small_tree.empty() != (size == 0)) ||
+            ((size != 0) && (small_tree.find(7).count() != size))) {
+            return test_result(false, __func__);
+        }
+    }
+
+    return test_result(true, __func__);
+}
+
+test_result test_map()
+{
+    AVL_map<std::string, std::vector<int>, std::less<>> map {};
+    std::map<std::string, std::vector<int>> expected {};
+    std::mt19937 rng { 29 };
+    for (int i = 0; i < 5000; ++i) {
+        auto key = std::to_string(rng() % 300);
+        int value = static_cast<int>(rng() % 100);
+        switch (rng() % 4) {
+        case 0:
+            map[key].push_back(value);
+            expected[key].push_back(value);
+            break;
+        case 1:
+            map.insert_or_assign(key, std::vector<int> { value });
+            expected.insert_or_assign(key, std::vector<int> { value });
+            break;
+        case 2:
+            if (map.try_emplace(key, 2, value).second !=
+                expected.try_emplace(key, 2, value).second) {
+                return test_result(false, __func__);
+            }
+            break;
+        default:
+            if ((map.erase(key) == avl_statuses::SUCCESS) != (expected.erase(key) == 1)) {
+                return test_result(false, __func__);
+            }
+        }
+    }
+    if ((map.test_tree() != "") || (map.size() != expected.size()) ||
+        !std::ranges::equal(map, expected, [](auto const& entry, auto const& pair) {
+            return (entry.first == pair.first) && (entry.second == pair.second);
+        })) {
+        return test_result(false, __func__);
+    }
+
+    // Values are updated in place through find(), and looked up by string_view.
+    for (auto const& [key, value] : expected) {
+        auto it = map.find(std::string_view(key));
+        if ((it == map.end()) || (it->second != value)) {
+            return test_result(false, __func__);
+        }
+        it->second.push_back(-1);
+    }
+    for (auto const& [key, value] : map) {
+        if (value.back() != -1) {
+            return test_result(false, __func__);
+        }
+    }
+    if (map.contains("x") || (map.find("x") != map.end()) ||
+        (map.erase(std::string_view("x")) != avl_statuses::VALUE_NOT_FOUND)) {
+        return test_result(false, __func__);
+    }
+
+    // try_emplace leaves a moved-from key untouched when the key exists.
+    std::string key = expected.begin()->first;
+    if (map.try_emplace(std::move(key)).second || (key != expected.begin()->first)) {
+        return test_result(false, __func__);
+    }
+
+    return test_result(true, __func__);
+}
+
+test_result test_statistics()
+{
+    // Without statistics, the tree has no counters at all.
+    if (sizeof(AVL_tree<int>) + sizeof(AVL_tree_stats) !=
+        sizeof(AVL_tree<int, std::less<int>, std::allocator<int>, AVL_statistics_traits>)) {
+        return test_result(false, __func__);
+    }
+
+    AVL_tree<int, std::less<int>, std::allocator<int>, AVL_statistics_traits> tree {};
+    // Ascending adds rotate at every other level, never with a double rotation.
+    for (int i = 0; i < 1024; ++i) {
+        tree.add(i);
+    }
+    auto stats = tree.stats();
+    if ((stats.adds != 1024) || (stats.duplicate_adds != 0) || (stats.double_rotations != 0) ||
+        (stats.single_rotations != 1024 - 11) || (stats.retraces != 1023) ||
+        (stats.searches != 1024) || (stats.hits != 0)) {
+        return test_result(false, __func__);
+    }
+
+    tree.reset_stats();
+    tree.add(5);
+    bool found = tree.contains(5) && !tree.contains(-1);
+    tree.remove(5);
+    tree.remove(5);
+    tree.remove(-1);
+    stats = tree.stats();
+    uint64_t histogram_total = 0;
+    for (auto searches : stats.depth_histogram) {
+        histogram_total += searches;
+    }
+    // A miss in a tree of height h visits h nodes at most.
+    if (!found || (stats.adds != 1) || (stats.duplicate_adds != 1) || (stats.removes != 2) ||
+        (stats.searches != 6) || (stats.hits != 4) || (stats.misses != 2) ||
+        (histogram_total != stats.searches) || (stats.depth_histogram[0] != 0) ||
+        (tree.test_tree() != "")) {
+        return test_result(false, __func__);
+    }
+
+    return test_result(true, __func__);
+}
+
+test_result test_validation()
+{
+    AVL_tree<int> tree {};
+    if ((tree.height() != 0) || (tree.validate() != "")) {
+        return test_result(false, __func__);
+    }
+    // Ascending adds fill every level of a 2^k - 1 node AVL tree.
+    for (int i = 0; i < 1023; ++i) {
+        tree.add(i);
+    }
+    if ((tree.height() != 10) || (tree.validate() != "") || (tree.validate(parallel) != "")) {
+        return test_result(false, __func__);
+    }
+
+    // An AVL tree of n nodes is at least log2(n + 1) and below 1.45 log2(n + 2) high.
+    auto height_in_bounds = [](AVL_tree<int> const& checked, size_t unique_count) {
+        auto lowest = std::bit_width(unique_count);
+        auto highest = static_cast<size_t>(1.45 * std::log2(static_cast<double>(unique_count + 2)));
+        return (checked.height() >= lowest) && (checked.height() <= highest) &&
+            (checked.validate() == "") && (checked.validate(parallel) == "");
+    };
+    std::mt19937 rng { 23 };
+    std::set<int> reference(tree.begin(), tree.end());
+    for (int i = 0; i < 20000; ++i) {
+        int value = static_cast<int>(rng() % 4000);
+        // Counts stay at 1, so that every remove takes its node out.
+        if (rng() % 2 == 0) {
+            if (reference.insert(value).second) {
+                tree.add(value);
+            }
+        } else {
+            tree.remove(value);
+            reference.erase(value);
+        }
+        if ((i % 1000 == 0) && !height_in_bounds(tree, reference.size())) {
+            return test_result(false, __func__);
+        }
+    }
+    while (!reference.empty()) {
+        tree.remove(*reference.begin());
+        reference.erase(reference.begin());
+    }
+    if ((tree.height() != 0) || (tree.validate() != "")) {
+        return test_result(false, __func__);
+    }
+
+    std::vector<int> sorted(5000);
+    std::iota(sorted.begin(), sorted.end(), 0);
+    AVL_tree<int> built(from_sorted, sorted.begin(), sorted.end());
+    AVL_tree<int> built_parallel(parallel, from_sorted, sorted.begin(), sorted.end());
+    if ((built.height() != 13) || !height_in_bounds(built, 5000) ||
+        (built_parallel.height() != 13) || !height_in_bounds(built_parallel, 5000)) {
+        return test_result(false, __func__);
+    }
+    auto upper = built.split(1234);
+    if (!height_in_bounds(built, 1234) || !height_in_bounds(upper, 5000 - 1234)) {
+        return test_result(false, __func__);
+    }
+    built.unite(std::move(upper));
+    if (!height_in_bounds(built, 5000) || (upper.height() != 0)) {
+        return test_result(false, __func__);
+    }
+
+    return test_result(true, __func__);
+}
+
+test_result test_clear()
+{
+    AVL_tree<std::string> strings {};
+    for (int i = 0; i < 5000; ++i) {
+        strings.add(std::to_string(i) + std::string(32, 'x'));
+    }
+    strings.clear();
+    if (!strings.empty() || (strings.height() != 0) || (strings.begin() != strings.end())) {
+        return test_result(false, __func__);
+    }
+    strings.add("reused");
+    if (!strings.contains("reused") || (strings.validate() != "")) {
+        return test_result(false, __func__);
+    }
+
+    // Nodes of ints need no destruction, so a tree solely owning its pool drops the slabs.
+    AVL_tree<int, std::less<int>, AVL_pool_allocator<int>> pooled {};
+    for (int i = 0; i < 5000; ++i) {
+        pooled.add(i);
+    }
+    if (pooled.get_allocator().pool().reserved_bytes() == 0) {
+        return test_result(false, __func__);
+    }
+    pooled.clear();
+    if (!pooled.empty() || (pooled.get_allocator().pool().reserved_bytes() != 0)) {
+        return test_result(false, __func__);
+    }
+    for (int i = 0; i < 100; ++i) {
+        pooled.add(i);
+    }
+
+    // A shared pool is left alone, the nodes are freed one by one onto its free list.
+    AVL_pool_allocator<int> alloc {};
+    AVL_tree<int, std::less<int>, AVL_pool_allocator<int>> shared { alloc };
+    for (int i = 0; i < 5000; ++i) {
+        shared.add(i);
+    }
+    auto reserved = alloc.pool().reserved_bytes();
+    shared.clear();
+    for (int i = 0; i < 5000; ++i) {
+        shared.add(i);
+    }
+    if ((alloc.pool().reserved_bytes() != reserved) || !pooled.contains(99) ||
+        (shared.validate() != "") || (pooled.validate() != "")) {
+        return test_result(false, __func__);
+    }
+
+    AVL_map<int, std::string> map {};
+    map[1] = "one";
+    map.clear();
+    if (!map.empty() || map.contains(1)) {
+        return test_result(false, __func__);
+    }
+
+    return test_result(true, __func__);
+}
+
+test_result test_finger_search()
+{
+    // An ascending run is linked right after the last added value, with a single comparison.
+    AVL_tree<int, std::less<int>, std::allocator<int>, AVL_statistics_traits> appended {};
+    for (int i = 0; i < 10000; ++i) {
+        appended.add(i);
+    }
+    if ((appended.stats().depth_histogram[1] != 9999) || (appended.validate() != "")) {
+        return test_result(false, __func__);
+    }
+
+    // The last added value and its successor are forgotten once removed.
+    AVL_tree<int> tree {};
+    for (int value : { 10, 20, 15 }) {
+        tree.add(value);
+    }
+    tree.remove(20);
+    tree.add(30);
+    tree.add(25);
+    tree.remove(25);
+    tree.add(27);
+    if ((tree.validate() != "") || !std::ranges::equal(tree, std::vector { 10, 15, 27, 30 })) {
+        return test_result(false, __func__);
+    }
+
+    // Nearly sorted timestamps, each added with the previous one as hint.
+    std::mt19937 rng { 25 };
+    std::multiset<int> reference {};
+    AVL_tree<int> hinted {};
+    auto hint = hinted.end();
+    for (int i = 0; i < 20000; ++i) {
+        int value = i - static_cast<int>(rng() % 20);
+        hint = hinted.insert(hint, value).first;
+        reference.insert(value);
+        if (*hint != value) {
+            return test_result(false, __func__);
+        }
+    }
+    // Descending values, hinted and not.
+    for (int i = 0; i > -5000; --i) {
+        hint = hinted.insert(hint, i * 3).first;
+        hinted.add(hinted.end(), i * 3 + 1);
+        hinted.add(i * 3 + 2);
+        reference.insert({ i * 3, i * 3 + 1, i * 3 + 2 });
+    }
+    if ((hinted.validate() != "") ||
+        !std::ranges::equal(hinted, std::set<int>(reference.begin(), reference.end()))) {
+        return test_result(false, __func__);
+    }
+    for (auto it = hinted.begin(); it != hinted.end(); ++it) {
+        if (it.count() != reference.count(*it)) {
+            return test_result(false, __func__);
+        }
+    }
+
+    // Searches from a finger find what searches from the root find, in both directions.
+    for (int i = 0; i < 2000; ++i) {
+        int from = static_cast<int>(rng() % 40000) - 20000;
+        int to = static_cast<int>(rng() % 40000) - 20000;
+        auto finger = hinted.lower_bound(from);
+        if (hinted.find(finger, to) != hinted.find(to)) {
+            return test_result(false, __func__);
+        }
+    }
+
+    return test_result(true, __func__);
+}
+
+static size_t recorded_node_size = 0;
+
+/**
+ * @brief std::allocator which records the size of what it allocates last, to measure nodes.
+ */
+template <typename T>
+struct size_recording_allocator : std::allocator<T> {
+    using value_type = T;
+
+    size_recording_allocator() = default;
+    template <typename U>
+    size_recording_allocator(size_recording_allocator<U> const&)
+    {
+    }
+
+    T* allocate(size_t n)
+    {
+        recorded_node_size = sizeof(T);
+        return std::allocator<T>::allocate(n);
+    }
+};
+
+template <typename T, typename Traits = AVL_default_traits>
+size_t node_size()
+{
+    AVL_tree<T, std::less<T>, size_recording_allocator<T>, Traits> tree {};
+    tree.add(T {});
+    return recorded_node_size;
+}
+
+test_result test_set_mode()
+{
+    // A set's nodes have no count, and small values fill the padding after the balance.
+    if ((node_size<int, AVL_set_traits>() >= node_size<int>()) ||
+        (node_size<char>() > node_size<int, AVL_set_traits>()) ||
+        (node_size<char, AVL_set_traits>() > node_size<char>())) {
+        return test_result(false, __func__);
+    }
+
+    AVL_tree<int, std::less<int>, std::allocator<int>, AVL_set_traits> set {};
+    std::mt19937 rng { 26 };
+    std::set<int> reference {};
+    for (int i = 0; i < 10000; ++i) {
+        int value = static_cast<int>(rng() % 3000);
+        bool is_new = reference.insert(value).second;
+        auto [it, is_added] = set.insert(value);
+        if ((is_added != is_new) || (*it != value) || (it.count() != 1)) {
+            return test_result(false, __func__);
+        }
+    }
+    if ((set.validate() != "") || !std::ranges::equal(set, reference)) {
+        return test_result(false, __func__);
+    }
+    // A single remove takes a value out, however many times it was added.
+    set.add(5);
+    set.add(5);
+    set.remove(5);
+    if (set.contains(5)) {
+        return test_result(false, __func__);
+    }
+
+    // Duplicates across or within the inputs keep a single copy.
+    std::vector<int> with_duplicates { 1, 1, 2, 3, 3, 3, 8 };
+    using set_type = AVL_tree<int, std::less<int>, std::allocator<int>, AVL_set_traits>;
+    set_type sorted(from_sorted, with_duplicates.begin(), with_duplicates.end());
+    sorted.unite(set_type(from_sorted, with_duplicates.begin() + 2, with_duplicates.end()));
+    set_type intersected(from_sorted, with_duplicates.begin(), with_duplicates.end());
+    intersected.intersect(set_type(with_duplicates.begin() + 3, with_duplicates.end()));
+    sorted.subtract(set_type({ 2 }));
+    bool has_single_counts = true;
+    sorted.for_each([&](int, uint32_t count) { has_single_counts &= count == 1; });
+    if (!has_single_counts || !std::ranges::equal(sorted, std::vector { 1, 3, 8 }) ||
+        !std::ranges::equal(intersected, std::vector { 3, 8 }) || (sorted.validate() != "")) {
+        return test_result(false, __func__);
+    }
+
+    // Small keys search with selects instead of branches.
+    AVL_tree<char> chars {};
+    AVL_tree<uint64_t> wide {};
+    for (int i = 0; i < 1000; ++i) {
+        chars.add(static_cast<char>(rng() % 64));
+        wide.add(rng() % 5000);
+    }
+    for (int i = 0; i < 128; ++i) {
+        auto value = static_cast<char>(i);
+        if (chars.contains(value) != (std::ranges::find(chars, value) != chars.end())) {
+            return test_result(false, __func__);
+        }
+    }
+    for (uint64_t i = 0; i < 5000; ++i) {
+        if (wide.contains(i) != (std::ranges::find(wide, i) != wide.end())) {
+            return test_result(false, __func__);
+        }
+    }
+
+    return test_result(true, __func__);
+}
+
+struct lazy_counted_traits : AVL_lazy_removes_traits {
+    static constexpr bool order_statistics = true;
+    static constexpr bool statistics = true;
+};
+
+struct lazy_set_traits : AVL_lazy_removes_traits {
+    static constexpr bool multiset = false;
+};
+
+test_result test_lazy_removes()
+{
+    using lazy_tree = AVL_tree<int, std::less<int>, std::allocator<int>, lazy_counted_traits>;
+    std::mt19937 rng { 27 };
+    lazy_tree tree {};
+    std::multiset<int> reference {};
+    auto matches = [&]() {
+        if ((tree.validate() != "") || (tree.size() != reference.size()) ||
+            !std::ranges::equal(tree, std::set<int>(reference.begin(), reference.end())) ||
+            !std::ranges::equal(tree | std::views::reverse,
+                std::set<int>(reference.begin(), reference.end()) | std::views::reverse)) {
+            return false;
+        }
+        for (int value = -1; value <= 2001; value += 7) {
+            auto lower = reference.lower_bound(value);
+            auto upper = reference.upper_bound(value);
+            if ((tree.contains(value) != reference.contains(value)) ||
+                ((tree.find(value) == tree.end()) == reference.contains(value)) ||
+                ((tree.lower_bound(value) == tree.end()) != (lower == reference.end())) ||
+                ((lower != reference.end()) && (*tree.lower_bound(value) != *lower)) ||
+                ((upper != reference.end()) && (*tree.upper_bound(value) != *upper)) ||
+                (tree.rank(value) !=
+                    static_cast<size_t>(std::distance(reference.begin(), lower)))) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    for (int round = 0; round < 20; ++round) {
+        for (int i = 0; i < 500; ++i) {
+            int value = static_cast<int>(rng() % 2000);
+            tree.add(value);
+            reference.insert(value);
+        }
+        // Removes do no rotation, and revived values come back as new nodes.
+        tree.reset_stats();
+        for (int i = 0; i < 450; ++i) {
+            int value = static_cast<int>(rng() % 2000);
+            auto it = reference.find(value);
+            if ((tree.remove(value) == avl_statuses::SUCCESS) != (it != reference.end())) {
+                return test_result(false, __func__);
+            }
+            if (it != reference.end()) {
+                reference.erase(it);
+            }
+        }
+        auto stats = tree.stats();
+        if ((stats.single_rotations != 0) || (stats.double_rotations != 0) || !matches()) {
+            return test_result(false, __func__);
+        }
+    }
+    if (tree.select(reference.size() / 2) == tree.end() ||
+        (*tree.select(reference.size() / 2) !=
+            *std::next(reference.begin(), static_cast<long>(reference.size() / 2)))) {
+        return test_result(false, __func__);
+    }
+
+    // The batches and the bulk operations skip or drop the vacant nodes.
+    std::vector<int> batch { 3, 5, 7, 11, 13 };
+    for (int value : batch) {
+        while (tree.remove(value) == avl_statuses::SUCCESS) {
+            reference.erase(reference.find(value));
+        }
+    }
+    std::unique_ptr<bool[]> results(new bool[batch.size()]);
+    tree.contains_batch(batch, std::span<bool>(results.get(), batch.size()));
+    bool is_any_found = std::any_of(results.get(), results.get() + batch.size(), std::identity {});
+    tree.contains_many(batch, std::span<bool>(results.get(), batch.size()));
+    is_any_found |= std::any_of(results.get(), results.get() + batch.size(), std::identity {});
+    if (is_any_found || (tree.remove_batch(batch) != 0) || !matches()) {
+        return test_result(false, __func__);
+    }
+    // A batch large enough to rebuild the tree while it runs.
+    using lazy_ops_tree =
+        AVL_tree<int, std::less<int>, std::allocator<int>, AVL_lazy_removes_traits>;
+    lazy_ops_tree rebuilt {};
+    std::vector<int> rebuilt_batch {};
+    for (int i = 0; i < 100; ++i) {
+        rebuilt.add(i);
+        if (i % 5 != 0) {
+            rebuilt_batch.push_back(i);
+        }
+    }
+    if ((rebuilt.remove_batch(rebuilt_batch) != 80) || (rebuilt.validate() != "") ||
+        !std::ranges::equal(rebuilt, std::views::iota(0, 20) | std::views::transform([](int i) {
+            return i * 5;
+        }))) {
+        return test_result(false, __func__);
+    }
+
+    auto upper = tree.split(1000);
+    tree.join(std::move(upper));
+    tree.remove(*reference.begin());
+    reference.erase(reference.begin());
+    if (!matches()) {
+        return test_result(false, __func__);
+    }
+
+    // Removing everything leaves an empty tree, through the rebuilds.
+    while (!reference.empty()) {
+        tree.remove(*reference.begin());
+        reference.erase(reference.begin());
+    }
+    if (!tree.empty() || (tree.height() != 0) || (tree.begin() != tree.end()) || !matches()) {
+        return test_result(false, __func__);
+    }
+
+    // A lazy set keeps single counts through removes, revivals and unions.
+    using lazy_set = AVL_tree<int, std::less<int>, std::allocator<int>, lazy_set_traits>;
+    lazy_set set {};
+    for (int value : { 1, 2, 3, 4, 5, 6 }) {
+        set.add(value);
+    }
+    set.remove(2);
+    set.add(2);
+    set.add(2);
+    set.remove(4);
+    set.unite(lazy_set(from_sorted, batch.begin(), batch.end()));
+    bool has_single_counts = true;
+    set.for_each([&](int, uint32_t count) { has_single_counts &= count == 1; });
+    if (!has_single_counts || (set.validate() != "") ||
+        !std::ranges::equal(set, std::vector { 1, 2, 3, 5, 6, 7, 11, 13 })) {
+        return test_result(false, __func__);
+    }
+
+    // rebalance() gives any tree the minimal height.
+    AVL_tree<int> eager {};
+    for (int i = 0; i < 1000; ++i) {
+        eager.add(static_cast<int>(rng() % 100000));
+    }
+    eager.rebalance();
+    if ((eager.height() != 10) || (eager.validate() != "")) {
+        return test_result(false, __func__);
+    }
+
+    return test_result(true, __func__);
+}
+
+test_result test_merge_cursor()
+{
+    std::mt19937 rng { 28 };
+    std::map<int, uint32_t> reference {};
+    std::vector<AVL_tree<int>> trees(3);
+    for (auto& tree : trees) {
+        for (int i = 0; i < 1500; ++i) {
+            int value = static_cast<int>(rng() % 3000);
+            tree.add(value);
+            ++reference[value];
+        }
+    }
+    AVL_tree<int> frozen {};
+    for (int i = 0; i < 1000; ++i) {
+        int value = static_cast<int>(rng() % 4000);
+        frozen.add(value);
+        ++reference[value];
+    }
+    auto snapshot = frozen.freeze();
+    // Equal values of a range without counts add up one at a time.
+    std::vector<int> run {};
+    for (int i = 0; i < 800; ++i) {
+        run.push_back(static_cast<int>(rng() % 5000));
+        ++reference[run.back()];
+    }
+    std::ranges::sort(run);
+
+    AVL_merge_cursor<int> cursor {};
+    if (!cursor.at_end() || (cursor.begin() != cursor.end())) {
+        return test_result(false, __func__);
+    }
+    for (auto const& tree : trees) {
+        cursor.add_source(tree);
+    }
+    cursor.add_source(snapshot);
+    cursor.add_source(run);
+    cursor.add_source(AVL_tree<int>());
+    auto matches_from = [&](int key) {
+        cursor.seek(key);
+        auto expected = reference.lower_bound(key);
+        for (auto it = cursor.begin(); it != cursor.end(); ++it, ++expected) {
+            if ((expected == reference.end()) || (*it != expected->first) ||
+                (it.count() != expected->second)) {
+                return false;
+            }
+        }
+        return expected == reference.end();
+    };
+    if ((cursor.source_count() != 6) || !matches_from(-1) || !matches_from(4999) ||
+        !matches_from(2500) || !matches_from(17) || !matches_from(6000)) {
+        return test_result(false, __func__);
+    }
+    cursor.rewind();
+    if (cursor.at_end() || (cursor.value() != reference.begin()->first) ||
+        (cursor.count() != reference.begin()->second)) {
+        return test_result(false, __func__);
+    }
+
+    // Subranges are stored in the cursor.
+    AVL_merge_cursor<int> upper_halves {};
+    for (auto const& tree : trees) {
+        upper_halves.add_source(std::ranges::subrange(tree.lower_bound(1500), tree.end()));
+    }
+    AVL_tree<int> merged {};
+    for (auto it = upper_halves.begin(); it != upper_halves.end(); ++it) {
+        for (uint32_t i = 0; i < it.count(); ++i) {
+            merged.add(*it);
+        }
+    }
+    auto counts_match = [&]() {
+        for (auto [value, count] : reference) {
+            uint32_t expected = 0;
+            for (auto const& tree : trees) {
+                auto found = tree.find(value);
+                expected += (found == tree.end() || value < 1500) ? 0 : found.count();
+            }
+            auto found = merged.find(value);
+            if (expected != ((found == merged.end()) ? 0 : found.count())) {
+                return false;
+            }
+        }
+        return true;
+    };
+    if ((merged.validate() != "") || !counts_match()) {
+        return test_result(false, __func__);
+    }
+
+#ifdef AVL_HAS_MMAP
+    std::string path = "avl_merge_test.bin";
+    {
+        std::ofstream out(path, std::ios::binary);
+        snapshot.serialize(out);
+    }
+    bool mapped_ok = false;
+    {
+        auto mapped = AVL_snapshot<int>::map_file(path.c_str());
+        if (mapped) {
+            AVL_merge_cursor<int> runs {};
+            runs.add_source(*mapped);
+            runs.add_source(snapshot);
+            mapped_ok = std::ranges::equal(runs, frozen) && (runs.count() == 0);
+            runs.seek(*frozen.begin());
+            mapped_ok &= runs.count() == 2 * frozen.begin().count();
+        }
+    }
+    std::remove(path.c_str());
+    if (!mapped_ok) {
+        return test_result(false, __func__);
+    }
+#endif // ifdef AVL_HAS_MMAP
+
+    return test_result(true, __func__);
+}
+
+test_result test_incremental_operations()
+{
+    std::mt19937 rng { 30 };
+    auto random_tree = [&rng](int values) {
+        AVL_tree<int, std::less<int>, std::allocator<int>, AVL_order_statistics_traits> tree {};
+        for (int i = 0; i < values; ++i) {
+            tree.add(static_cast<int>(rng() % 5000));
+        }
+        return tree;
+    };
+
+    // The tree is empty at once and stays usable while its nodes are freed, the values added
+    // meanwhile staying in it.
+    auto tree = random_tree(5000);
+    tree.clear_incremental();
+    if (!tree.empty() || (tree.height() != 0)) {
+        return test_result(false, __func__);
+    }
+    tree.add(7);
+    tree.add(3);
+    int steps = 0;
+    while (!tree.clear_step(100)) {
+        steps += 1;
+        if (steps == 10) {
+            tree.clear_incremental();
+        }
+        tree.add(steps);
+    }
+    // At most a rotation and a free per node.
+    if ((steps < 50) || (steps > 101) || (tree.validate() != "") ||
+        !std::ranges::equal(tree, std::views::iota(10, steps + 1))) {
+        return test_result(false, __func__);
+    }
+    auto left_half_freed = random_tree(1000);
+    left_half_freed.clear_incremental();
+    left_half_freed.clear_step(500);
+
+    // unite_step() keeps both trees valid, and ends like unite().
+    auto first = random_tree(3000);
+    auto second = random_tree(3000);
+    std::multiset<int> reference(first.begin(), first.end());
+    for (auto it = second.begin(); it != second.end(); ++it) {
+        reference.insert(*it);
+        for (uint32_t i = 1; i < it.count(); ++i) {
+            reference.insert(*it);
+        }
+    }
+    for (auto it = first.begin(); it != first.end(); ++it) {
+        for (uint32_t i = 1; i < it.count(); ++i) {
+            reference.insert(*it);
+        }
+    }
+    while (!first.unite_step(second, 256)) {
+        if ((first.validate() != "") || (second.validate() != "")) {
+            return test_result(false, __func__);
+        }
+    }
+    if (!second.empty() || (first.size() != reference.size()) ||
+        !std::ranges::equal(first, std::set<int>(reference.begin(), reference.end()))) {
+        return test_result(false, __func__);
+    }
+
+    // A lazy source tree keeps its vacant nodes from outnumbering the others while it empties.
+    using lazy_tree = AVL_tree<int, std::less<int>, std::allocator<int>, lazy_counted_traits>;
+    lazy_tree lazy_first {};
+    lazy_tree lazy_second {};
+    std::multiset<int> lazy_union {};
+    for (int i = 0; i < 2000; ++i) {
+        int value = static_cast<int>(rng() % 3000);
+        (i % 2 == 0 ? lazy_first : lazy_second).add(value);
+        lazy_union.insert(value);
+    }
+    for (int value = 1500; value < 3000; value += 2) {
+        while (lazy_second.remove(value) == avl_statuses::SUCCESS) {
+            lazy_union.erase(lazy_union.find(value));
+        }
+    }
+    while (!lazy_first.unite_step(lazy_second, 50)) {
+        if ((lazy_first.validate() != "") || (lazy_second.validate() != "")) {
+            return test_result(false, __func__);
+        }
+    }
+    if ((lazy_first.validate() != "") || (lazy_first.size() != lazy_union.size()) ||
+        !std::ranges::equal(lazy_first, std::set<int>(lazy_union.begin(), lazy_union.end()))) {
+        return test_result(false, __func__);
+    }
+
+    // rebuild_step() drops the vacant nodes without rebuilding, by eager unlinks.
+    lazy_tree lazy {};
+    std::set<int> lazy_reference {};
+    for (int i = 0; i < 4000; ++i) {
+        lazy.add(i);
+        lazy_reference.insert(i);
+    }
+    for (int i = 0; i < 1900; ++i) {
+        int value = static_cast<int>(rng() % 4000);
+        lazy.remove(value);
+        lazy_reference.erase(value);
+    }
+    int rebuild_steps = 0;
+    while (!lazy.rebuild_step(100)) {
+        rebuild_steps += 1;
+        if ((rebuild_steps % 8 == 0) && ((lazy.validate() != "") ||
+                                            !std::ranges::equal(lazy, lazy_reference))) {
+            return test_result(false, __func__);
+        }
+        // Updates between the steps.
+        lazy.add(5000 + rebuild_steps);
+        lazy_reference.insert(5000 + rebuild_steps);
+        lazy.remove(*lazy_reference.begin());
+        lazy_reference.erase(lazy_reference.begin());
+    }
+    if ((lazy.validate() != "") || !std::ranges::equal(lazy, lazy_reference) ||
+        (lazy.height() > 13) || (rebuild_steps < 35) || !lazy.rebuild_step(1)) {
+        return test_result(false, __func__);
+    }
+
+    // The jobs run a step per resume() until done.
+    auto clear_job = first.clear_job(1000);
+    if (!first.empty()) {
+        return test_result(false, __func__);
+    }
+    int resumes = 0;
+    while (clear_job.resume()) {
+        resumes += 1;
+        first.add(-resumes);
+    }
+    for (int i = 1; i <= resumes; ++i) {
+        first.remove(-i);
+    }
+    auto third = random_tree(2000);
+    auto third_values = std::set<int>(third.begin(), third.end());
+    auto unite_job = first.unite_job(std::move(third), 100);
+    while (unite_job.resume()) { }
+    for (int i = 0; i < 1000; ++i) {
+        lazy.remove(i);
+        lazy_reference.erase(i);
+    }
+    auto rebuild_job = lazy.rebuild_job(64);
+    while (rebuild_job.resume()) { }
+    if ((resumes == 0) || !clear_job.done() || clear_job.resume() ||
+        !std::ranges::equal(first, third_values) || (first.validate() != "") ||
+        !std::ranges::equal(lazy, lazy_reference) || (lazy.validate() != "")) {
+        return test_result(false, __func__);
+    }
+
+    return test_result(true, __func__);
+}
+
 static const auto tests = {
     test_visual_outcome,
     test_big_tree_visual,
     // test_no_comparison_class,
     test_compiles_with_custom_type,
     test_add_contains,
+    test_pool_allocator,
+    test_compact_tree,
+    test_build_from_sorted,
+    test_iterators,
+    test_range_queries,
+    test_transparent_lookup,
+    test_insert_and_emplace,
+    test_random_operations,
+    test_order_statistics,
+    test_concurrent_tree,
+    test_sharded_tree,
+    test_batch_operations,
+    test_contains_many,
+    test_snapshot,
+    test_serialization,
+    test_persistent_tree,
+    test_set_operations,
+    test_parallel_operations,
+    test_map,
+    test_statistics,
+    test_validation,
+    test_clear,
+    test_finger_search,
+    test_set_mode,
+    test_lazy_removes,
+    test_merge_cursor,
+    test_incremental_operations,
 };
 
 int main()